@@ -5,10 +5,17 @@
 */
 
 #include <QMutex>
+#include <QMap>
+#include <QThreadStorage>
 #include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QSet>
+#include <QPair>
 #include <QDataStream>
 #include <QTextStream>
 #include <cmath>
+#include <cfloat>
 #include <algorithm>
 
 #include "calcs.h"
@@ -26,530 +33,1239 @@ bool SearchApnea(Session *session, qint64 time, qint64 dist)
     return false;
 }
 
-// Sort BreathPeak by peak index
-bool operator<(const BreathPeak & p1, const BreathPeak & p2)
+static QThreadStorage<CalcSettings *> localSettings;
+
+CalcSettings::CalcSettings()
 {
-    return p1.start < p2.start;
+    ahiWindow=60;
+    ahiReset=false;
+    userEventFlagging=false;
+    userEventDuration=0;
+    userEventDuplicates=false;
+    userFlowRestriction=0;
+    spO2DropDuration=0;
+    spO2DropPercentage=0;
+    pulseChangeDuration=0;
+    pulseChangeBPM=0;
+    clockDrift=0;
+    compressSessionData=false;
+}
+
+CalcSettings::CalcSettings(const CalcSettings & copy)
+{
+    ahiWindow=copy.ahiWindow;
+    ahiReset=copy.ahiReset;
+    userEventFlagging=copy.userEventFlagging;
+    userEventDuration=copy.userEventDuration;
+    userEventDuplicates=copy.userEventDuplicates;
+    userFlowRestriction=copy.userFlowRestriction;
+    spO2DropDuration=copy.spO2DropDuration;
+    spO2DropPercentage=copy.spO2DropPercentage;
+    pulseChangeDuration=copy.pulseChangeDuration;
+    pulseChangeBPM=copy.pulseChangeBPM;
+    clockDrift=copy.clockDrift;
+    compressSessionData=copy.compressSessionData;
+    maskProfileFile=copy.maskProfileFile;
+}
+
+void CalcSettings::load(Profile * profile)
+{
+    if (!profile) return;
+    ahiWindow=profile->cpap->AHIWindow();
+    ahiReset=profile->cpap->AHIReset();
+    userEventFlagging=profile->cpap->userEventFlagging();
+    userEventDuration=profile->cpap->userEventDuration();
+    userEventDuplicates=profile->cpap->userEventDuplicates();
+    userFlowRestriction=profile->cpap->userFlowRestriction();
+    spO2DropDuration=profile->oxi->spO2DropDuration();
+    spO2DropPercentage=profile->oxi->spO2DropPercentage();
+    pulseChangeDuration=profile->oxi->pulseChangeDuration();
+    pulseChangeBPM=profile->oxi->pulseChangeBPM();
+    clockDrift=profile->cpap->clockDrift();
+    compressSessionData=profile->session->compressSessionData();
+    maskProfileFile=profile->Get("{"+STR_GEN_DataFolder+"}/MaskProfile.mp");
+}
+
+CalcSettings CalcSettings::current()
+{
+    if (localSettings.hasLocalData())
+        return *localSettings.localData();
+    CalcSettings settings;
+    settings.load(p_profile);
+    return settings;
+}
+
+int CalcSettings::currentClockDrift()
+{
+    if (localSettings.hasLocalData())
+        return localSettings.localData()->clockDrift;
+    return p_profile ? p_profile->cpap->clockDrift() : 0;
+}
+
+void CalcSettings::setLocal(const CalcSettings & settings)
+{
+    if (localSettings.hasLocalData()) {
+        *localSettings.localData()=settings;
+    } else {
+        localSettings.setLocalData(new CalcSettings(settings));
+    }
+}
+
+void CalcSettings::clearLocal()
+{
+    // QThreadStorage deletes the old snapshot
+    localSettings.setLocalData(NULL);
+}
+
+PercentileEngine::PercentileEngine()
+{
+    m_hist.fill(0,num_buckets);
+    m_low=num_buckets;
+    m_high=-1;
+    m_count=0;
+}
+
+void PercentileEngine::clear()
+{
+    if (m_high >= m_low) {
+        memset(m_hist.data()+m_low, 0, (m_high-m_low+1)*sizeof(quint32));
+    }
+    m_low=num_buckets;
+    m_high=-1;
+    m_count=0;
 }
 
-//! \brief Filters input to output with a percentile filter with supplied width.
-//! \param samples Number of samples
-//! \param width number of surrounding samples to consider
-//! \param percentile fractional percentage, between 0 and 1
-void percentileFilter(EventDataType * input, EventDataType * output, int samples, int width, EventDataType percentile)
+void PercentileEngine::add(const EventStoreType * data, int samples)
 {
     if (samples<=0)
         return;
 
-    if (percentile>1)
-        percentile=1;
+    quint32 * hist=m_hist.data();
+    const EventStoreType * eptr=data+samples;
+    int low=m_low, high=m_high, idx;
 
-    QVector<EventDataType> buf(width);
-    int s,e;
-    int z1=width/2;
-    int z2=z1+(width % 2);
-    int nm1=samples-1;
-    //int j;
+    for (; data < eptr; data++) {
+        idx=int(*data)-min_raw;
+        hist[idx]++;
+        if (idx < low) low=idx;
+        if (idx > high) high=idx;
+    }
+    m_low=low;
+    m_high=high;
+    m_count+=samples;
+}
 
-    // Scan through all of input
-    for (int k=0;k < samples;k++) {
+EventStoreType PercentileEngine::raw(EventDataType percentile)
+{
+    EventStoreType result=0;
+    raw(&percentile,&result,1);
+    return result;
+}
 
-        s=k-z1;
-        e=k+z2;
+void PercentileEngine::raw(const EventDataType * percentiles, EventStoreType * results, int num)
+{
+    const quint32 * hist=m_hist.data();
+    quint32 nth, sum;
+    int idx;
 
-        // Cap bounds
-        if (s < 0) s=0;
-        if (e > nm1) e=nm1;
+    for (int i=0;i<num;i++) {
+        if (m_count==0) {
+            results[i]=0;
+            continue;
+        }
+
+        // Same rank Session::percentile always picked with nth_element
+        nth=quint32(EventDataType(m_count) * percentiles[i]);
+        if (nth >= m_count) nth=m_count-1;
 
-        //
-        int j=0;
-        for (int i=s; i < e; i++) {
-            buf[j++]=input[i];
+        sum=0;
+        for (idx=m_low; idx < m_high; idx++) {
+            sum+=hist[idx];
+            if (sum > nth) break;
         }
-        j--;
+        results[i]=EventStoreType(idx+min_raw);
+    }
+}
 
-        EventDataType val=j * percentile;
-        EventDataType fl=floor(val);
+PercentileEngine * PercentileEngine::local()
+{
+    static QThreadStorage<PercentileEngine *> engines;
+    if (!engines.hasLocalData()) {
+        engines.setLocalData(new PercentileEngine());
+    }
+    PercentileEngine * engine=engines.localData();
+    engine->clear();
+    return engine;
+}
 
-        // If even percentile, or already max value..
-        if ((val==fl) || (j>=width-1)) {
-            nth_element(buf.begin(),buf.begin()+j,buf.begin()+width-1);
-            val=buf[j];
+SummaryKernel::SummaryKernel()
+{
+    m_values.fill(0,num_buckets);
+    m_times.fill(0,num_buckets);
+    m_low=num_buckets;
+    m_high=-1;
+    clear();
+}
+
+void SummaryKernel::clear()
+{
+    if (m_high >= m_low) {
+        int len=m_high-m_low+1;
+        memset(m_values.data()+m_low, 0, len*sizeof(quint32));
+        memset(m_times.data()+m_low, 0, len*sizeof(double));
+    }
+    m_low=num_buckets;
+    m_high=-1;
+
+    m_count=0;
+    m_lists=0;
+    m_sum=0;
+    m_min=m_max=0;
+    m_gain=1;
+    m_hasminmax=false;
+    m_first=m_last=0;
+}
+
+void SummaryKernel::add(EventList * el, bool histograms)
+{
+    if (!m_lists++) {
+        m_gain=el->gain();
+        m_first=el->first();
+        m_last=el->last();
+    } else {
+        if (m_first > el->first()) m_first=el->first();
+        if (m_last < el->last()) m_last=el->last();
+    }
+
+    int cnt=el->count();
+    if (cnt<=0)
+        return;
+
+    // Min & Max come from the EventLists own records, ignoring unset (0,0) ones
+    EventDataType mn=el->Min(), mx=el->Max();
+    if (!((mn==0) && (mx==0))) {
+        if (!m_hasminmax) {
+            m_min=mn;
+            m_max=mx;
+            m_hasminmax=true;
         } else {
-            // Percentile lies between two points, interpolate.
-            double v1,v2;
-            nth_element(buf.begin(),buf.begin()+j,buf.begin()+width-1);
-            v1=buf[j];
-            nth_element(buf.begin(),buf.begin()+j+1,buf.begin()+width-1);
-            v2=buf[j+1];
+            if (m_min > mn) m_min=mn;
+            if (m_max < mx) m_max=mx;
+        }
+    }
+
+    const EventStoreType * dptr=el->rawData();
+    const EventStoreType * eptr=dptr+cnt;
+    qint64 rawsum=0;
 
-            val = v1 + (v2-v1)*(val-fl);
+    if (!histograms) {
+        for (; dptr < eptr; dptr++) {
+            rawsum+=*dptr;
         }
-        output[k]=val;
+    } else {
+        quint32 * values=m_values.data();
+        double * times=m_times.data();
+        int low=m_low, high=m_high, idx;
+
+        if (el->type()==EVL_Waveform) {
+            // Each sample covers rate milliseconds
+            double rate=el->rate();
+            for (; dptr < eptr; dptr++) {
+                rawsum+=*dptr;
+                idx=int(*dptr)-min_raw;
+                values[idx]++;
+                times[idx]+=rate;
+                if (idx < low) low=idx;
+                if (idx > high) high=idx;
+            }
+        } else {
+            // Each event value lasts (in whole seconds) until the next event.
+            // As always, the first event of each list only counts towards time, not the value summary.
+            const quint32 * tptr=el->rawTime();
+            qint64 time, lasttime=*tptr;
+            int lastidx=-1;
+            for (; dptr < eptr; dptr++) {
+                time=*tptr++;
+                rawsum+=*dptr;
+                idx=int(*dptr)-min_raw;
+                if (lastidx >= 0) {
+                    values[idx]++;
+                    times[lastidx]+=qint32((time-lasttime) / 1000L);
+                }
+                if (idx < low) low=idx;
+                if (idx > high) high=idx;
+                lastidx=idx;
+                lasttime=time;
+            }
+        }
+        m_low=low;
+        m_high=high;
     }
+
+    m_sum+=double(rawsum) * double(el->gain());
+    m_count+=cnt;
 }
 
-void xpassFilter(EventDataType * input, EventDataType * output, int samples, EventDataType weight)
+EventDataType SummaryKernel::wavg()
 {
-    // prime the first value
-    output[0]=input[0];
-
-    for (int i=1;i<samples;i++) {
-        output[i]=weight*input[i] + (1.0-weight)*output[i-1];
+    const double * times=m_times.data();
+    double s0=0, s1=0, s2;
+    for (int idx=m_low; idx <= m_high; idx++) {
+        s2=quint32(times[idx]);
+        if (s2 > 0) {
+            s0+=s2;
+            s1+=EventDataType(idx+min_raw) * m_gain * s2;
+        }
     }
-    //output[samples-1]=input[samples-1];
+    return (s0 > 0) ? s1/s0 : 0;
 }
 
-FlowParser::FlowParser()
+void SummaryKernel::valueSummary(QHash<EventStoreType, EventStoreType> & valsum)
 {
-    m_session=NULL;
-    m_flow=NULL;
-    m_filtered=NULL;
-    m_gain=1;
-    m_samples=0;
-    m_startsUpper=true;
+    const quint32 * values=m_values.data();
+    for (int idx=m_low; idx <= m_high; idx++) {
+        if (values[idx] > 0) {
+            valsum[EventStoreType(idx+min_raw)]=values[idx];
+        }
+    }
+}
 
-    // Allocate filter chain buffers..
-    m_filtered=(EventDataType *) malloc(max_filter_buf_size);
+void SummaryKernel::timeSummary(QHash<EventStoreType, quint32> & timesum)
+{
+    const quint32 * values=m_values.data();
+    const double * times=m_times.data();
+    for (int idx=m_low; idx <= m_high; idx++) {
+        // A lists first event may have time without a value count
+        if ((values[idx] > 0) || (times[idx] > 0)) {
+            timesum[EventStoreType(idx+min_raw)]=quint32(times[idx]);
+        }
+    }
 }
-FlowParser::~FlowParser()
+
+SummaryKernel * SummaryKernel::local()
 {
-    free (m_filtered);
-//    for (int i=0;i<num_filter_buffers;i++) {
-//        free(m_buffers[i]);
-//    }
+    static QThreadStorage<SummaryKernel *> kernels;
+    if (!kernels.hasLocalData()) {
+        kernels.setLocalData(new SummaryKernel());
+    }
+    SummaryKernel * kernel=kernels.localData();
+    kernel->clear();
+    return kernel;
 }
-void FlowParser::clearFilters()
+
+// Sort BreathPeak by peak index
+bool operator<(const BreathPeak & p1, const BreathPeak & p2)
 {
-    m_filters.clear();
+    return p1.start < p2.start;
 }
 
-EventDataType * FlowParser::applyFilters(EventDataType * data, int samples)
+void xpassFilter(EventDataType * input, EventDataType * output, int samples, EventDataType weight)
 {
-    EventDataType *in=NULL,*out=NULL;
-    if (m_filters.size()==0) {
-        //qDebug() << "Trying to apply empty filter list in FlowParser..";
-        return NULL;
-    }
-    for (int i=0;i<num_filter_buffers;i++) {
-        m_buffers[i]=(EventDataType *) malloc(max_filter_buf_size);
+    // prime the first value
+    output[0]=input[0];
+
+    for (int i=1;i<samples;i++) {
+        output[i]=weight*input[i] + (1.0-weight)*output[i-1];
     }
+    //output[samples-1]=input[samples-1];
+}
 
-    int numfilt=m_filters.size();
+/*! \class PercentileStage
+    \brief Streaming percentile filter. Output lags input by half the window, as it needs to see ahead
 
-    for (int i=0;i<numfilt;i++) {
-        if (i==0) {
-            in=data;
-            out=m_buffers[0];
-            if (in==out) {
-                //qDebug() << "Error: If you need to use internal m_buffers as initial input, use the second one. No filters were applied";
-                return NULL;
+    The window is split between two heaps: a max-heap of its lowest samples, sized so the
+    wanted percentile is on top, and a min-heap of the rest, whose top is the next value up
+    for interpolating. Each sample remembers where it sits in its heap, so the oldest can be
+    taken out directly when it leaves. Adding, removing and picking all take O(log width), and
+    the split only shifts by a sample or so as the window slides across block boundaries.
+    */
+class PercentileStage:public FilterStage
+{
+public:
+    PercentileStage(int width, EventDataType percentile) {
+        if (width<1) width=1;
+        if (percentile>1) percentile=1;
+        m_width=width;
+        m_percentile=percentile;
+        m_z1=width/2;
+        m_z2=m_z1+(width % 2);
+
+        // One extra, as a sample is added before the oldest leaves
+        m_ring.resize(width+1);
+        m_where.resize(width+1);
+        m_at.resize(width+1);
+        m_heap[Low].reserve(width+1);
+        m_heap[High].reserve(width+1);
+        reset();
+    }
+    virtual void reset() {
+        m_cs=m_ce=m_next=0;
+        m_heap[Low].clear();
+        m_heap[High].clear();
+    }
+    virtual int latency() { return m_z2-1; }
+    virtual int process(const EventDataType * input, int samples, EventDataType * output) {
+        int count=0;
+        for (int i=0;i<samples;i++) {
+            // Reads input[i] before writing output[count<=i], so filtering in place is fine
+            insert(input[i]);
+            while (m_next+m_z2 <= m_ce) {
+                output[count++]=emit();
             }
-        } else {
-            in=m_buffers[(i+1) % num_filter_buffers];
-            out=m_buffers[i % num_filter_buffers];
         }
+        return count;
+    }
+    virtual int flush(EventDataType * output) {
+        // Windows at the true end just run out of lookahead
+        int count=0;
+        while (m_next < m_ce) {
+            output[count++]=emit();
+        }
+        return count;
+    }
+
+protected:
+    //! \brief Low is a max-heap of the lowest samples, High a min-heap of the rest
+    enum { Low=0, High=1 };
 
-        // If final link in chain, pass it back out to input data
-        if (i==numfilt-1) {
-            out=data;
+    inline EventDataType value(int slot) const { return m_ring[slot]; }
+
+    //! \brief Returns true if slot a belongs above slot b in heap h
+    inline bool above(int h, int a, int b) const {
+        return (h==Low) ? (value(a) > value(b)) : (value(a) < value(b));
+    }
+
+    inline void place(int h, int i, int slot) {
+        m_heap[h][i]=slot;
+        m_where[slot]=h;
+        m_at[slot]=i;
+    }
+
+    void siftUp(int h, int i) {
+        QVector<int> & heap=m_heap[h];
+        int slot=heap[i], parent;
+        while (i > 0) {
+            parent=(i-1)/2;
+            if (!above(h,slot,heap[parent])) break;
+            place(h,i,heap[parent]);
+            i=parent;
         }
+        place(h,i,slot);
+    }
 
-        Filter & filter=m_filters[i];
-        if (filter.type==FilterNone) {
-            // Just copy it..
-            memcpy(in,out,samples*sizeof(EventDataType));
-        } else if (filter.type==FilterPercentile) {
-            percentileFilter(in,out,samples,filter.param1,filter.param2);
-        } else if (filter.type==FilterXPass) {
-            xpassFilter(in,out,samples,filter.param1);
+    void siftDown(int h, int i) {
+        QVector<int> & heap=m_heap[h];
+        int size=heap.size(), slot=heap[i], child;
+        while ((child=2*i+1) < size) {
+            if ((child+1 < size) && above(h,heap[child+1],heap[child])) child++;
+            if (!above(h,heap[child],slot)) break;
+            place(h,i,heap[child]);
+            i=child;
         }
+        place(h,i,slot);
     }
 
-    for (int i=0;i<num_filter_buffers;i++) {
-        free(m_buffers[i]);
+    void push(int h, int slot) {
+        m_heap[h].push_back(slot);
+        siftUp(h,m_heap[h].size()-1);
     }
-    return out;
-}
-void FlowParser::openFlow(Session * session, EventList * flow)
-{
-    if (!flow) {
-        qDebug() << "called FlowParser::processFlow() with a null EventList!";
-        return;
+
+    //! \brief Takes slot out of whichever heap it's in
+    void erase(int slot) {
+        int h=m_where[slot], i=m_at[slot];
+        QVector<int> & heap=m_heap[h];
+        int last=heap.back();
+        heap.pop_back();
+        if (last==slot)
+            return;
+        place(h,i,last);
+        siftUp(h,i);
+        siftDown(h,m_at[last]);
     }
-    m_session=session;
-    m_flow=flow;
-    m_gain=flow->gain();
-    m_rate=flow->rate();
-    m_samples=flow->count();
-    EventStoreType *inraw=flow->rawData();
 
-    // Make sure we won't overflow internal buffers
-    if (m_samples > max_filter_buf_size) {
-        qDebug() << "Error: Sample size exceeds max_filter_buf_size in FlowParser::openFlow().. Capping!!!";
-        m_samples=max_filter_buf_size;
+    //! \brief Moves the top of heap from to heap to
+    void move(int from, int to) {
+        int slot=m_heap[from].front();
+        erase(slot);
+        push(to,slot);
     }
 
-    // Begin with the second internal buffer
-    EventDataType * buf=m_filtered;
-    // Apply gain to waveform
-    EventStoreType *eptr=inraw+m_samples;
+    //! \brief Adds the next input sample to the window
+    void insert(EventDataType v) {
+        int slot=m_ce % m_ring.size();
+        m_ring[slot]=v;
+        m_ce++;
 
-    // Convert from store type to floats..
-    for (; inraw < eptr; inraw++) {
-        *buf++ = EventDataType(*inraw) * m_gain;
+        // Anything between the two tops can go either side
+        if (!m_heap[High].isEmpty() && (v > value(m_heap[High].front())))
+            push(High,slot);
+        else push(Low,slot);
     }
 
-    // Apply the rest of the filters chain
-    buf=applyFilters(m_filtered, m_samples);
+    //! \brief Drops the oldest sample from the window
+    void remove() {
+        erase(m_cs % m_ring.size());
+        m_cs++;
+    }
 
-    calcPeaks(m_filtered, m_samples);
-}
+    //! \brief Returns the output for sample m_next, whose window must be complete or end at the stream end
+    EventDataType emit() {
+        int s=m_next-m_z1;
+        while (m_cs < s) remove();
+        m_next++;
 
-// Calculates breath upper & lower peaks for a chunk of EventList data
-void FlowParser::calcPeaks(EventDataType * input, int samples)
+        int j=m_ce-m_cs-1;
+        EventDataType val=j * m_percentile;
+        EventDataType fl=floor(val);
+        int idx=int(fl);
+
+        // Put the idx'th lowest sample on top of Low, and the one after it on top of High
+        while (m_heap[Low].size() > idx+1) move(Low,High);
+        while (m_heap[Low].size() < idx+1) move(High,Low);
+
+        // If even percentile, or already max value..
+        if ((val==fl) || (idx>=j))
+            return value(m_heap[Low].front());
+
+        // Percentile lies between two points, interpolate.
+        double v1=value(m_heap[Low].front()), v2=value(m_heap[High].front());
+        return v1 + (v2-v1)*(val-fl);
+    }
+
+    int m_width, m_z1, m_z2;
+    EventDataType m_percentile;
+    //! \brief The window samples in arrival order, sample i in slot i % size
+    QVector<EventDataType> m_ring;
+    //! \brief Ring slots, heaped by their values
+    QVector<int> m_heap[2];
+    //! \brief Which heap each slot is in, and where
+    QVector<int> m_where, m_at;
+    //! \brief Window covers samples m_cs to m_ce, m_next is the next to output
+    int m_cs, m_ce, m_next;
+};
+
+/*! \class XPassStage
+    \brief Streaming xpassFilter, carrying the last output over to the next block
+    */
+class XPassStage:public FilterStage
 {
-    if (samples<=0)
-        return;
+public:
+    XPassStage(EventDataType weight) { m_weight=weight; reset(); }
+    virtual void reset() { m_primed=false; m_last=0; }
+    virtual int process(const EventDataType * input, int samples, EventDataType * output) {
+        if (samples<=0) return 0;
+        int i=0;
+        if (!m_primed) {
+            // prime the first value
+            output[0]=m_last=input[0];
+            m_primed=true;
+            i=1;
+        }
+        for (;i<samples;i++) {
+            output[i]=m_last=weight(input[i]);
+        }
+        return samples;
+    }
+protected:
+    inline EventDataType weight(EventDataType in) { return m_weight*in + (1.0-m_weight)*m_last; }
 
-    EventDataType min=0,max=0, c, lastc=0;
+    EventDataType m_weight, m_last;
+    bool m_primed;
+};
 
-    EventDataType zeroline=0;
+//! \brief Stage for FilterNone, passing its input straight through
+class CopyStage:public FilterStage
+{
+public:
+    virtual void reset() {}
+    virtual int process(const EventDataType * input, int samples, EventDataType * output) {
+        if (samples > 0)
+            memmove(output,input,samples*sizeof(EventDataType));
+        return samples;
+    }
+};
 
-    double rate=m_flow->rate();
+static FilterStage * createPercentileStage(const Filter & filter)
+{
+    return new PercentileStage(filter.param1,filter.param2);
+}
 
-    double flowstart=m_flow->first();
-    double lasttime,time;
+static FilterStage * createXPassStage(const Filter & filter)
+{
+    return new XPassStage(filter.param1);
+}
 
-    double peakmax=flowstart, peakmin=flowstart;
+static FilterStage * createCopyStage(const Filter & filter)
+{
+    Q_UNUSED(filter);
+    return new CopyStage();
+}
 
-    time=lasttime=flowstart;
-    breaths.clear();
+QMutex filterStageMutex;
+QHash<int,FilterStageFactory> filterStages;
 
-    // Estimate storage space needed using typical average breaths per minute.
-    m_minutes=double(m_flow->last() - m_flow->first()) / 60000.0;
-    const double avgbpm=20;
-    int guestimate=m_minutes*avgbpm;
-    breaths.reserve(guestimate);
+static void initFilterStages()
+{
+    if (!filterStages.isEmpty())
+        return;
+    filterStages[FilterNone]=createCopyStage;
+    filterStages[FilterPercentile]=createPercentileStage;
+    filterStages[FilterXPass]=createXPassStage;
+}
 
-    // Prime min & max, and see which side of the zero line we are starting from.
-    c=input[0];
-    min=max=c;
-    lastc=c;
-    m_startsUpper=(c >= zeroline);
+void registerFilterStage(FilterType type, FilterStageFactory factory)
+{
+    QMutexLocker lock(&filterStageMutex);
+    initFilterStages();
+    filterStages[type]=factory;
+}
 
-    qint32 start=0,middle=0;//,end=0;
+FilterStage * createFilterStage(const Filter & filter)
+{
+    FilterStageFactory factory;
+    {
+        QMutexLocker lock(&filterStageMutex);
+        initFilterStages();
+        factory=filterStages.value(filter.type,NULL);
+    }
+    return factory ? factory(filter) : NULL;
+}
 
+FilterChain::FilterChain()
+{
+}
 
-    int sps=1000/m_rate;
-    int len=0, lastk=0; //lastlen=0
+FilterChain::~FilterChain()
+{
+    clear();
+}
 
-    qint64 sttime=time;//, ettime=time;
+void FilterChain::clear()
+{
+    qDeleteAll(m_stages);
+    m_stages.clear();
+}
 
-    // For each samples, find the peak upper and lower breath components
-    for (int k=0; k < samples; k++) {
-        c=input[k];
+void FilterChain::add(FilterStage * stage)
+{
+    m_stages.push_back(stage);
+}
 
-        if (c >= zeroline) {
+void FilterChain::add(const Filter & filter)
+{
+    FilterStage * stage=createFilterStage(filter);
+    if (!stage) {
+        qWarning() << "FilterChain::add() no stage registered for filter type" << filter.type;
+        return;
+    }
+    add(stage);
+}
 
-            // Did we just cross the zero line going up?
-            if (lastc < zeroline) {
-                // This helps filter out dirty breaths..
-                len=k-start;
-                if ((max>3) && ((max-min) > 8) && (len>sps) && (middle > start))  {
+void FilterChain::reset()
+{
+    for (int i=0;i<m_stages.size();i++) {
+        m_stages[i]->reset();
+    }
+}
 
-                    // peak detection may not be needed..
-                    breaths.push_back(BreathPeak(min, max, start, middle, k)); //, peakmin, peakmax));
+int FilterChain::latency()
+{
+    int total=0;
+    for (int i=0;i<m_stages.size();i++) {
+        total+=m_stages[i]->latency();
+    }
+    return total;
+}
 
-                    // Set max for start of the upper breath cycle
-                    max=c;
-                    peakmax=time;
+int FilterChain::run(const EventDataType * input, int samples, EventDataType * output, bool flush)
+{
+    // Room for a block plus anything held back being flushed through
+    int size=filter_block_size+latency();
+
+    const EventDataType * src=input;
+    EventDataType * dst;
+    int count=samples;
+    for (int i=0;i<m_stages.size();i++) {
+        QVector<EventDataType> & block=m_blocks[i & 1];
+        if (block.size() < size)
+            block.resize(size);
+        dst=block.data();
+
+        FilterStage * stage=m_stages[i];
+        count=stage->process(src,count,dst);
+        if (flush)
+            count+=stage->flush(dst+count);
+        src=dst;
+    }
+    if (count > 0)
+        memcpy(output,src,count*sizeof(EventDataType));
+    return count;
+}
 
+int FilterChain::process(const EventDataType * input, int samples, EventDataType * output)
+{
+    int written=0;
+    for (int pos=0; pos < samples; pos+=filter_block_size) {
+        written+=run(input+pos,qMin(filter_block_size,samples-pos),output+written,false);
+    }
+    return written;
+}
 
-                    // Starting point of next breath cycle
-                    start=k;
-                    sttime=time;
-                }
-            } else if (c > max) {
-                // Update upper breath peak
-                max=c;
-                peakmax=time;
-            }
-        }
+int FilterChain::flush(EventDataType * output)
+{
+    return run(NULL,0,output,true);
+}
 
-        if (c < zeroline) {
-            // Did we just cross the zero line going down?
+void FilterChain::apply(EventDataType * data, int samples)
+{
+    if (m_stages.isEmpty() || (samples<=0))
+        return;
 
-            if (lastc >= zeroline) {
-                // Set min for start of the lower breath cycle
-                min=c;
-                peakmin=time;
-                middle=k;
+    // Output never gets ahead of input, so this can safely write back over the samples already read
+    reset();
+    int written=process(data,samples,data);
+    flush(data+written);
+}
 
-            } else if (c < min) {
-                // Update lower breath peak
-                min=c;
-                peakmin=time;
-            }
+FlowParser::FlowParser()
+{
+    m_session=NULL;
+    m_filtered=NULL;
+    m_rate=0;
+    m_sps=0;
+    m_calcResp=m_calcTv=m_calcTi=m_calcTe=m_calcMv=m_flag=false;
+    m_running=false;
+    m_runs=0;
+    m_nexttime=0;
+    m_input=0;
+    m_samples=0;
+    m_runstart=0;
+    m_startsUpper=true;
+    m_upper=true;
+    m_segtail=0;
+    m_bmin=m_bmax=0;
+    m_bstart=m_bmiddle=0;
+    m_tvsum=m_tvmiddle=0;
+    m_tvsps=0;
+    m_nbreaths=0;
+    m_emitted=0;
+    m_RR=m_TV=m_Ti=m_Te=m_MV=NULL;
+    m_minrr=m_maxrr=m_mintv=m_maxtv=0;
+    m_lastti=m_lastti2=m_lastte=m_lastte2=0;
+    m_lastet=0;
+
+    // Buffers are sized on demand, and kept for next time
+}
+FlowParser::~FlowParser()
+{
+}
 
-        }
-        lasttime=time;
-        time+=rate;
-        lastc=c;
-        lastk=k;
+FlowParser * FlowParser::local()
+{
+    static QThreadStorage<FlowParser *> parsers;
+    if (!parsers.hasLocalData()) {
+        parsers.setLocalData(new FlowParser());
     }
+    return parsers.localData();
 }
 
+void FlowParser::clearFilters()
+{
+    m_filters.clear();
+}
 
-//! \brief Calculate Respiratory Rate, TidalVolume, Minute Ventilation, Ti & Te..
-// These are grouped together because, a) it's faster, and b) some of these calculations rely on others.
-void FlowParser::calc(bool calcResp, bool calcTv, bool calcTi, bool calcTe, bool calcMv)
+// Grows buf to at least size samples, never shrinking it, so it can be reused without reallocating
+static inline EventDataType * reserveBuffer(QVector<EventDataType> & buf, int size)
 {
-    if (!m_session) {
+    if (buf.size() < size)
+        buf.resize(size);
+    return buf.data();
+}
+
+void FlowParser::beginStream(Session * session, bool calcResp, bool calcTv, bool calcTi, bool calcTe, bool calcMv, bool flagEvents)
+{
+    m_session=session;
+    m_calcResp=calcResp;
+    m_calcTv=calcTv;
+    m_calcTi=calcTi;
+    m_calcTe=calcTe;
+    m_calcMv=calcMv && calcResp && calcTv;
+    m_flag=flagEvents && CalcSettings::current().userEventFlagging;
+    m_running=false;
+    m_runs=0;
+}
+
+void FlowParser::addFlow(EventList * flow)
+{
+    if (!flow) {
+        qDebug() << "called FlowParser::addFlow() with a null EventList!";
         return;
     }
+    addSamples(flow->rawData(),flow->count(),flow->gain(),flow->rate(),flow->first());
+}
 
-    // Don't even bother if only a few breaths in this chunk
-    const int lowthresh=4;
-    int nm=breaths.size();
-    if (nm < lowthresh)
+void FlowParser::addSamples(const EventStoreType * data, int count, EventDataType gain, EventDataType rate, qint64 time)
+{
+    if (!m_session) {
+        qDebug() << "called FlowParser::addSamples() without beginStream()";
+        return;
+    }
+    if ((count<=0) || (rate<=0))
         return;
 
-    const qint64 minute=60000;
+    // Anything that doesn't carry straight on from the last piece starts afresh
+    if (m_running && ((rate!=m_rate) || (qAbs(time-m_nexttime) > qMax(qint64(1000),qint64(rate*2))))) {
+        finishRun();
+    }
+    if (!m_running) {
+        startRun(rate,time);
+    }
+    m_spans.push_back(FlowSpan(m_input,time));
+    m_nexttime=time+qint64(double(count)*rate);
 
+    EventDataType * inbuf=reserveBuffer(m_inbuf,filter_block_size);
+    EventDataType * outbuf=reserveBuffer(m_outbuf,filter_block_size+m_chain.latency());
+    EventDataType * buf;
+    const EventStoreType * end;
+    int n;
+    for (int pos=0; pos < count; pos+=n) {
+        n=qMin(filter_block_size,count-pos);
 
-    double start=m_flow->first();
-    double time=start;
+        // Convert from store type to floats, applying gain..
+        buf=inbuf;
+        for (end=data+n; data < end; data++) {
+            *buf++ = EventDataType(*data) * gain;
+        }
+        if (m_chain.isEmpty()) {
+            addFiltered(inbuf,n);
+        } else {
+            addFiltered(outbuf,m_chain.process(inbuf,n,outbuf));
+        }
+    }
+    m_input+=count;
+}
 
-    int bs,be,bm;
-    double st,et,mt;
+int FlowParser::endStream()
+{
+    finishRun();
+    m_session=NULL;
+    return m_runs;
+}
 
-    /////////////////////////////////////////////////////////////////////////////////
-    // Respiratory Rate setup
-    /////////////////////////////////////////////////////////////////////////////////
-    EventDataType minrr,maxrr;
-    EventList * RR=NULL;
-    quint32 * rr_tptr=NULL;
-    EventStoreType * rr_dptr=NULL;
-    if (calcResp) {
-        RR=m_session->AddEventList(CPAP_RespRate,EVL_Event);
-        minrr=RR->Min(), maxrr=RR->Max();
-        RR->setGain(0.2);
-        RR->setFirst(time+minute);
-        RR->getData().resize(nm);
-        RR->getTime().resize(nm);
-        rr_tptr=RR->rawTime();
-        rr_dptr=RR->rawData();
-    }
-
-    int rr_count=0;
-
-    double len, st2,et2,adj, stmin, b, rr=0;
-    double len2;
-    int idx;
+void FlowParser::startRun(EventDataType rate, qint64 time)
+{
+    m_running=true;
+    m_rate=rate;
+    m_sps=1000/m_rate;
+    m_tvsps=(1000.0/m_rate); // Samples Per Second
+    m_runstart=time;
+    m_input=0;
+    m_samples=0;
+    m_spans.clear();
+    m_hist.resize(0);
+    m_filtered=NULL;
 
+    breaths.resize(0);
+    m_breathtv.resize(0);
+    m_crossings.resize(0);
+    m_segpeak.resize(0);
+    m_nbreaths=0;
+    m_emitted=0;
+
+    m_RR=m_TV=m_Ti=m_Te=m_MV=NULL;
+    m_lastti=m_lastti2=m_lastte=m_lastte2=0;
+    m_lastet=0;
+
+    // Stages are cheap to build, and each run filters from a clean state
+    m_chain.clear();
+    for (int i=0;i<m_filters.size();i++) {
+        m_chain.add(m_filters.at(i));
+    }
+    m_chain.reset();
+}
 
+void FlowParser::finishRun()
+{
+    if (!m_running)
+        return;
 
-    /////////////////////////////////////////////////////////////////////////////////
-    // Inspiratory / Expiratory Time setup
-    /////////////////////////////////////////////////////////////////////////////////
-    double lastte2=0,lastti2=0,lastte=0, lastti=0, te, ti, ti1, te1,c;
-    EventList * Te=NULL, * Ti=NULL;
-    if (calcTi) {
-        Ti=m_session->AddEventList(CPAP_Ti,EVL_Event);
-        Ti->setGain(0.02);
+    if (!m_chain.isEmpty()) {
+        EventDataType * outbuf=reserveBuffer(m_outbuf,filter_block_size+m_chain.latency());
+        addFiltered(outbuf,m_chain.flush(outbuf));
     }
-    if (calcTe) {
-        Te=m_session->AddEventList(CPAP_Te,EVL_Event);
-        Te->setGain(0.02);
+    if (m_samples > 0) {
+        closeSegment();
     }
 
-
-    /////////////////////////////////////////////////////////////////////////////////
-    // Tidal Volume setup
-    /////////////////////////////////////////////////////////////////////////////////
-    EventList * TV;
-    EventDataType mintv, maxtv, tv;
-    double val1, val2;
-    quint32 * tv_tptr;
-    EventStoreType * tv_dptr;
-    int tv_count=0;
-    if (calcTv) {
-        TV=m_session->AddEventList(CPAP_TidalVolume,EVL_Event);
-        mintv=TV->Min(), maxtv=TV->Max();
-        TV->setGain(20);
-        TV->setFirst(start);
-        TV->getData().resize(nm);
-        TV->getTime().resize(nm);
-        tv_tptr=TV->rawTime();
-        tv_dptr=TV->rawData();
+    if (m_RR) {
+        m_RR->setMin(m_minrr);
+        m_RR->setMax(m_maxrr);
+        m_RR->setFirst(m_runstart);
+        m_RR->setLast(m_lastet);
     }
-    /////////////////////////////////////////////////////////////////////////////////
-    // Minute Ventilation setup
-    /////////////////////////////////////////////////////////////////////////////////
-    EventList * MV=NULL;
-    EventDataType mv;
-    if (calcMv) {
-        MV=m_session->AddEventList(CPAP_MinuteVent,EVL_Event);
-        MV->setGain(0.125);
+    if (m_TV) {
+        m_TV->setMin(m_mintv);
+        m_TV->setMax(m_maxtv);
+        m_TV->setFirst(m_runstart);
+        m_TV->setLast(m_lastet);
     }
 
-    EventDataType sps=(1000.0/m_rate); // Samples Per Second
+    if (m_flag) {
+        m_filtered=m_hist.data();
+        flagEvents();
+        m_filtered=NULL;
+    }
+    m_running=false;
+    m_runs++;
+}
 
+double FlowParser::sampleTime(qint32 idx)
+{
+    const FlowSpan & sp=spanOf(idx);
+    return double(sp.time) + (idx-sp.index) * m_rate;
+}
 
-    qint32 timeval=0; // Time relative to start
+double FlowParser::exactTime(qint32 idx)
+{
+    const FlowSpan & sp=spanOf(idx);
+    return double(sp.time) + double(idx-sp.index) * m_rate;
+}
 
-    for (idx=0;idx<nm;idx++) {
-        bs=breaths[idx].start;
-        bm=breaths[idx].middle;
-        be=breaths[idx].end;
+qint64 FlowParser::msecTime(qint32 idx)
+{
+    const FlowSpan & sp=spanOf(idx);
+    return sp.time + qint32((idx-sp.index) * m_rate);
+}
 
-        // Calculate start, middle and end time of this breath
-        st=start+bs * m_rate;
-        mt=start+bm * m_rate;
+const FlowSpan & FlowParser::spanOf(qint32 idx)
+{
+    // Nearly always the latest piece
+    int i=m_spans.size()-1;
+    if (m_spans[i].index > idx) {
+        int lo=0, hi=i, mid;
+        while (lo < hi) {
+            mid=(lo+hi+1)/2;
+            if (m_spans[mid].index <= idx) lo=mid;
+            else hi=mid-1;
+        }
+        i=lo;
+    }
+    return m_spans[i];
+}
 
-        timeval=be * m_rate;
+// Finds breath upper & lower peaks in a block of filtered flow
+void FlowParser::addFiltered(const EventDataType * data, int count)
+{
+    if (count<=0)
+        return;
 
-        et=start+timeval;
+    const EventDataType zeroline=0;
+    qint32 base=m_samples;
+    int k=0;
 
+    if (m_flag) {
+        // flagEvents needs the whole run
+        int size=m_hist.size();
+        m_hist.resize(size+count);
+        memcpy(m_hist.data()+size,data,count*sizeof(EventDataType));
+    }
 
+    if (base==0) {
+        // See which side of the zero line we are starting from.
+        m_startsUpper=m_upper=(data[0] >= zeroline);
+        m_bmin=m_bmax=data[0];
+        m_bstart=m_bmiddle=0;
+        m_tvsum=m_tvmiddle=0;
+        openSegment(0,data[0]);
+        k=1;
+    }
 
-        /////////////////////////////////////////////////////////////////////
-        // Calculate Inspiratory Time (Ti) for this breath
-        /////////////////////////////////////////////////////////////////////
-        if (calcTi) {
-            ti=((mt-st)/1000.0)*50.0;
-            ti1=(lastti2+lastti+ti)/3.0;
-            Ti->AddEvent(mt,ti1);
-            lastti2=lastti;
-            lastti=ti;
+    /////////////////////////////////////////////////////////////////////////////////
+    // Pre-pass: Index the zero line crossings in this block
+    /////////////////////////////////////////////////////////////////////////////////
+    m_blockcross.resize(0);
+    bool upper=m_upper, up;
+    for (int i=k; i < count; i++) {
+        up=(data[i] >= zeroline);
+        if (up != upper) {
+            m_blockcross.push_back(i);
+            upper=up;
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////////////////
+    // Reduce the open segments tail between crossings, as plain reductions over contiguous runs,
+    // and keep the Tidal Volume sum going. These are scalar loops: without -ffast-math gcc 12
+    // won't vectorise either of them, at -O2 or -O3.
+    /////////////////////////////////////////////////////////////////////////////////
+    int numcross=m_blockcross.size(), end;
+    const EventDataType * ptr, * eptr;
+    EventDataType peak;
+    for (int c=0; c <= numcross; c++) {
+        end=(c < numcross) ? m_blockcross[c] : count;
+        eptr=data+end;
+        peak=m_segtail;
+        if (m_upper) {
+            for (ptr=data+k; ptr < eptr; ptr++) peak=(*ptr > peak) ? *ptr : peak;
+        } else {
+            for (ptr=data+k; ptr < eptr; ptr++) peak=(*ptr < peak) ? *ptr : peak;
         }
-        /////////////////////////////////////////////////////////////////////
-        // Calculate Expiratory Time (Te) for this breath
-        /////////////////////////////////////////////////////////////////////
-        if (calcTe) {
-            te=((et-mt)/1000.0)*50.0;
-            // Average last three values..
-            te1=(lastte2+lastte+te)/3.0;
-            Te->AddEvent(mt,te1);
-
-            lastte2=lastte;
-            lastte=te;
-        }
-        /////////////////////////////////////////////////////////////////////
-        // Calculate TidalVolume
-        /////////////////////////////////////////////////////////////////////
-        if (calcTv) {
-            val1=0, val2=0;
-            // Scan the upper breath
-            for (int j=bs;j<bm;j++)  {
+        m_segtail=peak;
+        if (m_calcTv) {
+            for (ptr=data+k; ptr < eptr; ptr++) {
                 // convert flow to ml/s to L/min and divide by samples per second
-                c=double(qAbs(m_filtered[j])) * 1000.0 / 60.0 / sps;
-                val2+=c;
-                //val2+=c*c; // for RMS
+                m_tvsum+=double(qAbs(*ptr)) * 1000.0 / 60.0 / m_tvsps;
             }
-            // calculate root mean square
-            //double n=bm-bs;
-            //double q=(1/n)*val2;
-            //double x=sqrt(q)*2;
-            //val2=x;
-            tv=val2;
-
-            if (tv < mintv) mintv=tv;
-            if (tv > maxtv) maxtv=tv;
-            *tv_tptr++ = timeval;
-            *tv_dptr++ = tv / 20.0;
-            tv_count++;
-
-        }
-
-        /////////////////////////////////////////////////////////////////////
-        // Respiratory Rate Calculations
-        /////////////////////////////////////////////////////////////////////
-        if (calcResp) {
-            stmin=et-minute;
-            if (stmin < start)
-                stmin=start;
-            len=et-stmin;
-            rr=0;
-            len2=0;
-            //if ( len >= minute) {
-                //et2=et;
-
-                // Step back through last minute and count breaths
-                for (int i=idx;i>=0;i--) {
-                    st2=start + double(breaths[i].start) * m_rate;
-                    et2=start + double(breaths[i].end) * m_rate;
-                    if (et2 < stmin)
-                        break;
-
-                    len=et2-st2;
-                    if (st2 < stmin) {
-                        // Partial breath
-                        st2=stmin;
-                        adj=et2 - st2;
-                        b=(1.0 / len) * adj;
-                        len2+=adj;
-                    } else {
-                        b=1;
-                        len2+=len;
-                    }
+        }
+        if (c < numcross) {
+            closeSegment();
+            m_upper=!m_upper;
+            openSegment(base+end,data[end]);
+            k=end+1;
+        }
+    }
+    m_samples+=count;
+}
 
-                    rr+=b;
-                }
-                if (len2 < minute) {
-                    rr*=minute/len2;
+void FlowParser::openSegment(qint32 idx, EventDataType first)
+{
+    if (m_flag && (idx > 0)) {
+        m_crossings.push_back(idx);
+    }
+    if (m_upper) {
+        // Did we just cross the zero line going up?
+        if (idx > 0) {
+            // This helps filter out dirty breaths..
+            if ((m_bmax>3) && ((m_bmax-m_bmin) > 8) && ((idx-m_bstart)>m_sps) && (m_bmiddle > m_bstart))  {
+                breaths.push_back(BreathPeak(m_bmin, m_bmax, m_bstart, m_bmiddle, idx));
+                m_breathtv.push_back(m_tvmiddle);
+                m_nbreaths++;
+
+                // Set max for start of the upper breath cycle, and the next breaths starting point
+                m_bmax=first;
+                m_bstart=idx;
+                m_tvsum=0;
+
+                // Don't even bother until there's a few breaths in this run
+                const int lowthresh=4;
+                if (m_nbreaths >= lowthresh) {
+                    while (m_emitted < breaths.size()) {
+                        emitBreath(m_emitted++);
+                    }
+                    if (!m_flag) {
+                        // Respiratory Rate only ever looks back a minute, so older breaths can go
+                        double stmin=double(msecTime(idx)-60000);
+                        int drop=0;
+                        while ((drop < m_emitted-1) && (exactTime(breaths[drop].end) < stmin)) drop++;
+                        if (drop >= 64) {
+                            breaths.remove(0,drop);
+                            m_breathtv.remove(0,drop);
+                            m_emitted-=drop;
+                        }
+                    }
                 }
-                // Calculate min & max
-                if (rr < minrr)
-                    minrr=rr;
-                if (rr > maxrr)
-                    maxrr=rr;
+            }
+        }
+        m_segtail=-FLT_MAX;
+    } else {
+        // Set min for start of the lower breath cycle
+        m_bmin=first;
+        m_bmiddle=idx;
+        m_tvmiddle=m_tvsum;
+        m_segtail=FLT_MAX;
+    }
+    if (m_calcTv) {
+        m_tvsum+=double(qAbs(first)) * 1000.0 / 60.0 / m_tvsps;
+    }
+}
 
-                // Add manually.. (much quicker)
-                *rr_tptr++ = timeval;
+void FlowParser::closeSegment()
+{
+    if (m_flag) {
+        m_segpeak.push_back(m_segtail);
+    }
+    // Upper peaks carry over when a dirty breath gets merged into the next,
+    // while lower peaks always come from the last lower segment.
+    if (m_upper) {
+        if (m_segtail > m_bmax) m_bmax=m_segtail;
+    } else {
+        if (m_segtail < m_bmin) m_bmin=m_segtail;
+    }
+}
 
-                // Use the same gains as ResMed..
+EventDataType FlowParser::segmentPeak(int seg)
+{
+    EventDataType first=m_filtered[segmentStart(seg)];
+    if (first >= 0) return qMax(first,m_segpeak[seg]);
+    return -qMin(first,m_segpeak[seg]);
+}
 
-                *rr_dptr++ = rr * 5.0;
-                rr_count++;
+int FlowParser::segmentOf(int idx)
+{
+    return qUpperBound(m_crossings.begin(),m_crossings.end(),idx)-m_crossings.begin();
+}
 
-                //rr->AddEvent(et,br * 50.0);
-            //}
+int FlowParser::firstAbove(int from, int to, EventDataType cutoff)
+{
+    int seg=segmentOf(from), end;
+    int k=from;
+    while (k < to) {
+        end=qMin(segmentEnd(seg),to);
+        // Skip whole segments that never get past cutoff
+        if (segmentPeak(seg) > cutoff) {
+            for (; k < end; k++) {
+                if (qAbs(m_filtered[k]) > cutoff) return k;
+            }
         }
-        if (calcMv && calcResp && calcTv) {
-            mv=(tv/1000.0) * rr;
-            MV->AddEvent(et,mv * 8.0);
+        k=end;
+        seg++;
+    }
+    return to;
+}
+
+int FlowParser::lastAbove(int from, int to, EventDataType cutoff)
+{
+    int seg=segmentOf(to), begin;
+    int k=to;
+    while (k > from) {
+        begin=qMax(segmentStart(seg),from+1);
+        if (segmentPeak(seg) > cutoff) {
+            for (; k >= begin; k--) {
+                if (qAbs(m_filtered[k]) > cutoff) return k;
+            }
         }
+        k=begin-1;
+        seg--;
     }
+    return from;
+}
+
+
+//! \brief Calculate Respiratory Rate, TidalVolume, Minute Ventilation, Ti & Te for breaths[idx]
+// These are grouped together because, a) it's faster, and b) some of these calculations rely on others.
+void FlowParser::emitBreath(int idx)
+{
+    const qint64 minute=60000;
+    const BreathPeak & breath=breaths[idx];
+
+    // Calculate start, middle and end time of this breath
+    double st=sampleTime(breath.start);
+    double mt=sampleTime(breath.middle);
+    qint64 et=msecTime(breath.end);
+    m_lastet=et;
 
     /////////////////////////////////////////////////////////////////////
-    // Respiratory Rate post filtering
+    // Calculate Inspiratory Time (Ti) for this breath
     /////////////////////////////////////////////////////////////////////
-
-    if (calcResp) {
-        RR->setMin(minrr);
-        RR->setMax(maxrr);
-        RR->setFirst(start);
-        RR->setLast(et);
-        RR->setCount(rr_count);
+    if (m_calcTi) {
+        if (!m_Ti) {
+            m_Ti=m_session->AddEventList(CPAP_Ti,EVL_Event);
+            m_Ti->setGain(0.02);
+        }
+        double ti=((mt-st)/1000.0)*50.0;
+        double ti1=(m_lastti2+m_lastti+ti)/3.0;
+        m_Ti->AddEvent(mt,ti1);
+        m_lastti2=m_lastti;
+        m_lastti=ti;
     }
     /////////////////////////////////////////////////////////////////////
-    // Tidal Volume post filtering
+    // Calculate Expiratory Time (Te) for this breath
     /////////////////////////////////////////////////////////////////////
+    if (m_calcTe) {
+        if (!m_Te) {
+            m_Te=m_session->AddEventList(CPAP_Te,EVL_Event);
+            m_Te->setGain(0.02);
+        }
+        double te=((et-mt)/1000.0)*50.0;
+        // Average last three values..
+        double te1=(m_lastte2+m_lastte+te)/3.0;
+        m_Te->AddEvent(mt,te1);
+        m_lastte2=m_lastte;
+        m_lastte=te;
+    }
+    /////////////////////////////////////////////////////////////////////
+    // TidalVolume was summed while the breath went by
+    /////////////////////////////////////////////////////////////////////
+    EventDataType tv=0;
+    if (m_calcTv) {
+        if (!m_TV) {
+            m_TV=m_session->AddEventList(CPAP_TidalVolume,EVL_Event);
+            m_mintv=m_TV->Min(), m_maxtv=m_TV->Max();
+            m_TV->setGain(20);
+            m_TV->setFirst(m_runstart);
+        }
+        tv=m_breathtv[idx];
+        if (tv < m_mintv) m_mintv=tv;
+        if (tv > m_maxtv) m_maxtv=tv;
+        m_TV->AddEvent(et,tv / 20.0);
+    }
 
-    if (calcTv) {
-        TV->setMin(mintv);
-        TV->setMax(maxtv);
-        TV->setFirst(start);
-        TV->setLast(et);
-        TV->setCount(tv_count);
+    /////////////////////////////////////////////////////////////////////
+    // Respiratory Rate Calculations
+    /////////////////////////////////////////////////////////////////////
+    double rr=0;
+    if (m_calcResp) {
+        if (!m_RR) {
+            m_RR=m_session->AddEventList(CPAP_RespRate,EVL_Event);
+            m_minrr=m_RR->Min(), m_maxrr=m_RR->Max();
+            m_RR->setGain(0.2);
+            m_RR->setFirst(m_runstart);
+        }
+        double stmin=et-minute;
+        if (stmin < m_runstart)
+            stmin=m_runstart;
+        double len, st2, et2, adj, b, len2=0;
+
+        // Step back through last minute and count breaths
+        for (int i=idx;i>=0;i--) {
+            st2=exactTime(breaths[i].start);
+            et2=exactTime(breaths[i].end);
+            if (et2 < stmin)
+                break;
+
+            len=et2-st2;
+            if (st2 < stmin) {
+                // Partial breath
+                st2=stmin;
+                adj=et2 - st2;
+                b=(1.0 / len) * adj;
+                len2+=adj;
+            } else {
+                b=1;
+                len2+=len;
+            }
+
+            rr+=b;
+        }
+        if (len2 < minute) {
+            rr*=minute/len2;
+        }
+        // Calculate min & max
+        if (rr < m_minrr)
+            m_minrr=rr;
+        if (rr > m_maxrr)
+            m_maxrr=rr;
+
+        // Use the same gains as ResMed..
+        m_RR->AddEvent(et,rr * 5.0);
+    }
+    /////////////////////////////////////////////////////////////////////
+    // Minute Ventilation
+    /////////////////////////////////////////////////////////////////////
+    if (m_calcMv) {
+        if (!m_MV) {
+            m_MV=m_session->AddEventList(CPAP_MinuteVent,EVL_Event);
+            m_MV->setGain(0.125);
+        }
+        EventDataType mv=(tv/1000.0) * rr;
+        m_MV->AddEvent(et,mv * 8.0);
     }
 }
 
 void FlowParser::flagEvents()
 {
-    if (!PROFILE.cpap->userEventFlagging())  return;
+    CalcSettings settings=CalcSettings::current();
+    if (!settings.userEventFlagging)  return;
 
     int numbreaths=breaths.size();
     if (numbreaths<5) return;
@@ -566,12 +1282,10 @@ void FlowParser::flagEvents()
     //bvalue.reserve(numbreaths*2);
     br.reserve(numbreaths*2);
 
-    double start=m_flow->first();
-   // double sps=1000.0/m_rate;
     double st,mt,et, dur;
     qint64 len;
 
-    bool allowDuplicates=PROFILE.cpap->userEventDuplicates();
+    bool allowDuplicates=settings.userEventDuplicates;
 
     for (int i=0;i<numbreaths;i++) {
         mx=breaths[i].max;
@@ -588,7 +1302,7 @@ void FlowParser::flagEvents()
 
     EventDataType peak=br[idx];//*(br.begin()+idx);
 
-    EventDataType cutoffval=peak * (PROFILE.cpap->userFlowRestriction()/100.0);
+    EventDataType cutoffval=peak * (settings.userFlowRestriction/100.0);
 
     int bs,bm,be, bs1, bm1, be1;
     for (int i=0;i<numbreaths;i++) {
@@ -600,52 +1314,23 @@ void FlowParser::flagEvents()
         mn=breaths[i].min;
         val=mx - mn;
 
-//        if (qAbs(mx) > cutoffval) {
-            bs1=bs;
-            for (;bs1<be;bs1++) {
-                if (qAbs(m_filtered[bs1]) > cutoffval) {
-                    break;
-                }
-            }
-
-            bm1=bm;
-            for (;bm1>bs;bm1--) {
-                if (qAbs(m_filtered[bm1]) > cutoffval) {
-                    break;
-                }
-            }
-            if (bm1>=bs1) {
-                bstart.push_back(bs1);
-                bend.push_back(bm1);
-            }
-  //      }
-    //    if (qAbs(mn) > cutoffval) {
-            bm1=bm;
-            for (;bm1<be;bm1++) {
-                if (qAbs(m_filtered[bm1]) > cutoffval) {
-                    break;
-                }
-            }
-            be1=be;
-            for (;be1>bm;be1--) {
-                if (qAbs(m_filtered[be1]) > cutoffval) {
-                    break;
-                }
-            }
-            if (be1>=bm1) {
-                bstart.push_back(bm1);
-                bend.push_back(be1);
-            }
-//        }
-         st=start + bs1 * m_rate;
-         et=start + be1  * m_rate;
-//         uf2->AddEvent(st,0);
-//         uf3->AddEvent(et,0);
-
+        // Find where each half of the breath gets past the cutoff, skipping segments that never do
+        bs1=firstAbove(bs,be,cutoffval);
+        bm1=lastAbove(bs,bm,cutoffval);
+        if (bm1>=bs1) {
+            bstart.push_back(bs1);
+            bend.push_back(bm1);
+        }
+        bm1=firstAbove(bm,be,cutoffval);
+        be1=lastAbove(bm,be,cutoffval);
+        if (be1>=bm1) {
+            bstart.push_back(bm1);
+            bend.push_back(be1);
+        }
     }
 
 
-    EventDataType duration=PROFILE.cpap->userEventDuration();
+    EventDataType duration=settings.userEventDuration;
     //double lastst=start, lastet=start;
     //EventDataType v;
     int bsize=bstart.size();
@@ -654,8 +1339,8 @@ void FlowParser::flagEvents()
     for (int i=0;i<bsize-1;i++) {
         bs=bend[i];
         be=bstart[i+1];
-        st=start + bs * m_rate;
-        et=start + be  * m_rate;
+        st=sampleTime(bs);
+        et=sampleTime(be);
 
         len=et-st;
         dur=len/1000.0;
@@ -670,80 +1355,67 @@ void FlowParser::flagEvents()
     }
 }
 
-void calcRespRate(Session *session, FlowParser * flowparser)
+int calcRespRate(Session *session, const QList<ChannelID> & outputs, FlowParser * flowparser)
 {
-    if (session->machine()->GetType()!=MT_CPAP) return;
+    if (session->machine()->GetType()!=MT_CPAP) return 0;
 
 //    if (session->machine()->GetClass()!=STR_MACH_PRS1) return;
 
     if (!session->eventlist.contains(CPAP_FlowRate)) {
         //qDebug() << "calcRespRate called without FlowRate waveform available";
-        return; //need flow waveform
+        return 0; //need flow waveform
     }
 
-    bool trashfp;
-    if (!flowparser) {
-        flowparser=new FlowParser();
-        trashfp=true;
-        //qDebug() << "calcRespRate called without valid FlowParser object.. using a slow throw-away!";
-        //return;
-    } else {
-        trashfp=false;
-    }
-
-    bool calcResp=!session->eventlist.contains(CPAP_RespRate);
-    bool calcTv=!session->eventlist.contains(CPAP_TidalVolume);
-    bool calcTi=!session->eventlist.contains(CPAP_Ti);
-    bool calcTe=!session->eventlist.contains(CPAP_Te);
-    bool calcMv=!session->eventlist.contains(CPAP_MinuteVent);
-
+    bool calcResp=outputs.contains(CPAP_RespRate);
+    bool calcTv=outputs.contains(CPAP_TidalVolume);
+    bool calcTi=outputs.contains(CPAP_Ti);
+    bool calcTe=outputs.contains(CPAP_Te);
+    bool calcMv=outputs.contains(CPAP_MinuteVent);
+    bool flagEvents=outputs.contains(CPAP_UserFlag1);
 
     int z=(calcResp ? 1 : 0) + (calcTv ? 1 : 0) + (calcMv ? 1 : 0);
 
     // If any of these three missing, remove all, and switch all on
     if (z>0 && z<3) {
-        if (!calcResp && !calcTv && !calcMv)
         calcTv=calcMv=calcResp=true;
 
-        QVector<EventList *> & list=session->eventlist[CPAP_RespRate];
-        for (int i=0;i<list.size();i++) {
-            delete list[i];
-        }
-        session->eventlist[CPAP_RespRate].clear();
+        session->destroyEvent(CPAP_RespRate);
+        session->destroyEvent(CPAP_TidalVolume);
+        session->destroyEvent(CPAP_MinuteVent);
+    }
 
-        QVector<EventList *> & list2=session->eventlist[CPAP_TidalVolume];
-        for (int i=0;i<list2.size();i++) {
-            delete list2[i];
-        }
-        session->eventlist[CPAP_TidalVolume].clear();
+    if (!calcResp && !calcTv && !calcTi && !calcTe && !calcMv && !flagEvents) {
+        // Nothing to do, so don't waste time parsing the flow waveform
+        return 0;
+    }
 
-        QVector<EventList *> & list3=session->eventlist[CPAP_MinuteVent];
-        for (int i=0;i<list3.size();i++) {
-            delete list3[i];
-        }
-        session->eventlist[CPAP_MinuteVent].clear();
+    if (!flowparser) {
+        // Reuse this threads parser, and the buffers it's already grown
+        flowparser=FlowParser::local();
     }
 
     flowparser->clearFilters();
 
     // No filters works rather well with the new peak detection algorithm..
-    // Although the output could use filtering.
+    // but a short median takes the edge off sensor noise, and now costs next to nothing.
 
     //flowparser->addFilter(FilterPercentile,7,0.5);
-    //flowparser->addFilter(FilterPercentile,5,0.5);
+    flowparser->addFilter(FilterPercentile,5,0.5);
     //flowparser->addFilter(FilterXPass,0.5);
     EventList *flow;
+    int parsed=0;
+
+    // Contiguous EventLists get parsed as one run, breaths and all
+    flowparser->beginStream(session, calcResp, calcTv, calcTi, calcTe, calcMv, flagEvents);
     for (int ws=0; ws < session->eventlist[CPAP_FlowRate].size(); ws++) {
         flow=session->eventlist[CPAP_FlowRate][ws];
         if (flow->count() > 20) {
-            flowparser->openFlow(session, flow);
-            flowparser->calc(calcResp, calcTv, calcTi ,calcTe, calcMv);
-            flowparser->flagEvents();
+            flowparser->addFlow(flow);
+            parsed++;
         }
     }
-    if (trashfp) {
-        delete flowparser;
-    }
+    flowparser->endStream();
+    return parsed;
 }
 
 
@@ -782,29 +1454,55 @@ EventDataType calcAHI(Session *session,qint64 start, qint64 end)
     return ahi;
 }
 
-int calcAHIGraph(Session *session)
+// An apnea type event, for the merged sliding window sweep below
+struct AHIEvent {
+    AHIEvent() { time=0; rera=false; }
+    AHIEvent(qint64 t, bool r) { time=t; rera=r; }
+    qint64 time;
+    bool rera;
+};
+
+bool operator<(const AHIEvent & e1, const AHIEvent & e2)
+{
+    return e1.time < e2.time;
+}
+
+static void addAHIEvents(Session *session, ChannelID code, bool rera, QVector<AHIEvent> & events)
+{
+    QHash<ChannelID,QVector<EventList *> >::iterator it=session->eventlist.find(code);
+    if (it==session->eventlist.end()) return;
+
+    for (int i=0;i<it.value().size();i++) {
+        EventList & el=*(it.value()[i]);
+        qint64 start=el.first();
+        quint32 * tptr=el.rawTime();
+        quint32 * eptr=tptr+el.count();
+        for (; tptr < eptr; tptr++) {
+            events.push_back(AHIEvent(start + *tptr, rera));
+        }
+    }
+}
+
+int calcAHIGraph(Session *session, qint64 window_size_ms, qint64 window_step)
 {
     bool calcrdi=session->machine()->GetClass()=="PRS1";
     //PROFILE.general->calculateRDI()
 
+    CalcSettings settings=CalcSettings::current();
+    if (window_size_ms<=0)
+        window_size_ms=settings.ahiWindow*60000L;
+    if (window_step<=0)
+        window_step=30000; // 30 second windows
 
-    const qint64 window_step=30000; // 30 second windows
-    double window_size=p_profile->cpap->AHIWindow();
-    qint64 window_size_ms=window_size*60000L;
+    double window_size=double(window_size_ms)/60000.0;
 
-    bool zeroreset=p_profile->cpap->AHIReset();
+    bool zeroreset=settings.ahiReset;
 
     if (session->machine()->GetType()!=MT_CPAP) return 0;
 
-    bool hasahi=session->eventlist.contains(CPAP_AHI);
-    bool hasrdi=session->eventlist.contains(CPAP_RDI);
-    if (hasahi && hasrdi)
-        return 0; // abort if already there
-
-    if (!(!hasahi && !hasrdi)) {
-        session->destroyEvent(CPAP_AHI);
-        session->destroyEvent(CPAP_RDI);
-    }
+    // Both are always redone together
+    session->destroyEvent(CPAP_AHI);
+    session->destroyEvent(CPAP_RDI);
 
     if (!session->channelExists(CPAP_Obstructive) &&
             !session->channelExists(CPAP_Hypopnea) &&
@@ -813,13 +1511,27 @@ int calcAHIGraph(Session *session)
             !session->channelExists(CPAP_RERA)
             ) return 0;
 
+    // Merge all the apnea type events into one time sorted stream, so each window
+    // can be counted by sliding two pointers along it, instead of rescanning the lot.
+    QVector<AHIEvent> stream;
+    addAHIEvents(session,CPAP_Obstructive,false,stream);
+    addAHIEvents(session,CPAP_Hypopnea,false,stream);
+    addAHIEvents(session,CPAP_ClearAirway,false,stream);
+    addAHIEvents(session,CPAP_Apnea,false,stream);
+    if (calcrdi)
+        addAHIEvents(session,CPAP_RERA,true,stream);
+    qStable_sort(stream.begin(),stream.end());
+
+    const AHIEvent * sp=stream.constData();
+    const int size=stream.size();
+
     qint64 first=session->first(),
-           last=session->last(),
-           f;
+           last=session->last();
 
     EventList *AHI=new EventList(EVL_Event);
     AHI->setGain(0.02);
     session->eventlist[CPAP_AHI].push_back(AHI);
+    session->setChannelDirty(CPAP_AHI);
 
     EventList *RDI=NULL;
 
@@ -827,6 +1539,7 @@ int calcAHIGraph(Session *session)
         RDI=new EventList(EVL_Event);
         RDI->setGain(0.02);
         session->eventlist[CPAP_RDI].push_back(RDI);
+        session->setChannelDirty(CPAP_RDI);
     }
 
     EventDataType ahi,rdi;
@@ -837,19 +1550,30 @@ int calcAHIGraph(Session *session)
     double avgrdi=0;
     int cnt=0;
 
+    // Window is [sp[lo].time .. sp[hi-1].time], with the apnea & RERA counts inside it
+    int lo=0, hi=0;
+    int ahicnt=0, reracnt=0;
+
     double events;
     double hours=(window_size/60.0);
     if (zeroreset) {
         // I personally don't see the point of resetting each hour.
         do {
-            // For each window, in 30 second increments
+            // Drop everything before this period
+            for (; (lo < hi) && (sp[lo].time < ti); lo++) {
+                if (sp[lo].rera) reracnt--; else ahicnt--;
+            }
+            for (; (lo < size) && (sp[lo].time < ti); lo++);
+            if (hi < lo) hi=lo;
+
+            // For each window, in window_step increments
             for (qint64 t=ti;t < ti+window_size_ms; t+=window_step) {
                 if (t > last)
                     break;
-                events=session->rangeCount(CPAP_Obstructive,ti,t)
-                        +session->rangeCount(CPAP_Hypopnea,ti,t)
-                        +session->rangeCount(CPAP_ClearAirway,ti,t)
-                        +session->rangeCount(CPAP_Apnea,ti,t);
+                for (; (hi < size) && (sp[hi].time <= t); hi++) {
+                    if (sp[hi].rera) reracnt++; else ahicnt++;
+                }
+                events=ahicnt;
 
                 ahi = events / hours;
 
@@ -857,7 +1581,7 @@ int calcAHIGraph(Session *session)
                 avgahi+=ahi;
 
                 if (calcrdi) {
-                    events+=session->rangeCount(CPAP_RERA,ti,t);
+                    events+=reracnt;
                     rdi=events / hours;
                     RDI->AddEvent(t,rdi * 50);
                     avgrdi+=rdi;
@@ -870,48 +1594,247 @@ int calcAHIGraph(Session *session)
         } while (ti<last);
 
     } else {
+        qint64 f;
         for (ti=first;ti<last;ti+=window_step) {
             f=ti-window_size_ms;
-            //hours=window_size; //double(ti-f)/3600000L;
 
-            events=session->rangeCount(CPAP_Obstructive,f,ti)
-                    +session->rangeCount(CPAP_Hypopnea,f,ti)
-                    +session->rangeCount(CPAP_ClearAirway,f,ti)
-                    +session->rangeCount(CPAP_Apnea,f,ti);
+            for (; (hi < size) && (sp[hi].time <= ti); hi++) {
+                if (sp[hi].rera) reracnt++; else ahicnt++;
+            }
+            for (; (lo < hi) && (sp[lo].time < f); lo++) {
+                if (sp[lo].rera) reracnt--; else ahicnt--;
+            }
+
+            events=ahicnt;
+
+            ahi=events/hours;
+            avgahi+=ahi;
+            AHI->AddEvent(ti,ahi * 50);
+
+            if (calcrdi) {
+                events+=reracnt;
+                rdi=events/hours;
+                RDI->AddEvent(ti,rdi * 50);
+                avgrdi+=rdi;
+            }
+
+            cnt++;
+            lastti=ti;
+        }
+    }
+    AHI->AddEvent(lastti,0);
+    if (calcrdi)
+        RDI->AddEvent(lastti,0);
+
+    if (!cnt) {
+            avgahi=0;
+            avgrdi=0;
+    } else {
+        avgahi/=double(cnt);
+        avgrdi/=double(cnt);
+    }
+    cnt++;
+    session->setAvg(CPAP_AHI,avgahi);
+    if (calcrdi)
+        session->setAvg(CPAP_RDI,avgrdi);
+    return cnt;
+}
+LeakHistogram::LeakHistogram()
+{
+    m_plow=m_llow=m_lwidth=0;
+    m_count=0;
+}
+
+LeakHistogram::LeakHistogram(const LeakHistogram & copy)
+{
+    *this=copy;
+}
+
+LeakHistogram & LeakHistogram::operator=(const LeakHistogram & copy)
+{
+    m_plow=copy.m_plow;
+    m_llow=copy.m_llow;
+    m_lwidth=copy.m_lwidth;
+    m_rows=copy.m_rows;
+    m_cumulative=copy.m_cumulative;
+    m_totals=copy.m_totals;
+    m_dirty=copy.m_dirty;
+    m_count=copy.m_count;
+    return *this;
+}
+
+void LeakHistogram::clear()
+{
+    m_plow=m_llow=m_lwidth=0;
+    m_rows.clear();
+    m_cumulative.clear();
+    m_totals.clear();
+    m_dirty.clear();
+    m_count=0;
+}
+
+void LeakHistogram::grow(EventStoreType pressure, EventStoreType leak)
+{
+    // Leave a little room either side, so a leak range creeping out doesn't relayout every time
+    const int slack=32;
+    int l=leak, p=pressure;
+
+    if (m_lwidth==0) {
+        m_llow=l-slack;
+        m_lwidth=slack*2+1;
+    } else if ((l < m_llow) || (l >= m_llow+m_lwidth)) {
+        int low=qMin(m_llow,l-slack), high=qMax(m_llow+m_lwidth,l+slack+1);
+        int shift=m_llow-low, width=high-low;
+        for (int i=0;i<m_rows.size();i++) {
+            if (m_rows[i].isEmpty()) continue;
+            QVector<quint32> row(width,0);
+            memcpy(row.data()+shift,m_rows[i].constData(),m_lwidth*sizeof(quint32));
+            m_rows[i]=row;
+            m_dirty[i]=true;
+        }
+        m_llow=low;
+        m_lwidth=width;
+    }
+
+    if (m_rows.isEmpty()) {
+        m_plow=p;
+    }
+    if (p < m_plow) {
+        int n=m_plow-p;
+        m_rows.insert(0,n,QVector<quint32>());
+        m_cumulative.insert(0,n,QVector<quint32>());
+        m_totals.insert(0,n,0);
+        m_dirty.insert(0,n,false);
+        m_plow=p;
+    } else if (p >= m_plow+m_rows.size()) {
+        int size=p-m_plow+1;
+        m_rows.resize(size);
+        m_cumulative.resize(size);
+        m_totals.resize(size);
+        m_dirty.resize(size);
+    }
+
+    int row=p-m_plow;
+    if (m_rows[row].isEmpty()) {
+        m_rows[row].fill(0,m_lwidth);
+        m_totals[row]=0;
+        m_dirty[row]=true;
+    }
+}
+
+void LeakHistogram::merge(const LeakHistogram & other)
+{
+    for (int i=0;i<other.m_rows.size();i++) {
+        const QVector<quint32> & row=other.m_rows.at(i);
+        if (row.isEmpty()) continue;
+        EventStoreType pressure=other.m_plow+i;
+        for (int j=0;j<other.m_lwidth;j++) {
+            if (row.at(j)) add(pressure,other.m_llow+j,row.at(j));
+        }
+    }
+}
+
+void LeakHistogram::unmerge(const LeakHistogram & other)
+{
+    // Everything in other was merged in, so it all has room already
+    int shift=other.m_llow-m_llow;
+    for (int i=0;i<other.m_rows.size();i++) {
+        const QVector<quint32> & row=other.m_rows.at(i);
+        int r=other.m_plow+i-m_plow;
+        if (row.isEmpty() || (r < 0) || (r >= m_rows.size()) || m_rows[r].isEmpty()) continue;
+        quint32 * counts=m_rows[r].data();
+        for (int j=0;j<other.m_lwidth;j++) {
+            int col=j+shift;
+            if (!row.at(j) || (col < 0) || (col >= m_lwidth)) continue;
+            quint32 n=qMin(row.at(j),counts[col]);
+            counts[col]-=n;
+            m_totals[r]-=n;
+            m_count-=n;
+        }
+        m_dirty[r]=true;
+    }
+}
+
+QVector<EventStoreType> LeakHistogram::pressures() const
+{
+    QVector<EventStoreType> list;
+    for (int i=0;i<m_rows.size();i++) {
+        if (m_totals.at(i) > 0) list.push_back(m_plow+i);
+    }
+    return list;
+}
 
-            ahi=events/hours;
-            avgahi+=ahi;
-            AHI->AddEvent(ti,ahi * 50);
+quint32 LeakHistogram::total(EventStoreType pressure) const
+{
+    int row=int(pressure)-m_plow;
+    if ((row < 0) || (row >= m_totals.size())) return 0;
+    return m_totals.at(row);
+}
 
-            if (calcrdi) {
-                events+=session->rangeCount(CPAP_RERA,f,ti);
-                rdi=events/hours;
-                RDI->AddEvent(ti,rdi * 50);
-                avgrdi+=rdi;
-            }
+const quint32 * LeakHistogram::row(EventStoreType pressure) const
+{
+    int row=int(pressure)-m_plow;
+    if ((row < 0) || (row >= m_rows.size()) || m_rows.at(row).isEmpty()) return NULL;
+    return m_rows.at(row).constData();
+}
 
-            cnt++;
-            lastti=ti;
-            ti+=window_step;
+EventStoreType LeakHistogram::leakAtCount(EventStoreType pressure, quint32 n)
+{
+    int row=int(pressure)-m_plow;
+    if ((row < 0) || (row >= m_rows.size()) || (m_totals[row]==0)) return 0;
+
+    QVector<quint32> & cumulative=m_cumulative[row];
+    if (m_dirty[row]) {
+        const quint32 * counts=m_rows[row].constData();
+        cumulative.resize(m_lwidth);
+        quint32 sum=0;
+        for (int j=0;j<m_lwidth;j++) {
+            sum+=counts[j];
+            cumulative[j]=sum;
         }
+        m_dirty[row]=false;
     }
-    AHI->AddEvent(lastti,0);
-    if (calcrdi)
-        RDI->AddEvent(lastti,0);
+    const quint32 * begin=cumulative.constData();
+    int idx=qLowerBound(begin,begin+m_lwidth,n)-begin;
+    if (idx >= m_lwidth) idx=m_lwidth-1;
+    return m_llow+idx;
+}
 
-    if (!cnt) {
-            avgahi=0;
-            avgrdi=0;
-    } else {
-        avgahi/=double(cnt);
-        avgrdi/=double(cnt);
+QDataStream & operator<<(QDataStream & out, const LeakHistogram & hist)
+{
+    // Only the counts are stored, as (pressure, leak, count) triples
+    quint32 cells=0;
+    for (int i=0;i<hist.m_rows.size();i++) {
+        const QVector<quint32> & row=hist.m_rows.at(i);
+        for (int j=0;j<row.size();j++) {
+            if (row.at(j)) cells++;
+        }
     }
-    cnt++;
-    session->setAvg(CPAP_AHI,avgahi);
-    if (calcrdi)
-        session->setAvg(CPAP_RDI,avgrdi);
-    return cnt;
+    out << cells;
+    for (int i=0;i<hist.m_rows.size();i++) {
+        const QVector<quint32> & row=hist.m_rows.at(i);
+        for (int j=0;j<row.size();j++) {
+            if (!row.at(j)) continue;
+            out << (qint16)(hist.m_plow+i) << (qint16)(hist.m_llow+j) << row.at(j);
+        }
+    }
+    return out;
+}
+
+QDataStream & operator>>(QDataStream & in, LeakHistogram & hist)
+{
+    quint32 cells, count;
+    qint16 pressure, leak;
+    hist.clear();
+    in >> cells;
+    for (quint32 i=0;i<cells;i++) {
+        in >> pressure >> leak >> count;
+        if (in.status()!=QDataStream::Ok) break;
+        hist.add(pressure,leak,count);
+    }
+    return in;
 }
+
 struct TimeValue {
     TimeValue() {
         time=0;
@@ -934,14 +1857,26 @@ public:
     zMaskProfile(MaskType type, QString name);
     ~zMaskProfile();
 
-    void reset() { pressureleaks.clear(); }
+    void reset() {
+        pressureleaks.clear();
+        pressuremax.clear();
+        pressuremin.clear();
+        pressurecount.clear();
+        pressuretotal.clear();
+        pressuremean.clear();
+        pressurestddev.clear();
+    }
     void scanLeaks(Session * session);
     void scanPressure(Session * session);
     void updatePressureMin();
-    void updateProfile(Session * session);
 
-    void load(Profile * profile);
-    void save();
+    //! \brief Tallies sessions pressure & leak data into pressureleaks
+    void addSession(Session * session);
+
+    //! \brief Works out the leak baseline from everything in pressureleaks
+    void update();
+
+    void updateProfile(Session * session);
 
     QMap<EventStoreType, EventDataType> pressuremax;
     QMap<EventStoreType, EventDataType> pressuremin;
@@ -952,19 +1887,17 @@ public:
 
     QVector<TimeValue> Pressure;
 
+    LeakHistogram pressureleaks;
+
     EventDataType calcLeak(EventStoreType pressure);
 
 protected:
-    static const quint32 version=0;
     void scanLeakList(EventList * leak);
     void scanPressureList(EventList * el);
 
     MaskType    m_type;
     QString     m_name;
-    Profile     * m_profile;
-    QString     m_filename;
 
-    QMap<EventStoreType, QMap<EventStoreType,quint32> > pressureleaks;
     EventDataType maxP,minP,maxL,minL,m_factor;
 };
 
@@ -973,52 +1906,47 @@ bool operator<(const TimeValue &p1, const TimeValue & p2) {
     return p1.time < p2.time;
 }
 
-zMaskProfile::zMaskProfile(MaskType type, QString name)
-    :m_type(type), m_name(name)
-{
-}
-zMaskProfile::~zMaskProfile()
-{
-    save();
-}
+/*! \struct PressureCursor
+    \brief Finds the pressure in effect at each of a run of ascending times, in one merge-walk
+    over the time sorted pressure list rather than a scan from the start for every lookup
+    */
+struct PressureCursor {
+    PressureCursor(const QVector<TimeValue> & pressure):m_pressure(pressure) {
+        m_idx=0;
+        m_last=0;
+    }
 
-void zMaskProfile::load(Profile * profile)
-{
-    m_profile=profile;
-    m_filename=m_profile->Get("{"+STR_GEN_DataFolder+"}/MaskProfile.mp");
-    QFile f(m_filename);
-    if (!f.open(QFile::ReadOnly))
-        return;
+    //! \brief Sets value to the pressure at time. Returns false if time is outside the pressure data
+    bool find(qint64 time, EventStoreType & value) {
+        int last=m_pressure.size()-1;
+        if ((last<1) || (time < m_pressure[0].time) || (time > m_pressure[last].time))
+            return false;
 
-    QDataStream in(&f);
-    in.setVersion(QDataStream::Qt_4_6);
-    in.setByteOrder(QDataStream::LittleEndian);
+        // Times only go backwards at the start of another EventList
+        if (time < m_last) m_idx=0;
+        m_last=time;
 
-    quint32 m,v;
-    in >> m;
-    in >> v;
-    if (m!=magic) {
-        qDebug() << "Magic wrong in zMaskProfile::load";
+        const TimeValue * p=m_pressure.constData();
+        while (!((p[m_idx+1].time > time) && (p[m_idx].time <= time)) && (p[m_idx+1].time != time)) {
+            m_idx++;
+        }
+        value=(p[m_idx+1].time==time) ? p[m_idx+1].value : p[m_idx].value;
+        return true;
     }
 
-    in >> pressureleaks;
-    f.close();
+protected:
+    const QVector<TimeValue> & m_pressure;
+    int m_idx;
+    qint64 m_last;
+};
+
+zMaskProfile::zMaskProfile(MaskType type, QString name)
+    :m_type(type), m_name(name)
+{
+    maxP=minP=maxL=minL=m_factor=0;
 }
-void zMaskProfile::save()
+zMaskProfile::~zMaskProfile()
 {
-    QFile f(m_filename);
-    if (!f.open(QFile::WriteOnly))
-        return;
-
-    QDataStream out(&f);
-    out.setVersion(QDataStream::Qt_4_6);
-    out.setByteOrder(QDataStream::LittleEndian);
-
-    out << (quint32)magic;
-    out << (quint32)version;
-
-    out << pressureleaks;
-    f.close();
 }
 
 void zMaskProfile::scanPressureList(EventList * el)
@@ -1046,20 +1974,16 @@ void zMaskProfile::scanPressure(Session * session)
     if (session->eventlist.contains(CPAP_Pressure)) {
         prescnt=session->count(CPAP_Pressure);
         Pressure.reserve(prescnt);
-        for (int j=0;j<session->eventlist[CPAP_Pressure].size();j++) {
-            QVector<EventList *> & el=session->eventlist[CPAP_Pressure];
-            for (int e=0;e<el.size();e++) {
-                scanPressureList(el[e]);
-            }
+        QVector<EventList *> & el=session->eventlist[CPAP_Pressure];
+        for (int e=0;e<el.size();e++) {
+            scanPressureList(el[e]);
         }
     } else if (session->eventlist.contains(CPAP_IPAP)) {
         prescnt=session->count(CPAP_IPAP);
         Pressure.reserve(prescnt);
-        for (int j=0;j<session->eventlist[CPAP_IPAP].size();j++) {
-            QVector<EventList *> & el=session->eventlist[CPAP_IPAP];
-            for (int e=0;e<el.size();e++) {
-                scanPressureList(el[e]);
-            }
+        QVector<EventList *> & el=session->eventlist[CPAP_IPAP];
+        for (int e=0;e<el.size();e++) {
+            scanPressureList(el[e]);
         }
     }
     qSort(Pressure);
@@ -1079,32 +2003,21 @@ void zMaskProfile::scanLeakList(EventList * el)
     QMap<EventStoreType, EventDataType>::iterator pmin;
     qint64 ti;
     bool found;
+    if (Pressure.isEmpty()) return;
+
+    PressureCursor cursor(Pressure);
     for (;dptr<eptr;dptr++) {
         leak=*dptr;
         ti=start + *tptr++;
 
-        found=false;
-        pressure=Pressure[0].value;
         if (Pressure.size()>1) {
-            for (int i=0;i<Pressure.size()-1;i++) {
-                const TimeValue & p1=Pressure[i];
-                const TimeValue & p2=Pressure[i+1];
-
-                if ((p2.time > ti) && (p1.time <= ti)) {
-                    pressure=p1.value;
-                    found=true;
-                    break;
-                } else if (p2.time==ti) {
-                    pressure=p2.value;
-                    found=true;
-                    break;
-                }
-            }
+            found=cursor.find(ti,pressure);
         } else {
+            pressure=Pressure[0].value;
             found=true;
         }
         if (found) {
-            pressureleaks[pressure][leak]++;
+            pressureleaks.add(pressure,leak);
 //            pmin=pressuremin.find(pressure);
 //            fleak=EventDataType(leak) * gain;
 //            if (pmin==pressuremin.end()) {
@@ -1132,262 +2045,557 @@ void zMaskProfile::scanLeaks(Session * session)
 }
 void zMaskProfile::updatePressureMin()
 {
-    QMap<EventStoreType, QMap<EventStoreType,quint32> >::iterator it;
+    QVector<EventStoreType> pressures=pressureleaks.pressures();
 
     EventStoreType pressure;
-    //EventDataType perc=0.1;
-    //EventDataType tmp,l1,l2;
-    //int idx1, idx2,
-    int lks;
-    double SN;
     double percentile=0.40;
+    double SN, nthi;
+    EventStoreType v1;
 
-    double p=100.0*percentile;
-    double nth,nthi;
+    for (int i=0;i<pressures.size();i++) {
+        pressure=pressures[i];
 
-    int sum1,sum2,w1,w2,N,k;
+        // Row totals are kept while tallying
+        SN=pressureleaks.total(pressure);
+        pressuretotal[pressure]=SN;
 
-    for (it=pressureleaks.begin();it!=pressureleaks.end();it++) {
-        pressure=it.key();
-        QMap<EventStoreType,quint32> & leakmap = it.value();
-        lks=leakmap.size();
-        SN=0;
+        nthi=floor(double(SN)*percentile); // index of the position in the unweighted set would be
 
-        // First sum total counts of all leaks
-        for (QMap<EventStoreType,quint32>::iterator lit=leakmap.begin();lit!=leakmap.end();lit++) {
-            SN+=lit.value();
-        }
+        // First leak value whose cumulative count reaches nthi, found in the rows prefix sums
+        v1=pressureleaks.leakAtCount(pressure,qMax(quint32(nthi),quint32(1)));
+        pressuremin[pressure]=v1;
+        pressurecount[pressure]=pressureleaks.row(pressure)[v1-pressureleaks.leakLow()];
+    }
+}
+
+EventDataType zMaskProfile::calcLeak(EventStoreType pressure)
+{
+    if (maxP==minP)
+        return pressuremin[pressure];
+
+    EventDataType leak=(pressure-minP) * (m_factor) + minL;
+    return leak;
+
+}
+
+void zMaskProfile::addSession(Session * session)
+{
+    scanPressure(session);
+    scanLeaks(session);
+}
+
+void zMaskProfile::updateProfile(Session * session)
+{
+    addSession(session);
+    update();
+}
+
+void zMaskProfile::update()
+{
+    updatePressureMin();
+
+    if (pressuremin.size()<=1) {
+        maxP=minP=0;
+        maxL=minL=0;
+        m_factor=0;
+        return;
+    }
+    EventDataType p,tmp,mean,sum;
+    minP=250,maxP=0;
+    minL=1000, maxL=0;
 
+    long cnt=0;
+    int n;
 
-        nth=double(SN)*percentile; // index of the position in the unweighted set would be
-        nthi=floor(nth);
+    EventDataType maxcnt, maxval, lastval, lastcnt;
 
-        sum1=0,sum2=0;
-        w1,w2=0;
+    QVector<EventStoreType> pressures=pressureleaks.pressures();
+    int llow=pressureleaks.leakLow(), width=pressureleaks.leakWidth();
+    const quint32 * row;
+    EventStoreType key;
+    quint32 value;
 
-        EventDataType v1=0,v2;
+    for (int i=0;i<pressures.size();i++) {
+        p=pressures[i];
+        row=pressureleaks.row(pressures[i]);
+        cnt=0;
+        n=0;
+        sum=0;
 
-        N=leakmap.size();
-        k=0;
+        // Walk the dense row in ascending leak order, skipping empty buckets
+        maxcnt=0, maxval=0, lastval=0, lastcnt=0;
+        for (int j=0;j<width;j++) {
+            if (!(value=row[j])) continue;
+            key=llow+j;
+            n++;
+            cnt+=value;
+            if (value > maxcnt) {
+                lastcnt=maxcnt;
+                maxcnt=value;
+                lastval=maxval;
+                maxval=key;
 
-        bool found=false;
-        double total=0;
-        for (QMap<EventStoreType,quint32>::iterator lit=leakmap.begin();lit!=leakmap.end();lit++,k++) {
-            total+=lit.value();
+            }
+            sum+=key * value;
+        }
+        pressuremean[p]=mean=sum / EventDataType(cnt);
+        if (lastval > 0) {
+            maxval=qMax(maxval,lastval); //((maxval*maxcnt)+(lastval*lastcnt)) / (maxcnt+lastcnt);
+        }
+        pressuremax[p]=lastval;
+        sum=0;
+        for (int j=0;j<width;j++) {
+            if (!row[j]) continue;
+            key=llow+j;
+            tmp=key-mean;
+            sum+=tmp * tmp;
         }
-        pressuretotal[pressure]=total;
-        for (QMap<EventStoreType,quint32>::iterator lit=leakmap.begin();lit!=leakmap.end();lit++,k++) {
-        //for (k=0;k < N;k++) {
-            v1=lit.key();
-            w1=lit.value();
-            sum1+=w1;
+        pressurestddev[p]=tmp=sqrt(sum / EventDataType(n));
+    }
+    QMap<EventStoreType, EventDataType> pressureval;
+    EventDataType max=0,tmp2,tmp3;
+    for (QMap<EventStoreType, EventDataType>::iterator it=pressuretotal.begin();it!=pressuretotal.end();it++) {
+        if (max < it.value()) max=it.value();
+    }
+    for (QMap<EventStoreType, EventDataType>::iterator it=pressuretotal.begin();it!=pressuretotal.end();it++) {
+        p=it.key();
+        tmp=pressurecount[p];
+        tmp2=it.value();
 
-            if (sum1 > nthi) {
-                pressuremin[pressure]=v1;
-                pressurecount[pressure]=w1;
-                found=true;
-                break;
+        tmp3=(tmp / tmp2) * (tmp2 / max);
+        if (tmp3 > 0.05) {
+            tmp=pressuremean[p];
+            if (tmp>0) {
+                pressureval[p]=tmp; // / tmp2;
+                if (p < minP) minP = p;
+                if (p > maxP) maxP = p;
+                if (tmp < minL) minL = tmp;
+                if (tmp > maxL) maxL = tmp;
             }
-            if (sum1 == nthi) {
-                break; // boundary condition
+        }
+    }
+
+    if ((maxP==minP)  || (minL==maxL) || (minP==250) || (minL==1000)) {
+        // crappy data set
+        maxP=minP=0;
+        maxL=minL=0;
+        m_factor=0;
+        return;
+    }
+    m_factor = (maxL - minL) / (maxP - minP);
+}
+
+/*! \struct MaskLeakNight
+    \brief One sessions entry in the mask leak history. The histogram lives in a file of its own,
+    and is only held in memory while the night is part of its machines running window
+    */
+struct MaskLeakNight {
+    MaskLeakNight() {
+        start=0;
+        count=0;
+        loaded=saved=false;
+    }
+    MaskLeakNight(qint64 _start, quint32 _count) {
+        start=_start;
+        count=_count;
+        loaded=saved=false;
+    }
+    MaskLeakNight(const MaskLeakNight & copy) {
+        start=copy.start;
+        count=copy.count;
+        loaded=copy.loaded;
+        saved=copy.saved;
+        leaks=copy.leaks;
+    }
+    qint64 start;
+    //! \brief Samples tallied, 0 for nights without leak data
+    quint32 count;
+    //! \brief Whether leaks holds the nights histogram
+    bool loaded;
+    //! \brief Whether the histogram is in the nights file
+    bool saved;
+    LeakHistogram leaks;
+};
+
+//! \brief Orders nights by starting time, then session
+typedef QPair<qint64, SessionID> MaskLeakKey;
+
+/*! \struct MaskLeakHistory
+    \brief A machines nights, which calcLeaks draws each baseline from, and the last baseline window drawn
+    */
+struct MaskLeakHistory {
+    //! \brief Every recorded night, by session
+    QHash<SessionID, MaskLeakNight> nights;
+    //! \brief Sample counts of the nights with leak data, in order of starting time
+    QMap<MaskLeakKey, quint32> order;
+    //! \brief Nights in the running window. Neighbouring sessions windows mostly overlap, so the
+    //! next one only has to add and take away the difference
+    QSet<SessionID> window;
+    //! \brief The window nights histograms, summed
+    LeakHistogram merged;
+};
+
+static const quint32 maskHistoryVersion=3;
+
+//! \brief Most sessions with leak data (counting the one being calculated) a baseline is drawn from
+static const int maskHistorySessions=30;
+
+static QMutex maskHistoryMutex;
+static QHash<MachineID, MaskLeakHistory> maskHistory;
+static QString maskHistoryFile;
+static bool maskHistoryLoaded=false;
+static bool maskHistoryChanged=false;
+
+// These all expect maskHistoryMutex to be held
+static QString maskLeakNightFile(MachineID machine, SessionID session)
+{
+    QString name;
+    name.sprintf("/MaskLeaks/%08lx/%08lx.mlh",machine,session);
+    return QFileInfo(maskHistoryFile).absolutePath()+name;
+}
+
+static bool writeMaskLeakNight(MachineID machine, SessionID session, const LeakHistogram & leaks)
+{
+    if (maskHistoryFile.isEmpty())
+        return false;
+
+    QString filename=maskLeakNightFile(machine,session);
+    QDir().mkpath(QFileInfo(filename).absolutePath());
+    QFile f(filename);
+    if (!f.open(QFile::WriteOnly)) {
+        qWarning() << "Couldn't write mask leak night" << filename;
+        return false;
+    }
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_4_6);
+    out.setByteOrder(QDataStream::LittleEndian);
+
+    out << (quint32)magic;
+    out << (quint32)maskHistoryVersion;
+    out << (quint32)session;
+    out << leaks;
+    f.close();
+    return true;
+}
+
+static bool readMaskLeakNight(MachineID machine, SessionID session, LeakHistogram & leaks)
+{
+    leaks.clear();
+    QFile f(maskLeakNightFile(machine,session));
+    if (!f.open(QFile::ReadOnly))
+        return false;
+
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_4_6);
+    in.setByteOrder(QDataStream::LittleEndian);
+
+    quint32 m,v,id;
+    in >> m;
+    in >> v;
+    in >> id;
+    if ((m!=magic) || (v!=maskHistoryVersion) || (id!=quint32(session)))
+        return false;
+    in >> leaks;
+    return in.status()==QDataStream::Ok;
+}
+
+// Lets a saved nights histogram go, now its not needed in memory
+static void unloadMaskLeakNight(MaskLeakNight & night)
+{
+    if (night.saved) {
+        night.leaks.clear();
+        night.loaded=false;
+    }
+}
+
+// Takes session out of the history, its window and its file
+static bool forgetMaskLeakNight(MaskLeakHistory & history, MachineID machine, SessionID session)
+{
+    QHash<SessionID, MaskLeakNight>::iterator it=history.nights.find(session);
+    if (it==history.nights.end())
+        return false;
+
+    // Window nights are always loaded
+    if (history.window.remove(session))
+        history.merged.unmerge(it.value().leaks);
+    history.order.remove(MaskLeakKey(it.value().start,session));
+    if (it.value().saved)
+        QFile::remove(maskLeakNightFile(machine,session));
+    history.nights.erase(it);
+    return true;
+}
+
+// Only the index is written here. Each nights histogram is written when it's stored
+static void writeMaskLeakHistory()
+{
+    if (!maskHistoryChanged || maskHistoryFile.isEmpty())
+        return;
+
+    QFile f(maskHistoryFile);
+    if (!f.open(QFile::WriteOnly)) {
+        qWarning() << "Couldn't write mask leak history" << maskHistoryFile;
+        return;
+    }
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_4_6);
+    out.setByteOrder(QDataStream::LittleEndian);
+
+    out << (quint32)magic;
+    out << (quint32)maskHistoryVersion;
+    out << (quint32)maskHistory.size();
+    for (QHash<MachineID, MaskLeakHistory>::iterator it=maskHistory.begin();it!=maskHistory.end();it++) {
+        const QHash<SessionID, MaskLeakNight> & nights=it.value().nights;
+        out << (quint32)it.key();
+        out << (quint32)nights.size();
+        for (QHash<SessionID, MaskLeakNight>::const_iterator n=nights.begin();n!=nights.end();n++) {
+            out << (quint32)n.key();
+            out << n.value().start;
+            out << n.value().count;
+        }
+    }
+    f.close();
+    maskHistoryChanged=false;
+}
+
+static void readMaskLeakHistory(const QString & filename)
+{
+    maskHistory.clear();
+    maskHistoryFile=filename;
+    maskHistoryLoaded=true;
+    maskHistoryChanged=false;
+
+    QFile f(filename);
+    if (filename.isEmpty() || !f.open(QFile::ReadOnly))
+        return;
+
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_4_6);
+    in.setByteOrder(QDataStream::LittleEndian);
+
+    quint32 m,v,machines,nights,id,session;
+    in >> m;
+    in >> v;
+    if ((m!=magic) || ((v!=maskHistoryVersion) && (v!=2))) {
+        // Older files lumped each machines nights together, so they can't be taken apart again
+        qDebug() << "Mask leak history" << filename << "is out of date, starting afresh";
+        return;
+    }
+    if (v==2) {
+        // Version 2 kept every histogram in here. Give each one its own file
+        qDebug() << "Moving mask leak history" << filename << "into separate nights";
+        maskHistoryChanged=true;
+    }
+    in >> machines;
+    for (quint32 i=0;(i<machines) && (in.status()==QDataStream::Ok);i++) {
+        in >> id;
+        MaskLeakHistory & history=maskHistory[id];
+        in >> nights;
+        for (quint32 j=0;(j<nights) && (in.status()==QDataStream::Ok);j++) {
+            in >> session;
+            MaskLeakNight & night=history.nights[session];
+            in >> night.start;
+            if (v==2) {
+                in >> night.leaks;
+                night.count=night.leaks.count();
+                night.saved=night.count && writeMaskLeakNight(id,session,night.leaks);
+                night.loaded=true;
+                unloadMaskLeakNight(night);
+            } else {
+                in >> night.count;
+                night.saved=(night.count>0);
             }
+            if (night.count)
+                history.order[MaskLeakKey(night.start,session)]=night.count;
         }
-        if (found) continue;
-        if (k>=N) {
-            pressuremin[pressure]=v1;
-            pressurecount[pressure]=w1;
-            continue;
+    }
+    f.close();
+}
+
+static void loadMaskLeakHistory(const QString & filename)
+{
+    if (!maskHistoryLoaded || (filename!=maskHistoryFile)) {
+        // Profile changed, so put the last ones away first
+        writeMaskLeakHistory();
+        readMaskLeakHistory(filename);
+    }
+}
+
+/*! \brief Brings historys running window round to the nights in window, then copies its sum into leaks.
+    Nights whose histograms can't be read are dropped from the history, so they get recorded again */
+static void mergeMaskLeakWindow(MaskLeakHistory & history, MachineID machine, const QList<SessionID> & window, LeakHistogram & leaks)
+{
+    QSet<SessionID> wanted=window.toSet();
+    QSet<SessionID> out=history.window;
+    out.subtract(wanted);
+    QSet<SessionID> in=wanted;
+    in.subtract(history.window);
+
+    // Starting again is less work when most of the window has moved
+    bool restart=(out.size()+in.size() > wanted.size());
+    if (restart) {
+        history.merged.clear();
+        in=wanted;
+    }
+    for (QSet<SessionID>::iterator it=out.begin();it!=out.end();it++) {
+        MaskLeakNight & night=history.nights[*it];
+        if (!restart) history.merged.unmerge(night.leaks);
+        unloadMaskLeakNight(night);
+    }
+    for (QSet<SessionID>::iterator it=in.begin();it!=in.end();it++) {
+        MaskLeakNight & night=history.nights[*it];
+        if (!night.loaded) {
+            if (!readMaskLeakNight(machine,*it,night.leaks)) {
+                qWarning() << "Couldn't read mask leak night" << maskLeakNightFile(machine,*it);
+                history.window.remove(*it);
+                forgetMaskLeakNight(history,machine,*it);
+                wanted.remove(*it);
+                maskHistoryChanged=true;
+                continue;
+            }
+            night.loaded=true;
         }
+        history.merged.merge(night.leaks);
+    }
+    history.window=wanted;
+    leaks=history.merged;
+}
 
-        v2=(leakmap.begin()+(k+1)).key();
-        w2=(leakmap.begin()+(k+1)).value();
-        sum2=sum1+w2;
-        // value lies between v1 and v2
-
-        double px=100.0/double(SN); // Percentile represented by one full value
-
-        // calculate percentile ranks
-        double p1=px * (double(sum1)-(double(w1)/2.0));
-        double p2=px * (double(sum2)-(double(w2)/2.0));
+void saveMaskLeakHistory()
+{
+    QMutexLocker lock(&maskHistoryMutex);
+    writeMaskLeakHistory();
+}
 
-        // calculate linear interpolation
-        double v=v1 + ((p-p1)/(p2-p1)) * (v2-v1);
-        pressuremin[pressure]=v;
-        pressurecount[pressure]=w1;
+// Stores sessions histogram, unless it's already there
+static void storeMaskLeakNight(Session * session, const LeakHistogram & leaks)
+{
+    QString filename=CalcSettings::current().maskProfileFile;
+    MachineID machine=session->machine()->id();
+    SessionID id=session->session();
+
+    QMutexLocker lock(&maskHistoryMutex);
+    loadMaskLeakHistory(filename);
+    MaskLeakHistory & history=maskHistory[machine];
+    QHash<SessionID, MaskLeakNight>::iterator it=history.nights.find(id);
+    if ((it!=history.nights.end()) && (it.value().start==session->first()) && (it.value().count==leaks.count()))
+        return;
 
+    forgetMaskLeakNight(history,machine,id);
+    MaskLeakNight night(session->first(),leaks.count());
+    if (night.count) {
+        night.saved=writeMaskLeakNight(machine,id,leaks);
+        if (!night.saved) {
+            night.leaks=leaks;
+            night.loaded=true;
+        }
+        history.order[MaskLeakKey(night.start,id)]=night.count;
     }
+    history.nights[id]=night;
+    maskHistoryChanged=true;
 }
 
-EventDataType zMaskProfile::calcLeak(EventStoreType pressure)
+void recordMaskLeakHistory(Session * session)
 {
-    if (maxP==minP)
-        return pressuremin[pressure];
-
-    EventDataType leak=(pressure-minP) * (m_factor) + minL;
-    return leak;
+    zMaskProfile maskProfile(Mask_NasalPillows,"ResMed Swift FX");
+    if (session->eventlist.contains(CPAP_LeakTotal))
+        maskProfile.addSession(session);
 
+    // Nights without pressure to compare against are still recorded, so they aren't scanned again
+    if (maskProfile.Pressure.size()<2) maskProfile.pressureleaks.clear();
+    storeMaskLeakNight(session,maskProfile.pressureleaks);
 }
 
-void zMaskProfile::updateProfile(Session * session)
+bool hasMaskLeakHistory(Session * session)
 {
-    scanPressure(session);
-    scanLeaks(session);
-    updatePressureMin();
+    QString filename=CalcSettings::current().maskProfileFile;
 
+    QMutexLocker lock(&maskHistoryMutex);
+    loadMaskLeakHistory(filename);
+    QHash<MachineID, MaskLeakHistory>::iterator it=maskHistory.find(session->machine()->id());
+    return (it!=maskHistory.end()) && it.value().nights.contains(session->session());
+}
 
-    if (pressuremin.size()<=1) {
-        maxP=minP=0;
-        maxL=minL=0;
-        m_factor=0;
-        return;
+void removeMaskLeakHistory(MachineID machine, SessionID session)
+{
+    QString filename=CalcSettings::current().maskProfileFile;
+
+    QMutexLocker lock(&maskHistoryMutex);
+    loadMaskLeakHistory(filename);
+    QHash<MachineID, MaskLeakHistory>::iterator it=maskHistory.find(machine);
+    if ((it!=maskHistory.end()) && forgetMaskLeakNight(it.value(),machine,session)) {
+        maskHistoryChanged=true;
+        writeMaskLeakHistory();
     }
-    EventDataType p,l,tmp,mean,sum;
-    minP=250,maxP=0;
-    minL=1000, maxL=0;
-
-    long cnt=0, vcnt;
-    int n;
+}
 
-    EventDataType maxcnt, maxval, lastval, lastcnt;
+void purgeMaskLeakHistory(MachineID machine)
+{
+    QString filename=CalcSettings::current().maskProfileFile;
 
-    for (QMap<EventStoreType, QMap<EventStoreType,quint32> >::iterator it=pressureleaks.begin();it!=pressureleaks.end();it++)  {
-        p=it.key();
-        l=pressuremin[p];
-        QMap<EventStoreType,quint32> & leakval=it.value();
-        cnt=0;
-        vcnt=-1;
-        n=leakval.size();
-        sum=0;
+    QMutexLocker lock(&maskHistoryMutex);
+    loadMaskLeakHistory(filename);
+    QHash<MachineID, MaskLeakHistory>::iterator it=maskHistory.find(machine);
+    if (it==maskHistory.end())
+        return;
 
-        maxcnt=0, maxval=0, lastval=0, lastcnt=0;
-        for (QMap<EventStoreType,quint32>::iterator lit=leakval.begin();lit!=leakval.end();lit++) {
-            cnt+=lit.value();
-            if (lit.value() > maxcnt) {
-                lastcnt=maxcnt;
-                maxcnt=lit.value();
-                lastval=maxval;
-                maxval=lit.key();
+    const QHash<SessionID, MaskLeakNight> & nights=it.value().nights;
+    for (QHash<SessionID, MaskLeakNight>::const_iterator n=nights.begin();n!=nights.end();n++) {
+        if (n.value().saved) QFile::remove(maskLeakNightFile(machine,n.key()));
+    }
+    QDir().rmdir(QFileInfo(maskLeakNightFile(machine,0)).absolutePath());
+    maskHistory.erase(it);
+    maskHistoryChanged=true;
+    writeMaskLeakHistory();
+}
 
-            }
-            sum+=lit.key() * lit.value();
-            if (lit.key()==(EventStoreType)l) {
-                vcnt=lit.value();
-            }
-        }
-        pressuremean[p]=mean=sum / EventDataType(cnt);
-        if (lastval > 0) {
-            maxval=qMax(maxval,lastval); //((maxval*maxcnt)+(lastval*lastcnt)) / (maxcnt+lastcnt);
-        }
-        pressuremax[p]=lastval;
-        sum=0;
-        for (QMap<EventStoreType,quint32>::iterator lit=leakval.begin();lit!=leakval.end();lit++) {
-            tmp=lit.key()-mean;
-            sum+=tmp * tmp;
-        }
-        pressurestddev[p]=tmp=sqrt(sum / EventDataType(n));
+/*! \brief Picks the nights sessions baseline is drawn from: itself and those that started before it,
+    at most maskHistorySessions of them with leak data. Only depends on what's been recorded, not the
+    order sessions were calculated in. Adds sessions own night first if it hasn't got one yet.
+    \param window Session IDs in order of starting time
+    \param counts How many samples each one has tallied
+    \param leaks If not NULL, gets the merged histogram, from the machines running window */
+static void maskLeakWindow(Session * session, QList<SessionID> & window, QList<quint32> & counts, LeakHistogram * leaks=NULL)
+{
+    if (!hasMaskLeakHistory(session))
+        recordMaskLeakHistory(session);
 
-        if (vcnt>=0) {
-            tmp=1.0 / EventDataType(cnt) * EventDataType(vcnt);
+    QString filename=CalcSettings::current().maskProfileFile;
+    qint64 start=session->first();
+    SessionID id=session->session();
 
-        }
-    }
-    QMap<EventStoreType, EventDataType> pressureval;
-    QMap<EventStoreType, EventDataType> pressureval2;
-    EventDataType max=0,tmp2,tmp3;
-    for (QMap<EventStoreType, EventDataType>::iterator it=pressuretotal.begin();it!=pressuretotal.end();it++) {
-        if (max < it.value()) max=it.value();
-    }
-    for (QMap<EventStoreType, EventDataType>::iterator it=pressuretotal.begin();it!=pressuretotal.end();it++) {
-        p=it.key();
-        tmp=pressurecount[p];
-        tmp2=it.value();
+    MachineID machine=session->machine()->id();
 
-        tmp3=(tmp / tmp2) * (tmp2 / max);
-        if (tmp3 > 0.05) {
-            tmp=pressuremean[p];
-            if (tmp>0) {
-                pressureval[p]=tmp; // / tmp2;
-                if (p < minP) minP = p;
-                if (p > maxP) maxP = p;
-                if (tmp < minL) minL = tmp;
-                if (tmp > maxL) maxL = tmp;
-            }
-        }
-    }
+    QMutexLocker lock(&maskHistoryMutex);
+    loadMaskLeakHistory(filename);
+    MaskLeakHistory & history=maskHistory[machine];
 
-    if ((maxP==minP)  || (minL==maxL) || (minP==250) || (minL==1000)) {
-        // crappy data set
-        maxP=minP=0;
-        maxL=minL=0;
-        m_factor=0;
-        return;
+    // Walk back from sessions own night
+    QMap<MaskLeakKey, quint32>::const_iterator it=history.order.upperBound(MaskLeakKey(start,id));
+    while ((it!=history.order.constBegin()) && (window.size() < maskHistorySessions)) {
+        --it;
+        window.push_front(it.key().second);
+        counts.push_front(it.value());
     }
-    m_factor = (maxL - minL) / (maxP - minP);
-
-//    for (QMap<EventStoreType, EventDataType>::iterator it=pressuremin.begin();it!=pressuremin.end()-1;it++) {
-//        p1=it.key();
-//        p2=(it+1).key();
-//        l1=it.value();
-//        l2=(it+1).value();
-//        if (l2 > l1) {
-//            factor=(l2 - l1) / (p2 - p1);
-//            sum+=factor;
-//            cnt++;
-//        }
-//    }
-
-//    m_factor=sum/double(cnt);
-
-//    int i=0;
-//    if (i==1) {
-//        QFile f("/home/mark/leaks.csv");
-//        f.open(QFile::WriteOnly);
-//        QTextStream out(&f);
-//        EventDataType p,l,c;
-//        QString fmt;
-//        for (QMap<EventStoreType, EventDataType>::iterator it=pressuremin.begin();it!=pressuremin.end();it++) {
-//            p=EventDataType(it.key()/10.0);
-//            l=it.value();
-//            fmt=QString("%1,%2\n").arg(p,0,'f',1).arg(l);
-//            out << fmt;
-//        }
-
-    // cruft
-//        for (QMap<EventStoreType, QMap<EventStoreType,quint32> >::iterator it=pressureleaks.begin();it!=pressureleaks.end();it++)  {
-//            QMap<EventStoreType,quint32> & leakval=it.value();
-//            for (QMap<EventStoreType,quint32>::iterator lit=leakval.begin();lit!=leakval.end();lit++) {
-//                l=lit.key();
-//                c=lit.value();
-//                fmt=QString("%1,%2,%3\n").arg(p,0,'f',2).arg(l).arg(c);
-//                out << fmt;
-//            }
-//        }
-//        f.close();
-//    }
+    if (leaks) mergeMaskLeakWindow(history,machine,window,*leaks);
 }
 
-QMutex zMaskmutex;
-zMaskProfile mmaskProfile(Mask_NasalPillows,"ResMed Swift FX");
-bool mmaskFirst=true;
-
 int calcLeaks(Session *session)
 {
 
     if (session->machine()->GetType()!=MT_CPAP) return 0;
-    if (session->eventlist.contains(CPAP_Leak)) return 0; // abort if already there
     if (!session->eventlist.contains(CPAP_LeakTotal)) return 0; // can't calculate without this..
 
-    zMaskmutex.lock();
-    zMaskProfile * maskProfile=&mmaskProfile;
-    if (mmaskFirst) {
-        mmaskFirst=false;
-        maskProfile->load(p_profile);
-    }
-//    if (!maskProfile) {
-//        maskProfile=new zMaskProfile(Mask_NasalPillows,"ResMed Swift FX");
-//    }
-    maskProfile->reset();
-    maskProfile->updateProfile(session);
+    zMaskProfile maskProfile(Mask_NasalPillows,"ResMed Swift FX");
+    maskProfile.addSession(session);
+    if (maskProfile.Pressure.size()<2) return 0; // no pressure to compare against
+
+    // The baseline comes from this night and the ones before it, as recorded in the history
+    storeMaskLeakNight(session,maskProfile.pressureleaks);
+    QList<SessionID> window;
+    QList<quint32> counts;
+    maskProfile.pressureleaks.clear();
+    maskLeakWindow(session,window,counts,&maskProfile.pressureleaks);
+    maskProfile.update();
 
     EventList *leak=session->AddEventList(CPAP_Leak,EVL_Event,1);
 
@@ -1403,29 +2611,13 @@ int calcLeaks(Session *session)
         tptr=el.rawTime();
         start=el.first();
 
-        bool found;
+        PressureCursor cursor(maskProfile.Pressure);
         for (; dptr < eptr; dptr++) {
             tmp=EventDataType(*dptr) * gain;
             ti=start+ *tptr++;
 
-            found=false;
-            pressure=maskProfile->Pressure[0].value;
-            for (int i=0;i<maskProfile->Pressure.size()-1;i++) {
-                const TimeValue & p1=maskProfile->Pressure[i];
-                const TimeValue & p2=maskProfile->Pressure[i+1];
-
-                if ((p2.time > ti) && (p1.time <= ti)) {
-                    pressure=p1.value;
-                    found=true;
-                    break;
-                } else if (p2.time==ti) {
-                    pressure=p2.value;
-                    found=true;
-                    break;
-                }
-            }
-            if (found) {
-                val=tmp-maskProfile->calcLeak(pressure);
+            if (cursor.find(ti,pressure)) {
+                val=tmp-maskProfile.calcLeak(pressure);
 
                 if (val < 0) {
                     val=0;
@@ -1435,62 +2627,173 @@ int calcLeaks(Session *session)
             }
         }
     }
-    zMaskmutex.unlock();
     return leak->count();
 }
 
 
-int calcPulseChange(Session *session)
+WindowExtremes::WindowExtremes()
+{
+    m_data=NULL;
+    m_gain=1;
+    m_maxhead=m_maxtail=0;
+    m_minhead=m_mintail=0;
+}
+
+void WindowExtremes::reset(EventList * el)
+{
+    m_data=el->rawData();
+    m_gain=el->gain();
+    // Deques never hold more than the whole list, so they never need to wrap
+    if (m_max.size() < int(el->count())) {
+        m_max.resize(el->count());
+        m_min.resize(el->count());
+    }
+    m_maxhead=m_maxtail=0;
+    m_minhead=m_mintail=0;
+}
+
+void WindowExtremes::push(int idx)
+{
+    EventStoreType val=m_data[idx];
+    int * dq=m_max.data();
+    while ((m_maxtail > m_maxhead) && (m_data[dq[m_maxtail-1]] <= val)) m_maxtail--;
+    dq[m_maxtail++]=idx;
+
+    dq=m_min.data();
+    while ((m_mintail > m_minhead) && (m_data[dq[m_mintail-1]] >= val)) m_mintail--;
+    dq[m_mintail++]=idx;
+}
+
+void WindowExtremes::popBefore(int idx)
+{
+    while ((m_maxhead < m_maxtail) && (m_max[m_maxhead] < idx)) m_maxhead++;
+    while ((m_minhead < m_mintail) && (m_min[m_minhead] < idx)) m_minhead++;
+}
+
+int WindowExtremes::lastAbove(EventDataType value)
+{
+    // Values decrease towards the back, so those above value are a run at the front
+    const int * dq=m_max.constData();
+    int lo=m_maxhead, hi=m_maxtail;
+    while (lo < hi) {
+        int mid=(lo+hi) >> 1;
+        if (EventDataType(m_data[dq[mid]]) * m_gain > value) lo=mid+1;
+        else hi=mid;
+    }
+    return (lo > m_maxhead) ? dq[lo-1] : -1;
+}
+
+int WindowExtremes::lastBelow(EventDataType value)
+{
+    const int * dq=m_min.constData();
+    int lo=m_minhead, hi=m_mintail;
+    while (lo < hi) {
+        int mid=(lo+hi) >> 1;
+        if (EventDataType(m_data[dq[mid]]) * m_gain < value) lo=mid+1;
+        else hi=mid;
+    }
+    return (lo > m_minhead) ? dq[lo-1] : -1;
+}
+
+//! \brief Time of sample i, straight from the raw columns. tptr is rawTime() for EVL_Event lists, NULL for waveforms
+static inline qint64 sampleTime(EventList * el, const quint32 * tptr, int i)
+{
+    if (tptr) return el->first()+qint64(tptr[i]);
+    return el->first()+qint64(EventDataType(i)*el->rate());
+}
+
+int findWindowChanges(EventList * el, qint64 window, EventDataType threshold, QVector<Excursion> & results)
+{
+    int count=el->count();
+    if (count < 2) return 0;
+
+    const EventStoreType * data=el->rawData();
+    const quint32 * tptr=(el->type()==EVL_Event) ? el->rawTime() : NULL;
+    EventDataType gain=el->gain();
+    EventDataType val;
+    int found=0, j, r=1;
+
+    WindowExtremes ext;
+    ext.reset(el);
+
+    for (int i=0;i<count-1;i++) {
+        // Window covers the samples after i, up to window ms later
+        qint64 end=sampleTime(el,tptr,i)+window;
+        if (r <= i) r=i+1;
+        ext.popBefore(i+1);
+        while ((r < count) && (sampleTime(el,tptr,r) <= end)) {
+            ext.push(r++);
+        }
+        if (ext.isEmpty()) continue;
+
+        val=EventDataType(data[i]) * gain;
+        j=qMax(ext.lastAbove(val+threshold), ext.lastBelow(val-threshold));
+        if (j >= 0) {
+            results.push_back(Excursion(i,j,qAbs(EventDataType(data[j]) * gain - val)));
+            found++;
+            i=j;
+        }
+    }
+    return found;
+}
+
+int findRunsBelow(EventList * el, EventDataType level, qint64 duration, QVector<Excursion> & results)
 {
-    if (session->eventlist.contains(OXI_PulseChange)) return 0;
+    int count=el->count();
+    const EventStoreType * data=el->rawData();
+    const quint32 * tptr=(el->type()==EVL_Event) ? el->rawTime() : NULL;
+    EventDataType gain=el->gain();
+    EventDataType val, lowest;
+    int found=0, e;
+
+    for (int i=0;i<count;) {
+        val=EventDataType(data[i]) * gain;
+        if (!val || (val > level)) {
+            i++;
+            continue;
+        }
+        // Later starting points in the same run are only ever shorter, so each run is measured once
+        lowest=val;
+        for (e=i; (e+1 < count) && ((val=EventDataType(data[e+1]) * gain) <= level); e++) {
+            if (val && (val < lowest)) lowest=val;
+        }
+        if (sampleTime(el,tptr,e)-sampleTime(el,tptr,i) >= duration) {
+            results.push_back(Excursion(i,e,lowest));
+            found++;
+        }
+        // Sample e+1, if there is one, is above level
+        i=e+2;
+    }
+    return found;
+}
 
+int calcPulseChange(Session *session)
+{
     QHash<ChannelID,QVector<EventList *> >::iterator it=session->eventlist.find(OXI_Pulse);
     if (it==session->eventlist.end()) return 0;
 
-    EventDataType val,val2,change,tmp;
-    qint64 time,time2;
-    qint64 window=PROFILE.oxi->pulseChangeDuration();
+    CalcSettings settings=CalcSettings::current();
+    qint64 window=settings.pulseChangeDuration;
     window*=1000;
 
-    change=PROFILE.oxi->pulseChangeBPM();
+    EventDataType change=settings.pulseChangeBPM;
 
     EventList *pc=new EventList(EVL_Event,1,0,0,0,0,true);
     pc->setFirst(session->first(OXI_Pulse));
-    qint64 lastt;
-    EventDataType lv=0;
-    int li=0;
 
-    int max;
+    QVector<Excursion> changes;
+    qint64 time,lastt;
     for (int e=0;e<it.value().size();e++) {
         EventList & el=*(it.value()[e]);
 
-        for (unsigned i=0;i<el.count();i++) {
-            val=el.data(i);
-            time=el.time(i);
-
-
-            lastt=0;
-            lv=change;
-            max=0;
-
-            for (unsigned j=i+1;j<el.count();j++) { // scan ahead in the window
-                time2=el.time(j);
-                if (time2 > time+window) break;
-                val2=el.data(j);
-                tmp=qAbs(val2-val);
-                if (tmp > lv) {
-                    lastt=time2;
-                    if (tmp>max) max=tmp;
-                    //lv=tmp;
-                    li=j;
-                }
-            }
-            if (lastt>0) {
-                qint64 len=(lastt-time)/1000.0;
-                pc->AddEvent(lastt,len,tmp);
-                i=li;
-
-            }
+        changes.clear();
+        findWindowChanges(&el,window,change,changes);
+        for (int i=0;i<changes.size();i++) {
+            const Excursion & ex=changes.at(i);
+            time=el.time(ex.start);
+            lastt=el.time(ex.end);
+            qint64 len=(lastt-time)/1000.0;
+            pc->AddEvent(lastt,len,ex.value);
         }
     }
     if (pc->count()==0) {
@@ -1498,6 +2801,7 @@ int calcPulseChange(Session *session)
         return 0;
     }
     session->eventlist[OXI_PulseChange].push_back(pc);
+    session->setChannelDirty(OXI_PulseChange);
     session->setMin(OXI_PulseChange,pc->Min());
     session->setMax(OXI_PulseChange,pc->Max());
     session->setCount(OXI_PulseChange,pc->count());
@@ -1509,107 +2813,57 @@ int calcPulseChange(Session *session)
 
 int calcSPO2Drop(Session *session)
 {
-    if (session->eventlist.contains(OXI_SPO2Drop)) return 0;
-
     QHash<ChannelID,QVector<EventList *> >::iterator it=session->eventlist.find(OXI_SPO2);
     if (it==session->eventlist.end()) return 0;
 
-    EventDataType val,val2,change,tmp;
-    qint64 time,time2;
-    qint64 window=PROFILE.oxi->spO2DropDuration();
+    EventDataType val,change,tmp;
+    qint64 time;
+    CalcSettings settings=CalcSettings::current();
+    qint64 window=settings.spO2DropDuration;
     window*=1000;
-    change=PROFILE.oxi->spO2DropPercentage();
+    change=settings.spO2DropPercentage;
 
     EventList *pc=new EventList(EVL_Event,1,0,0,0,0,true);
-    qint64 lastt;
-    EventDataType lv=0;
-    int li=0;
-
-    // Fix me.. Time scale varies.
-    //const unsigned ringsize=30;
-    //EventDataType ring[ringsize]={0};
-    //qint64 rtime[ringsize]={0};
-    //int rp=0;
-    int min;
+
     int cnt=0;
     tmp=0;
 
     qint64 start=0;
 
     // Calculate median baseline
-    QList<EventDataType> med;
+    PercentileEngine * med=PercentileEngine::local();
+    EventStoreType raw;
     for (int e=0;e<it.value().size();e++) {
         EventList & el=*(it.value()[e]);
         for (unsigned i=0;i<el.count();i++) {
-            val=el.data(i);
+            raw=el.raw(i);
+            val=EventDataType(raw) * el.gain();
             time=el.time(i);
-            if (val>0) med.push_back(val);
+            if (val>0) med->add(raw);
             if (!start) start=time;
             if (time > start+3600000) break; // just look at the first hour
             tmp+=val;
             cnt++;
         }
     }
-    qSort(med);
-    int midx=float(med.size())*0.90;
-    if (midx>med.size()-1) midx=med.size()-1;
-    EventDataType baseline=med[midx];
+    EventDataType baseline=EventDataType(med->raw(0.90)) * it.value()[0]->gain();
     session->settings[OXI_SPO2Drop]=baseline;
     //EventDataType baseline=round(tmp/EventDataType(cnt));
-    EventDataType current;
     qDebug() << "Calculated baseline" << baseline;
 
+    // A drop is a run of samples at least change below the baseline, lasting at least window
+    QVector<Excursion> drops;
+    qint64 lastt;
     for (int e=0;e<it.value().size();e++) {
         EventList & el=*(it.value()[e]);
-        for (unsigned i=0;i<el.count();i++) {
-            current=el.data(i);
-            if (!current) continue;
-            time=el.time(i);
-            /*ring[rp]=val;
-            rtime[rp]=time;
-            rp++;
-            rp=rp % ringsize;
-            if (i<ringsize)  {
-                for (unsigned j=i;j<ringsize;j++) {
-                    ring[j]=val;
-                    rtime[j]=0;
-                }
-            }
-            tmp=0;
-            cnt=0;
-            for (unsigned j=0;j<ringsize;j++) {
-                if (rtime[j] > time-300000) {  // only look at recent entries..
-                    tmp+=ring[j];
-                    cnt++;
-                }
-            }
-            if (!cnt) {
-                unsigned j=abs((rp-1) % ringsize);
-                tmp=(ring[j]+val)/2;
-            } else tmp/=EventDataType(cnt); */
-
-            val=baseline;
-            lastt=0;
-            lv=val;
-
 
-            min=val;
-            for (unsigned j=i;j<el.count();j++) { // scan ahead in the window
-                time2=el.time(j);
-                //if (time2 > time+window) break;
-                val2=el.data(j);
-
-                if (val2 > baseline-change) break;
-                lastt=time2;
-                li=j+1;
-            }
-            if (lastt>0) {
-                qint64 len=(lastt-time);
-                if (len>=window) {
-                    pc->AddEvent(lastt,len/1000,val-min);
-                    i=li;
-                }
-            }
+        drops.clear();
+        findRunsBelow(&el,baseline-change,window,drops);
+        for (int i=0;i<drops.size();i++) {
+            const Excursion & ex=drops.at(i);
+            time=el.time(ex.start);
+            lastt=el.time(ex.end);
+            pc->AddEvent(lastt,(lastt-time)/1000,baseline-ex.value);
         }
     }
     if (pc->count()==0) {
@@ -1617,6 +2871,7 @@ int calcSPO2Drop(Session *session)
         return 0;
     }
     session->eventlist[OXI_SPO2Drop].push_back(pc);
+    session->setChannelDirty(OXI_SPO2Drop);
     session->setMin(OXI_SPO2Drop,pc->Min());
     session->setMax(OXI_SPO2Drop,pc->Max());
     session->setCount(OXI_SPO2Drop,pc->count());
@@ -1624,3 +2879,284 @@ int calcSPO2Drop(Session *session)
     session->setLast(OXI_SPO2Drop,pc->last());
     return pc->count();
 }
+
+// Derived channel registry
+
+static int calcAHIChannels(Session *session, const QList<ChannelID> & outputs)
+{
+    Q_UNUSED(outputs);
+    return calcAHIGraph(session);
+}
+
+static int calcFlowChannels(Session *session, const QList<ChannelID> & outputs)
+{
+    return calcRespRate(session, outputs);
+}
+
+static int calcLeakChannels(Session *session, const QList<ChannelID> & outputs)
+{
+    Q_UNUSED(outputs);
+    return calcLeaks(session);
+}
+
+static int calcSPO2DropChannels(Session *session, const QList<ChannelID> & outputs)
+{
+    Q_UNUSED(outputs);
+    return calcSPO2Drop(session);
+}
+
+static int calcPulseChangeChannels(Session *session, const QList<ChannelID> & outputs)
+{
+    Q_UNUSED(outputs);
+    return calcPulseChange(session);
+}
+
+// The leading number is the algorithm revision, bump it to force recalculation after changing one
+static quint32 ahiParams(Session *session)
+{
+    Q_UNUSED(session);
+    CalcSettings settings=CalcSettings::current();
+    return qHash(QString("2:%1:%2").arg(settings.ahiWindow).arg(int(settings.ahiReset)));
+}
+
+static quint32 flowParams(Session *session)
+{
+    Q_UNUSED(session);
+    return qHash(QString("3"));
+}
+
+static quint32 userFlagParams(Session *session)
+{
+    Q_UNUSED(session);
+    CalcSettings settings=CalcSettings::current();
+    return qHash(QString("3:%1:%2:%3:%4")
+                 .arg(int(settings.userEventFlagging))
+                 .arg(settings.userEventDuration)
+                 .arg(int(settings.userEventDuplicates))
+                 .arg(settings.userFlowRestriction));
+}
+
+// The baseline comes from earlier nights too, so which ones (and how much of each) go in the hash
+static quint32 leakParams(Session *session)
+{
+    QList<SessionID> window;
+    QList<quint32> counts;
+    maskLeakWindow(session,window,counts);
+
+    QString params("3");
+    for (int i=0;i<window.size();i++) {
+        params+=QString(":%1/%2").arg(window.at(i)).arg(counts.at(i));
+    }
+    return qHash(params);
+}
+
+static quint32 spo2DropParams(Session *session)
+{
+    Q_UNUSED(session);
+    CalcSettings settings=CalcSettings::current();
+    return qHash(QString("2:%1:%2").arg(settings.spO2DropDuration).arg(settings.spO2DropPercentage));
+}
+
+static quint32 pulseChangeParams(Session *session)
+{
+    Q_UNUSED(session);
+    CalcSettings settings=CalcSettings::current();
+    return qHash(QString("2:%1:%2").arg(settings.pulseChangeDuration).arg(settings.pulseChangeBPM));
+}
+
+QMutex derivedMutex;
+QList<DerivedChannel> derivedRegistry;
+QMultiHash<ChannelID,ChannelID> derivedDeps;   // input -> derived output
+QHash<ChannelID,int> derivedIndex;              // output -> registry index
+
+static void initDerivedChannels()
+{
+    // Must be called with derivedMutex held
+    if (!derivedRegistry.isEmpty())
+        return;
+
+    DerivedChannel dc;
+
+    // Sliding window AHI/RDI graph
+    dc=DerivedChannel("AHI",calcAHIChannels,ahiParams,false,false);
+    dc.inputs << CPAP_Obstructive << CPAP_Hypopnea << CPAP_ClearAirway << CPAP_Apnea << CPAP_RERA;
+    dc.outputs << CPAP_AHI << CPAP_RDI;
+    derivedRegistry.push_back(dc);
+
+    // Entries sharing calcFlowChannels get done in one pass over the flow waveform
+    dc=DerivedChannel("Respiration",calcFlowChannels,flowParams,false,true);
+    dc.inputs << CPAP_FlowRate;
+    dc.outputs << CPAP_RespRate << CPAP_TidalVolume << CPAP_MinuteVent;
+    derivedRegistry.push_back(dc);
+
+    // User flags skip anything close to a machine flagged apnea
+    dc=DerivedChannel("UserFlags",calcFlowChannels,userFlagParams,false,false);
+    dc.inputs << CPAP_FlowRate;
+    dc.depends << CPAP_Obstructive << CPAP_Hypopnea << CPAP_ClearAirway << CPAP_Apnea;
+    dc.outputs << CPAP_UserFlag1;
+    derivedRegistry.push_back(dc);
+
+    // Only Daily's statistics table summarizes Ti & Te, and Daily opens the day before building it,
+    // so these are left until somebody looks
+    dc=DerivedChannel("BreathTiming",calcFlowChannels,flowParams,true,true);
+    dc.inputs << CPAP_FlowRate;
+    dc.outputs << CPAP_Ti << CPAP_Te;
+    derivedRegistry.push_back(dc);
+
+    dc=DerivedChannel("Leak",calcLeakChannels,leakParams,false,true);
+    dc.inputs << CPAP_LeakTotal;
+    dc.depends << CPAP_Pressure << CPAP_IPAP;
+    dc.outputs << CPAP_Leak;
+    derivedRegistry.push_back(dc);
+
+    dc=DerivedChannel("SPO2Drop",calcSPO2DropChannels,spo2DropParams,false,false);
+    dc.inputs << OXI_SPO2;
+    dc.outputs << OXI_SPO2Drop;
+    derivedRegistry.push_back(dc);
+
+    dc=DerivedChannel("PulseChange",calcPulseChangeChannels,pulseChangeParams,false,false);
+    dc.inputs << OXI_Pulse;
+    dc.outputs << OXI_PulseChange;
+    derivedRegistry.push_back(dc);
+
+    for (int i=0;i<derivedRegistry.size();i++) {
+        const DerivedChannel & d=derivedRegistry.at(i);
+        for (int j=0;j<d.outputs.size();j++) {
+            derivedIndex[d.outputs.at(j)]=i;
+            for (int k=0;k<d.inputs.size();k++) {
+                derivedDeps.insert(d.inputs.at(k),d.outputs.at(j));
+            }
+            for (int k=0;k<d.depends.size();k++) {
+                derivedDeps.insert(d.depends.at(k),d.outputs.at(j));
+            }
+        }
+    }
+}
+
+const QList<DerivedChannel> & derivedChannelRegistry()
+{
+    QMutexLocker lock(&derivedMutex);
+    initDerivedChannels();
+    return derivedRegistry;
+}
+
+const DerivedChannel * findDerivedChannel(ChannelID code)
+{
+    QMutexLocker lock(&derivedMutex);
+    initDerivedChannels();
+    QHash<ChannelID,int>::iterator it=derivedIndex.find(code);
+    if (it==derivedIndex.end())
+        return NULL;
+    return &derivedRegistry.at(it.value());
+}
+
+QList<ChannelID> derivedChannels(ChannelID code)
+{
+    QMutexLocker lock(&derivedMutex);
+    initDerivedChannels();
+    return derivedDeps.values(code);
+}
+
+int updateDerivedChannels(Session * session, bool lazy)
+{
+    // Nothing to work from if the events aren't loaded
+    if (session->eventlist.isEmpty())
+        return 0;
+
+    const QList<DerivedChannel> & registry=derivedChannelRegistry();
+    int num=registry.size();
+
+    QVector<QList<ChannelID> > todo(num);
+    QVector<quint32> hashes(num);
+    QHash<ChannelID,quint32>::iterator rec;
+    ChannelID code;
+    bool present,changed;
+
+    for (int i=0;i<num;i++) {
+        const DerivedChannel & dc=registry.at(i);
+
+        present=false;
+        for (int j=0;j<dc.inputs.size();j++) {
+            if (session->eventlist.contains(dc.inputs.at(j))) {
+                present=true;
+                break;
+            }
+        }
+        if (!present)
+            continue;
+
+        changed=false;
+        for (int j=0;j<dc.inputs.size();j++) {
+            if (session->channelDirty(dc.inputs.at(j))) changed=true;
+        }
+        for (int j=0;j<dc.depends.size();j++) {
+            if (session->channelDirty(dc.depends.at(j))) changed=true;
+        }
+
+        hashes[i]=dc.params(session);
+
+        for (int j=0;j<dc.outputs.size();j++) {
+            code=dc.outputs.at(j);
+            rec=session->m_derived.find(code);
+            if (rec!=session->m_derived.end()) {
+                // Up to date (even if it came out empty), unless the events it made were thrown away
+                // before being stored, which the summary still counting some gives away
+                if (!changed && (rec.value()==hashes[i])
+                && (session->eventlist.contains(code) || (session->m_cnt.value(code,0)==0)))
+                    continue;
+
+                session->destroyEvent(code);
+            } else if (session->eventlist.contains(code)) {
+                if (dc.supplied)
+                    continue; // machine data, leave it be
+
+                if (!changed) {
+                    // Calculated before these records were kept
+                    session->m_derived[code]=hashes[i];
+                    continue;
+                }
+                session->destroyEvent(code);
+            }
+
+            // Stale lazy channels are just thrown away, to be redone when viewed
+            if (dc.lazy && !lazy)
+                continue;
+
+            todo[i].push_back(code);
+        }
+    }
+
+    int total=0;
+    for (int i=0;i<num;i++) {
+        if (todo[i].isEmpty())
+            continue;
+        const DerivedChannel & dc=registry.at(i);
+
+        // Batch up anything else using the same calculation
+        QList<int> batch;
+        QList<ChannelID> outputs;
+        for (int j=i;j<num;j++) {
+            if (!todo[j].isEmpty() && (registry.at(j).calc==dc.calc)) {
+                batch.push_back(j);
+                outputs.append(todo[j]);
+            }
+        }
+
+        dc.calc(session,outputs);
+
+        for (int j=0;j<batch.size();j++) {
+            int idx=batch.at(j);
+            for (int k=0;k<todo[idx].size();k++) {
+                code=todo[idx].at(k);
+                session->m_derived[code]=hashes[idx];
+                session->setChannelDirty(code);
+                total++;
+            }
+            todo[idx].clear();
+        }
+    }
+    if (total>0)
+        session->SetChanged(true);
+
+    return total;
+}
@@ -8,10 +8,258 @@
 
 #include "day.h"
 
-//! param samples Number of samples
-//! width number of surrounding samples to consider
-//! percentile fractional percentage, between 0 and 1
-void percentileFilter(EventDataType * input, EventDataType * output, int samples, int width, EventDataType percentile);
+class Profile;
+class QDataStream;
+
+/*! \struct CalcSettings
+    \brief Snapshot of the preferences the calculations (and Session times) depend on
+
+    Worker threads install a copy with setLocal() before touching any Sessions, so they never
+    read the profile while the GUI thread is free to change it. Threads without one read the
+    live preferences.
+    */
+struct CalcSettings {
+    CalcSettings();
+    CalcSettings(const CalcSettings & copy);
+
+    //! \brief Copies the relevant preferences out of profile
+    void load(Profile * profile);
+
+    double ahiWindow;
+    bool ahiReset;
+    bool userEventFlagging;
+    double userEventDuration;
+    bool userEventDuplicates;
+    double userFlowRestriction;
+    double spO2DropDuration;
+    double spO2DropPercentage;
+    double pulseChangeDuration;
+    double pulseChangeBPM;
+    int clockDrift;
+    bool compressSessionData;
+    //! \brief Where the mask leak history is kept
+    QString maskProfileFile;
+
+    //! \brief Returns this threads snapshot, or the live preferences if it hasn't got one
+    static CalcSettings current();
+
+    //! \brief Returns the CPAP clock drift in seconds, without copying a whole snapshot
+    static int currentClockDrift();
+
+    //! \brief Installs a copy of settings as this threads snapshot
+    static void setLocal(const CalcSettings & settings);
+
+    //! \brief Drops this threads snapshot, going back to the live preferences
+    static void clearLocal();
+};
+
+/*! \class PercentileEngine
+    \brief Counting-select percentile engine for raw ("ungained") 16bit EventStoreType data
+
+    Values are tallied into a bucket per possible raw value in a single pass, after which any
+    number of percentiles can be answered by walking the cumulative counts. No sorting is done,
+    and the buckets are kept between uses (only the touched range gets cleared), so reusing an
+    engine, or the per-thread one from local(), costs no allocations.
+    */
+class PercentileEngine
+{
+public:
+    PercentileEngine();
+
+    //! \brief Empties the tally, ready for the next data set
+    void clear();
+
+    //! \brief Tallies a single raw value
+    inline void add(EventStoreType value) {
+        int idx=int(value)-min_raw;
+        m_hist[idx]++;
+        if (idx < m_low) m_low=idx;
+        if (idx > m_high) m_high=idx;
+        m_count++;
+    }
+
+    //! \brief Tallies samples raw values from data
+    void add(const EventStoreType * data, int samples);
+
+    //! \brief Tallies all raw values contained in EventList el
+    void add(EventList * el) { add(el->rawData(), el->count()); }
+
+    //! \brief Returns the number of values tallied since the last clear()
+    quint32 count() { return m_count; }
+
+    //! \brief Returns the raw value at fractional percentile (between 0 and 1), without interpolation
+    EventStoreType raw(EventDataType percentile);
+
+    /*! \brief Answers num percentiles from the same tally
+        \param percentiles fractional percentages, between 0 and 1
+        \param results receives num raw values */
+    void raw(const EventDataType * percentiles, EventStoreType * results, int num);
+
+    //! \brief Returns this threads engine, for callers that don't keep their own
+    static PercentileEngine * local();
+
+protected:
+    static const int min_raw=-32768;
+    static const int num_buckets=65536;
+
+    QVector<quint32> m_hist;
+    int m_low, m_high;
+    quint32 m_count;
+};
+
+/*! \class LeakHistogram
+    \brief Dense pressure by leak histogram of raw values, for working out mask leak baselines
+
+    Each pressure seen gets a row of counts, one bucket per raw leak value over the range seen
+    so far, so tallying a sample is just an increment. Row totals are kept as it goes, and each
+    rows cumulative counts are only rebuilt when a percentile is asked of a changed row.
+    Histograms can be merged and unmerged again, so a run of nights can be kept as a running sum.
+    */
+class LeakHistogram
+{
+public:
+    LeakHistogram();
+    LeakHistogram(const LeakHistogram & copy);
+    LeakHistogram & operator=(const LeakHistogram & copy);
+
+    //! \brief Empties the histogram
+    void clear();
+
+    //! \brief Returns true if nothing has been tallied
+    bool isEmpty() const { return m_count==0; }
+
+    //! \brief Number of samples tallied altogether
+    quint32 count() const { return m_count; }
+
+    //! \brief Tallies count samples of leak at pressure
+    inline void add(EventStoreType pressure, EventStoreType leak, quint32 count=1) {
+        int row=int(pressure)-m_plow, col=int(leak)-m_llow;
+        if ((row < 0) || (row >= m_rows.size()) || (col < 0) || (col >= m_lwidth) || m_rows[row].isEmpty()) {
+            grow(pressure,leak);
+            row=int(pressure)-m_plow;
+            col=int(leak)-m_llow;
+        }
+        m_rows[row][col]+=count;
+        m_totals[row]+=count;
+        m_dirty[row]=true;
+        m_count+=count;
+    }
+
+    //! \brief Adds all of others counts to this one
+    void merge(const LeakHistogram & other);
+
+    //! \brief Takes others counts off this one again, after an earlier merge
+    void unmerge(const LeakHistogram & other);
+
+    //! \brief Returns the pressures that have been seen, in ascending order
+    QVector<EventStoreType> pressures() const;
+
+    //! \brief Number of samples tallied at pressure
+    quint32 total(EventStoreType pressure) const;
+
+    //! \brief Lowest raw leak value the rows have room for
+    int leakLow() const { return m_llow; }
+
+    //! \brief Number of leak buckets in each row
+    int leakWidth() const { return m_lwidth; }
+
+    //! \brief Returns pressures row of counts, leakWidth() long starting at leakLow(), or NULL if unseen
+    const quint32 * row(EventStoreType pressure) const;
+
+    //! \brief Returns the smallest leak value at pressure with at least n samples at or below it
+    EventStoreType leakAtCount(EventStoreType pressure, quint32 n);
+
+    friend QDataStream & operator<<(QDataStream & out, const LeakHistogram & hist);
+    friend QDataStream & operator>>(QDataStream & in, LeakHistogram & hist);
+
+protected:
+    //! \brief Makes room for pressure and leak, keeping existing counts
+    void grow(EventStoreType pressure, EventStoreType leak);
+
+    int m_plow, m_llow, m_lwidth;
+    //! \brief Counts per pressure row, empty for pressures not seen
+    QVector<QVector<quint32> > m_rows;
+    //! \brief Cumulative counts per row, valid unless m_dirty is set
+    QVector<QVector<quint32> > m_cumulative;
+    QVector<quint32> m_totals;
+    QVector<bool> m_dirty;
+    quint32 m_count;
+};
+
+/*! \class SummaryKernel
+    \brief Fused single-pass statistics kernel for a channels EventLists
+
+    Each EventList is streamed once, collecting count, sum, min/max, first/last time, and
+    optionally the value and time-weighted histograms Session keeps for percentile and wavg.
+    Histograms are tallied into dense buckets indexed by raw value, rather than hashed per
+    sample, and only converted to Session's hash format when read out.
+    */
+class SummaryKernel
+{
+public:
+    SummaryKernel();
+
+    //! \brief Resets all results, ready for the next channel
+    void clear();
+
+    //! \brief Streams EventList el into the results. Histograms are only tallied if requested
+    void add(EventList * el, bool histograms);
+
+    //! \brief Number of values seen
+    quint32 count() { return m_count; }
+
+    //! \brief Sum of gained values
+    double sum() { return m_sum; }
+
+    //! \brief Average of gained values
+    EventDataType avg() { return m_count ? m_sum/double(m_count) : 0; }
+
+    //! \brief Minimum, taken from the EventLists own min/max records
+    EventDataType Min() { return m_min; }
+
+    //! \brief Maximum, taken from the EventLists own min/max records
+    EventDataType Max() { return m_max; }
+
+    //! \brief Earliest EventList starting time
+    qint64 first() { return m_first; }
+
+    //! \brief Latest EventList ending time
+    qint64 last() { return m_last; }
+
+    //! \brief Gain of the first EventList added
+    EventDataType gain() { return m_gain; }
+
+    //! \brief Returns true if histograms were tallied and contain anything
+    bool hasHistogram() { return m_high >= m_low; }
+
+    //! \brief Time weighted average, calculated from the time-weighted histogram
+    EventDataType wavg();
+
+    //! \brief Copies the value histogram out in Session::m_valuesummary format
+    void valueSummary(QHash<EventStoreType, EventStoreType> & valsum);
+
+    //! \brief Copies the time-weighted histogram out in Session::m_timesummary format
+    void timeSummary(QHash<EventStoreType, quint32> & timesum);
+
+    //! \brief Returns this threads kernel, already cleared
+    static SummaryKernel * local();
+
+protected:
+    static const int min_raw=-32768;
+    static const int num_buckets=65536;
+
+    QVector<quint32> m_values;
+    QVector<double> m_times;
+    int m_low, m_high;
+
+    quint32 m_count;
+    int m_lists;
+    double m_sum;
+    EventDataType m_min, m_max, m_gain;
+    bool m_hasminmax;
+    qint64 m_first, m_last;
+};
+
 void xpassFilter(EventDataType * input, EventDataType * output, int samples, EventDataType weight);
 
 enum FilterType { FilterNone=0, FilterPercentile, FilterXPass };
@@ -42,6 +290,90 @@ struct Filter {
     EventDataType param3;
 };
 
+/*! \class FilterStage
+    \brief One stage of a FilterChain, keeping whatever state it needs from one block to the next
+
+    Output may lag input by latency() samples, for stages that need to see ahead. Those samples
+    are held back until flush() is called at the end of the stream.
+    */
+class FilterStage
+{
+public:
+    virtual ~FilterStage() {}
+
+    //! \brief Forgets all state, ready for a new stream
+    virtual void reset()=0;
+
+    //! \brief Number of samples output lags input by
+    virtual int latency() { return 0; }
+
+    //! \brief Filters samples of input into output, returning how many output samples were written
+    virtual int process(const EventDataType * input, int samples, EventDataType * output)=0;
+
+    //! \brief Ends the stream, writing any held back samples to output and returning how many
+    virtual int flush(EventDataType * output) { Q_UNUSED(output); return 0; }
+};
+
+//! \brief Creates the FilterStage that carries out filter
+typedef FilterStage * (*FilterStageFactory)(const Filter & filter);
+
+//! \brief Registers the factory creating stages for FilterType type, replacing any already registered
+void registerFilterStage(FilterType type, FilterStageFactory factory);
+
+//! \brief Returns a new stage for filter, or NULL if none is registered for its type
+FilterStage * createFilterStage(const Filter & filter);
+
+//! \brief Samples a FilterChain pushes through all its stages at a time, small enough to stay in cache
+const int filter_block_size=4096;
+
+/*! \class FilterChain
+    \brief Streaming filter engine, running a list of FilterStages block by block
+
+    Each block goes through every stage while it's still in cache, instead of each filter making
+    its own pass over the whole waveform. Stages carry their state across blocks, so a stream
+    fed in pieces (like live oximetry) filters exactly the same as a stored waveform in one go.
+    */
+class FilterChain
+{
+public:
+    FilterChain();
+    ~FilterChain();
+
+    //! \brief Deletes all stages
+    void clear();
+
+    //! \brief Appends stage, taking ownership of it
+    void add(FilterStage * stage);
+
+    //! \brief Appends a stage carrying out filter, from the registered stage factories
+    void add(const Filter & filter);
+
+    //! \brief Returns true if there are no stages
+    bool isEmpty() { return m_stages.isEmpty(); }
+
+    //! \brief Resets all stages, ready for a new stream
+    void reset();
+
+    //! \brief Total number of samples output lags input by
+    int latency();
+
+    //! \brief Feeds samples of input through the chain, returning the number of samples written to output
+    int process(const EventDataType * input, int samples, EventDataType * output);
+
+    //! \brief Ends the stream, writing the last latency() samples to output and returning how many
+    int flush(EventDataType * output);
+
+    //! \brief Filters a whole stored waveform in place
+    void apply(EventDataType * data, int samples);
+
+protected:
+    //! \brief Pushes one block through every stage
+    int run(const EventDataType * input, int samples, EventDataType * output, bool flush);
+
+    QList<FilterStage *> m_stages;
+    QVector<EventDataType> m_blocks[2];
+};
+
 struct BreathPeak {
     BreathPeak() { min=0; max=0; start=0; middle=0; end=0; } // peakmin=0; peakmax=0;  }
     BreathPeak(EventDataType _min, EventDataType _max, qint32 _start, qint32 _middle,  qint32 _end) {//, qint64 _peakmin, qint64 _peakmax) {
@@ -77,11 +409,31 @@ struct BreathPeak {
 
 bool operator<(const BreathPeak & p1, const BreathPeak & p2);
 
-const int num_filter_buffers=2;
+/*! \struct FlowSpan
+    \brief Where each piece of flow data fed to a FlowParser run starts, for working out sample times
+    */
+struct FlowSpan {
+    FlowSpan() { index=0; time=0; }
+    FlowSpan(qint32 _index, qint64 _time) { index=_index; time=_time; }
+    FlowSpan(const FlowSpan & copy) { index=copy.index; time=copy.time; }
+
+    //! \brief Sample number within the run
+    qint32 index;
+    //! \brief Time of that sample
+    qint64 time;
+};
 
-const int max_filter_buf_size=2097152*sizeof(EventDataType);
+/*! \class FlowParser
+    \brief Streaming Flow Rate waveform processor
 
-//! \brief Class to process Flow Rate waveform data
+    Flow data is fed in as it comes, a whole EventList or a chunk of raw samples at a time. It's
+    filtered, split into breaths at zero line crossings, and each breaths Respiratory Rate, Tidal
+    Volume, Minute Ventilation, Ti & Te are added to the outputs as soon as it's complete. Data that
+    carries straight on from the last piece continues the same run, filters, breaths and all,
+    so only the current breath (and the last minute of breath boundaries) needs keeping. User
+    flagging is the exception: its cutoff comes from the whole runs breath peaks, so when it's
+    requested the filtered flow is kept until the run ends.
+    */
 class FlowParser {
 public:
     FlowParser();
@@ -90,53 +442,296 @@ public:
     //! \brief Clears the (input) filter chain
     void clearFilters();
 
-    //! \brief Applies the filter chain to input, with supplied number of samples
-    EventDataType * applyFilters(EventDataType * input, int samples);
-
     //! \brief Add the filter
     void addFilter(FilterType ft, EventDataType p1=0, EventDataType p2=0, EventDataType p3=0) {
         m_filters.push_back(Filter(ft,p1,p2,p3));
     }
-    //! \brief Opens the flow rate EventList, applies the input filter chain, and calculates peaks
-    void openFlow(Session * session, EventList * flow);
 
-    //! \brief Calculates the upper and lower breath peaks
-    void calcPeaks(EventDataType * input, int samples);
+    //! \brief Starts streaming flow data into session, calculating the requested output channels
+    void beginStream(Session * session, bool calcResp, bool calcTv, bool calcTi, bool calcTe, bool calcMv, bool flagEvents);
 
-    // Minute vent needs Resp & TV calcs made here..
-    void calc(bool calcResp, bool calcTv, bool calcTi, bool calcTe, bool calcMv);
-    void flagEvents();
+    //! \brief Feeds a flow rate EventList into the stream
+    void addFlow(EventList * flow);
 
-    /*void calcTidalVolume();
-    void calcRespRate();
-    void calcMinuteVent(); */
+    /*! \brief Feeds count raw flow samples, the first at time, so loaders can hand over data while still decoding
+        A gap in time, or a change of rate, ends the current run and starts another */
+    void addSamples(const EventStoreType * data, int count, EventDataType gain, EventDataType rate, qint64 time);
 
+    //! \brief Finishes off the stream, returning the number of contiguous runs of flow data parsed
+    int endStream();
+
+    //! \brief Returns this threads FlowParser, so its buffers get reused from one session to the next
+    static FlowParser * local();
 
     QList<Filter> m_filters;
 protected:
+    //! \brief Starts a new run at time, resetting the filters & breath detection
+    void startRun(EventDataType rate, qint64 time);
+
+    //! \brief Flushes the filters, and finishes the outputs of the current run
+    void finishRun();
+
+    //! \brief Finds zero line crossings in a block of filtered flow, and assembles breaths from them
+    void addFiltered(const EventDataType * data, int count);
+
+    //! \brief Starts a segment of flow on one side of the zero line, at sample idx
+    void openSegment(qint32 idx, EventDataType first);
+
+    //! \brief Closes the current segment, folding its peak into the breath being assembled
+    void closeSegment();
+
+    //! \brief Calculates and adds the outputs for breaths[idx]
+    void emitBreath(int idx);
+
+    //! \brief Flags User Flag 1 events, once all of a runs breaths are known
+    void flagEvents();
+
+    //! \brief Returns the time of sample idx in the current run
+    double sampleTime(qint32 idx);
+
+    //! \brief Returns the time of sample idx in the current run, with the offset in double precision
+    double exactTime(qint32 idx);
+
+    //! \brief Returns the whole millisecond time of sample idx in the current run
+    qint64 msecTime(qint32 idx);
+
+    //! \brief Returns the span sample idx belongs to
+    const FlowSpan & spanOf(qint32 idx);
+
     QVector<BreathPeak> breaths;
 
-    int m_samples;
-    EventList * m_flow;
     Session * m_session;
-    EventDataType m_gain;
     EventDataType m_rate;
-    EventDataType m_minutes;
-    //! \brief The filtered waveform
+    //! \brief Minimum breath length, in samples
+    int m_sps;
+
+    bool m_calcResp, m_calcTv, m_calcTi, m_calcTe, m_calcMv, m_flag;
+    bool m_running;
+    int m_runs;
+
+    //! \brief Where each piece of the current run starts
+    QVector<FlowSpan> m_spans;
+    //! \brief Where the next piece has to start to carry on the current run
+    qint64 m_nexttime;
+    //! \brief Input samples fed into the current run
+    qint32 m_input;
+    //! \brief Filtered samples out of the filter chain so far
+    qint32 m_samples;
+
+    //! \brief Start time of the current run
+    qint64 m_runstart;
+
+    //! \brief The current runs filtered flow, only kept when flagging needs it
+    QVector<EventDataType> m_hist;
+    //! \brief The filtered waveform, for flagEvents
     EventDataType * m_filtered;
+
     //! \brief BreathPeak's start on positive cycle?
     bool m_startsUpper;
+
+    // The open segment, and the breath being assembled
+    bool m_upper;
+    EventDataType m_segtail;
+    EventDataType m_bmin, m_bmax;
+    qint32 m_bstart, m_bmiddle;
+
+    //! \brief Running Tidal Volume sum from the breath start, and its value at the breath middle
+    double m_tvsum, m_tvmiddle;
+    EventDataType m_tvsps;
+
+    //! \brief Tidal Volume of each breath in breaths
+    QVector<EventDataType> m_breathtv;
+    //! \brief Breaths found in the current run
+    int m_nbreaths;
+    //! \brief Breaths already in the outputs
+    int m_emitted;
+
+    //! \brief Filtered sample indices where the flow crosses the zero line (kept when flagging)
+    QVector<qint32> m_crossings;
+    //! \brief Each segment between crossings' peak after its first sample (max above zero, min below)
+    QVector<EventDataType> m_segpeak;
+    //! \brief Crossings within the block being added
+    QVector<qint32> m_blockcross;
+
+    // Outputs, and their running state
+    EventList * m_RR, * m_TV, * m_Ti, * m_Te, * m_MV;
+    EventDataType m_minrr, m_maxrr, m_mintv, m_maxtv;
+    double m_lastti, m_lastti2, m_lastte, m_lastte2;
+    qint64 m_lastet;
+
+    //! \brief First sample of segment seg
+    inline int segmentStart(int seg) { return seg > 0 ? m_crossings[seg-1] : 0; }
+    //! \brief One past the last sample of segment seg
+    inline int segmentEnd(int seg) { return seg < m_crossings.size() ? m_crossings[seg] : m_samples; }
+    //! \brief Largest absolute value reached in segment seg
+    EventDataType segmentPeak(int seg);
+    //! \brief Returns the segment sample idx belongs to
+    int segmentOf(int idx);
+    //! \brief First sample in [from,to) with an absolute value above cutoff, or to if none
+    int firstAbove(int from, int to, EventDataType cutoff);
+    //! \brief Last sample in (from,to] with an absolute value above cutoff, or from if none
+    int lastAbove(int from, int to, EventDataType cutoff);
 private:
-    EventDataType * m_buffers[num_filter_buffers];
+    //! \brief Block buffers for converting & filtering input, grown as needed and kept for next time
+    QVector<EventDataType> m_inbuf, m_outbuf;
+    //! \brief Stages built from m_filters, kept along with their block buffers
+    FilterChain m_chain;
 };
 
 bool SearchApnea(Session *session, qint64 time, qint64 dist=15000);
 
-//! \brief Calculate Respiratory Rate, Tidal Volume & Minute Ventilation for PRS1 data
-void calcRespRate(Session *session, FlowParser * flowparser=NULL);
+/*! \class WindowExtremes
+    \brief Sliding window minimum & maximum over an EventLists raw data, using monotonic deques
 
-//! \brief Calculates the sliding window AHI graph
-int calcAHIGraph(Session *session);
+    Samples are pushed in at the back as the window grows and dropped off the front as it moves
+    on. Each sample enters and leaves each deque at most once, so a whole pass is linear. Deque
+    values strictly decrease (max) or increase (min) towards the back, which also means the last
+    sample in the window beyond any threshold is always still in them.
+    */
+class WindowExtremes
+{
+public:
+    WindowExtremes();
+
+    //! \brief Empties the window, ready to slide over el
+    void reset(EventList * el);
+
+    //! \brief Adds sample idx, which must come after any pushed before, to the back of the window
+    void push(int idx);
+
+    //! \brief Drops samples before idx from the front of the window
+    void popBefore(int idx);
+
+    //! \brief Returns true if the window has no samples in it
+    bool isEmpty() { return m_maxhead >= m_maxtail; }
+
+    //! \brief Index of the largest sample in the window (the earliest, if tied)
+    int maxIndex() { return m_max[m_maxhead]; }
+
+    //! \brief Index of the smallest sample in the window (the earliest, if tied)
+    int minIndex() { return m_min[m_minhead]; }
+
+    //! \brief Returns the index of the last sample in the window with a gained value above value, or -1
+    int lastAbove(EventDataType value);
+
+    //! \brief Returns the index of the last sample in the window with a gained value below value, or -1
+    int lastBelow(EventDataType value);
+
+protected:
+    const EventStoreType * m_data;
+    EventDataType m_gain;
+    QVector<int> m_max, m_min;
+    int m_maxhead, m_maxtail;
+    int m_minhead, m_mintail;
+};
+
+/*! \struct Excursion
+    \brief A threshold excursion found by findWindowChanges or findRunsBelow, as sample indices
+    */
+struct Excursion {
+    Excursion() { start=0; end=0; value=0; }
+    Excursion(int _start, int _end, EventDataType _value) {
+        start=_start;
+        end=_end;
+        value=_value;
+    }
+    Excursion(const Excursion & copy) {
+        start=copy.start;
+        end=copy.end;
+        value=copy.value;
+    }
+    //! \brief The reference sample the excursion is measured from
+    int start;
+    //! \brief The last sample of the excursion
+    int end;
+    //! \brief Size of the change, or the lowest value reached, in gained units
+    EventDataType value;
+};
+
+/*! \brief Threshold excursion within window detector
+    Flags the last sample within window milliseconds of a reference sample that differs from it
+    by more than threshold, either way. Searching restarts after each excursion found.
+    \returns The number of excursions appended to results */
+int findWindowChanges(EventList * el, qint64 window, EventDataType threshold, QVector<Excursion> & results);
+
+/*! \brief Finds runs of samples at or below level lasting at least duration milliseconds
+    Runs have to start on a non-zero sample, and value holds the lowest non-zero sample reached
+    \returns The number of runs appended to results */
+int findRunsBelow(EventList * el, EventDataType level, qint64 duration, QVector<Excursion> & results);
+
+//! \brief Calculates the requested outputs of a DerivedChannel
+typedef int (*DerivedCalc)(Session * session, const QList<ChannelID> & outputs);
+
+//! \brief Returns a hash of the preferences (and algorithm revision) a DerivedChannel depends on for session
+typedef quint32 (*DerivedParams)(Session * session);
+
+/*! \struct DerivedChannel
+    \brief Registry entry describing channels calculated from other channels, rather than imported
+
+    Each calculated output remembers the parameter hash it was made with (in Session::m_derived),
+    so preference changes and changes to the input channels cause it to be redone automatically.
+    */
+struct DerivedChannel {
+    DerivedChannel() {
+        calc=NULL;
+        params=NULL;
+        lazy=false;
+        supplied=false;
+    }
+    DerivedChannel(QString _name, DerivedCalc _calc, DerivedParams _params, bool _lazy, bool _supplied) {
+        name=_name;
+        calc=_calc;
+        params=_params;
+        lazy=_lazy;
+        supplied=_supplied;
+    }
+    DerivedChannel(const DerivedChannel & copy) {
+        name=copy.name;
+        inputs=copy.inputs;
+        depends=copy.depends;
+        outputs=copy.outputs;
+        calc=copy.calc;
+        params=copy.params;
+        lazy=copy.lazy;
+        supplied=copy.supplied;
+    }
+
+    QString name;
+    //! \brief Channels the calculation works from, at least one must be present
+    QList<ChannelID> inputs;
+    //! \brief Other channels read along the way, which only matter when they change
+    QList<ChannelID> depends;
+    //! \brief Channels produced
+    QList<ChannelID> outputs;
+    DerivedCalc calc;
+    DerivedParams params;
+    //! \brief Only calculated once the session is opened for viewing, not during import
+    bool lazy;
+    //! \brief Outputs may also come straight from machine data, which is left alone
+    bool supplied;
+};
+
+//! \brief Returns the derived channel registry, in calculation order
+const QList<DerivedChannel> & derivedChannelRegistry();
+
+//! \brief Returns the registry entry calculating channel code, or NULL if it isn't a derived channel
+const DerivedChannel * findDerivedChannel(ChannelID code);
+
+//! \brief Returns the channels derived directly from input channel code
+QList<ChannelID> derivedChannels(ChannelID code);
+
+/*! \brief Calculates any of sessions derived channels that are missing or out of date
+    \param lazy Also calculate those left until the session is viewed
+    \returns The number of output channels (re)calculated */
+int updateDerivedChannels(Session * session, bool lazy);
+
+//! \brief Calculate the requested Respiratory Rate, Tidal Volume, Minute Ventilation, Ti, Te & User Flag outputs from the flow waveform
+int calcRespRate(Session *session, const QList<ChannelID> & outputs, FlowParser * flowparser=NULL);
+
+/*! \brief Calculates the sliding window AHI (and RDI for PRS1) graph, in a single sweep over the apnea events
+    \param window_size_ms Window length in milliseconds, or 0 to use the AHI window preference
+    \param window_step Milliseconds between graph points */
+int calcAHIGraph(Session *session, qint64 window_size_ms=0, qint64 window_step=30000);
 
 //! \brief Calculates AHI for a session between start & end (a support function for the sliding window graph)
 EventDataType calcAHI(Session *session,qint64 start=-1, qint64 end=-1);
@@ -144,6 +739,21 @@ EventDataType calcAHI(Session *session,qint64 start=-1, qint64 end=-1);
 //! \brief Leaks calculations for PRS1
 int calcLeaks(Session *session);
 
+//! \brief Writes out the mask leak history if any nights were added to it
+void saveMaskLeakHistory();
+
+//! \brief Records sessions pressure & leak histogram in its machines mask leak history
+void recordMaskLeakHistory(Session * session);
+
+//! \brief Returns true if session has a night in the mask leak history
+bool hasMaskLeakHistory(Session * session);
+
+//! \brief Drops a deleted sessions night from the mask leak history
+void removeMaskLeakHistory(MachineID machine, SessionID session);
+
+//! \brief Drops all of a machines nights from the mask leak history, for when its data is purged
+void purgeMaskLeakHistory(MachineID machine);
+
 //! \brief Calculate Pulse change flagging, according to preferences
 int calcPulseChange(Session *session);
 
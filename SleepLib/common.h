@@ -37,6 +37,21 @@ QString weightString(float kg, UnitSystem us=US_Undefined);
 //! \brief Mercilessly trash a directory
 bool removeDir(const QString & path);
 
+//! \brief CRC-16 (reflected, polynomial 0x8408) of len bytes, as used by PRS1 data chunks. Works eight bytes at a time.
+quint16 CRC16(const unsigned char * data, int len, quint16 crc=0);
+
+/*! \brief Checks CRC16 against a byte at a time version for every length up to 1KB, then logs
+    the throughput of both. Run with -crc16 on the command line.
+    \returns false if they ever disagree */
+bool CRC16SelfTest();
+
+//! \brief Plain 8 bit sum of len bytes, added onto sum
+inline quint8 checksum8(const unsigned char * data, int len, quint8 sum=0)
+{
+    while (len-- > 0) sum+=*data++;
+    return sum;
+}
+
 
 const QString STR_UNIT_CM=QObject::tr("cm");
 const QString STR_UNIT_INCH=QObject::tr("\"");
@@ -7,13 +7,13 @@
 #include "day.h"
 #include "profiles.h"
 #include <cmath>
-#include <QMultiMap>
 #include <algorithm>
 
 Day::Day(Machine *m)
 :machine(m)
 {
     d_firstsession=true;
+    d_totaltime=0;
 }
 Day::~Day()
 {
@@ -50,6 +50,116 @@ void Day::AddSession(Session *s)
 //        if (d_last < s->last()) d_last = s->last();
 //    }
     sessions.push_back(s);
+    s->setDay(this);
+
+    // Keep the interval index up to date as we go, rather than rebuilding it.
+    // The session tells us itself if its times or enabled state change later
+    bool enabled=s->enabled();
+    d_spans.push_back(SessionSpan(s,s->really_first(),s->really_last(),enabled));
+    if (enabled)
+        mergeSpan(s->really_first(),s->really_last());
+}
+
+qint64 Day::drift()
+{
+    if (machine && (machine->GetType()==MT_CPAP))
+        return qint64(PROFILE.cpap->clockDrift())*1000L;
+    return 0;
+}
+
+void Day::mergeSpan(qint64 first, qint64 last)
+{
+    if (last < first)
+        return;
+
+    // Binary search for the first span ending at or after this one starts
+    int lo=0, hi=d_union.size(), mid;
+    while (lo < hi) {
+        mid=(lo+hi)/2;
+        if (d_union[mid].last < first) lo=mid+1;
+        else hi=mid;
+    }
+
+    // Swallow any spans this one overlaps
+    int end=lo;
+    while ((end < d_union.size()) && (d_union[end].first <= last)) {
+        const TimeSpan & span=d_union[end];
+        if (span.first < first) first=span.first;
+        if (span.last > last) last=span.last;
+        d_totaltime-=span.last-span.first;
+        end++;
+    }
+    d_union.remove(lo,end-lo);
+    d_union.insert(lo,TimeSpan(first,last));
+    d_totaltime+=last-first;
+}
+
+void Day::removeSession(Session *s)
+{
+    int i=sessions.indexOf(s);
+    if (i<0)
+        return;
+    sessions.remove(i);
+    d_spans.remove(i);
+    if (s->day()==this)
+        s->setDay(NULL);
+
+    // Can't take a span back out of the union, as it may have swallowed others
+    rebuildIntervals();
+}
+
+void Day::clearSessions()
+{
+    for (int i=0;i<sessions.size();i++) {
+        if (sessions[i]->day()==this)
+            sessions[i]->setDay(NULL);
+    }
+    sessions.clear();
+    d_spans.clear();
+    d_union.clear();
+    d_totaltime=0;
+}
+
+void Day::updateSession(Session *s)
+{
+    int i=sessions.indexOf(s);
+    if (i<0)
+        return;
+
+    SessionSpan & span=d_spans[i];
+    SessionSpan now(s,s->really_first(),s->really_last(),s->enabled());
+    bool grown=span.enabled && now.enabled && (now.first<=span.first) && (now.last>=span.last);
+    bool enabled=!span.enabled && now.enabled;
+    bool unchanged=(!span.enabled && !now.enabled) || (span.enabled && now.enabled && (now.first==span.first) && (now.last==span.last));
+    span=now;
+
+    if (unchanged)
+        return;
+
+    // Sessions only ever grow while being recorded or loaded, which merges straight in
+    if (grown || enabled) {
+        mergeSpan(now.first,now.last);
+    } else {
+        rebuildIntervals();
+    }
+}
+
+void Day::rebuildIntervals()
+{
+    d_union.clear();
+    d_totaltime=0;
+
+    qint64 length=0;
+    for (int i=0;i<d_spans.size();i++) {
+        const SessionSpan & span=d_spans[i];
+        if (!span.enabled) continue;
+
+        mergeSpan(span.first,span.last);
+        length+=span.last-span.first;
+    }
+    if (length!=d_totaltime) {
+        qDebug() << "Sessions Times overlaps!" << d_totaltime << length;
+    }
 }
 
 EventDataType Day::settings_sum(ChannelID code)
@@ -348,45 +458,61 @@ EventDataType Day::wavg(ChannelID code)
 // Total session time in milliseconds
 qint64 Day::total_time()
 {
-    qint64 d_totaltime=0;
-    // Sessions may overlap.. :(
-    QMultiMap<qint64,bool> range;
+    // Sessions may overlap.. the interval index takes care of that
+    return d_totaltime;
+}
 
-    //range.reserve(size()*2);
+qint64 Day::overlap(qint64 start, qint64 end)
+{
 
-    for (QVector<Session *>::iterator s=begin();s!=end();s++) {
-        if (!(*s)->enabled()) continue;
+    qint64 d=drift();
+    start-=d;
+    end-=d;
 
-        Session & sess=*(*s);
-        range.insert(sess.first(),0);
-        range.insert(sess.last(),1);
-        d_totaltime+=sess.length();
+    // Binary search for the first span ending after start
+    int lo=0, hi=d_union.size(), mid;
+    while (lo < hi) {
+        mid=(lo+hi)/2;
+        if (d_union[mid].last <= start) lo=mid+1;
+        else hi=mid;
     }
 
-    qint64 ti=0;
-    bool b;
-    int nest=0;
     qint64 total=0;
-    // This is my implementation of a typical "brace counting" algorithm mentioned here:
-    // http://stackoverflow.com/questions/7468948/problem-calculating-overlapping-date-ranges
-    for (QMultiMap<qint64,bool>::iterator it=range.begin();it!=range.end();it++) {
-        b=it.value();
-        if (!b) {
-            if (!ti) ti=it.key();
-            nest++;
-        } else {
-            if (--nest <= 0) {
-                total+=it.key()-ti;
-                ti=0;
-            }
-        }
+    for (int i=lo; (i < d_union.size()) && (d_union[i].first < end); i++) {
+        total+=qMin(end,d_union[i].last)-qMax(start,d_union[i].first);
+    }
+    return total;
+}
+
+qint64 Day::distance(qint64 start, qint64 end)
+{
+    if (d_union.isEmpty())
+        return -1;
+
+    qint64 d=drift();
+    start-=d;
+    end-=d;
+
+    // Binary search for the first span ending at or after start
+    int lo=0, hi=d_union.size(), mid;
+    while (lo < hi) {
+        mid=(lo+hi)/2;
+        if (d_union[mid].last < start) lo=mid+1;
+        else hi=mid;
     }
 
-    if (total!=d_totaltime) {
-        qDebug() << "Sessions Times overlaps!" << total << d_totaltime;
+    qint64 gap=-1;
+    if (lo < d_union.size()) {
+        if (d_union[lo].first <= end)
+            return 0;
+        gap=d_union[lo].first-end;
     }
-    return total; //d_totaltime;
+    if ((lo > 0) && ((gap < 0) || (start-d_union[lo-1].last < gap))) {
+        gap=start-d_union[lo-1].last;
+    }
+    return gap;
 }
+
 bool Day::hasEnabledSessions()
 {
     bool b=false;
@@ -658,39 +784,15 @@ void Day::CloseEvents()
 
 qint64 Day::first()
 {
-    qint64 date=0;
-    qint64 tmp;
-
-    for (QVector<Session *>::iterator s=sessions.begin();s!=sessions.end();s++) {
-        if (!(*s)->enabled()) continue;
-        tmp=(*s)->first();
-        if (!tmp) continue;
-        if (!date) {
-            date=tmp;
-        } else {
-            if (tmp<date) date=tmp;
-        }
-    }
-    return date;
-//    return d_first;
+    if (d_union.isEmpty())
+        return 0;
+    return d_union.first().first+drift();
 }
 
 //! \brief Returns the last session time of this day
 qint64 Day::last()
 {
-    qint64 date=0;
-    qint64 tmp;
-
-    for (QVector<Session *>::iterator s=sessions.begin();s!=sessions.end();s++) {
-        if (!(*s)->enabled()) continue;
-        tmp=(*s)->last();
-        if (!tmp) continue;
-        if (!date) {
-            date=tmp;
-        } else {
-            if (tmp>date) date=tmp;
-        }
-    }
-    return date;
-//    return d_last;
+    if (d_union.isEmpty())
+        return 0;
+    return d_union.last().last+drift();
 }
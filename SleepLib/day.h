@@ -23,6 +23,33 @@ class OneTypePerDay
 class Machine;
 class Session;
 
+/*! \struct TimeSpan
+    \brief A time range, in milliseconds since epoch
+    */
+struct TimeSpan {
+    TimeSpan() { first=last=0; }
+    TimeSpan(qint64 _first, qint64 _last) { first=_first; last=_last; }
+    qint64 first;
+    qint64 last;
+};
+
+/*! \struct SessionSpan
+    \brief A Sessions time range & enabled state, as last merged into Day's interval index
+    */
+struct SessionSpan {
+    SessionSpan() { session=NULL; first=last=0; enabled=false; }
+    SessionSpan(Session * _session, qint64 _first, qint64 _last, bool _enabled) {
+        session=_session;
+        first=_first;
+        last=_last;
+        enabled=_enabled;
+    }
+    Session * session;
+    qint64 first;
+    qint64 last;
+    bool enabled;
+};
+
 /*! \class Day
     \brief Contains a list of all Sessions for single date, for a single machine
     */
@@ -35,6 +62,15 @@ public:
     //! \brief Add Session to this Day object (called during Load)
     void AddSession(Session *s);
 
+    //! \brief Takes Session s out of this Day, without deleting it
+    void removeSession(Session *s);
+
+    //! \brief Empties this Days session list, without deleting the sessions
+    void clearSessions();
+
+    //! \brief Updates the interval index after s changed its time range or enabled state (see Session::setDay)
+    void updateSession(Session *s);
+
     //! \brief Returns this machines type
     MachineType machine_type();
 
@@ -104,9 +140,19 @@ public:
     //! \brief Returns the last session time of this day for the supplied Channel code
     qint64 last(ChannelID code);
 
-    //! \brief Returns the total time in milliseconds for this day
+    //! \brief Returns the total time in milliseconds for this day (overlapping sessions only count once)
     qint64 total_time();
 
+    //! \brief Returns how many milliseconds between start and end are covered by enabled sessions
+    qint64 overlap(qint64 start, qint64 end);
+
+    //! \brief Returns true if any enabled session overlaps the time range start to end
+    bool overlaps(qint64 start, qint64 end) { return overlap(start,end) > 0; }
+
+    /*! \brief Returns the milliseconds between the time range start to end and the closest enabled session
+        Returns 0 if they overlap or touch, or -1 if there are no enabled sessions */
+    qint64 distance(qint64 start, qint64 end);
+
     //! \brief Returns true if this day has enabled sessions
     bool hasEnabledSessions();
 
@@ -137,8 +183,8 @@ public:
     //! \brief Closes all Events files for this Days Sessions
     void CloseEvents();
 
-    //! \brief Returns this days sessions list
-    QVector<Session *> & getSessions() { return sessions; }
+    //! \brief Returns this days sessions list (use AddSession/removeSession to change it)
+    const QVector<Session *> & getSessions() { return sessions; }
 
     //! \brief Returns true if this Day contains loaded Event Data for this channel.
     bool channelExists(ChannelID id);
@@ -157,6 +203,24 @@ protected:
     QVector<Session *> sessions;
     QHash<ChannelID, QHash<EventDataType, EventDataType> > perc_cache;
     //qint64 d_first,d_last;
+
+    //! \brief Rebuilds the session interval index from d_spans, for when a span shrank or went away
+    void rebuildIntervals();
+
+    //! \brief Merges the time range first to last into the session interval index
+    void mergeSpan(qint64 first, qint64 last);
+
+    //! \brief Returns the clock drift the sessions apply to their times
+    qint64 drift();
+
+    //! \brief Each sessions span, in session order, the interval index was built from
+    QVector<SessionSpan> d_spans;
+
+    //! \brief Sorted, non overlapping union of the enabled session time ranges (without clock drift)
+    QVector<TimeSpan> d_union;
+
+    //! \brief Cached length of d_union
+    qint64 d_totaltime;
 private:
     bool d_firstsession;
 };
@@ -122,6 +122,46 @@ void EventList::AddEvent(qint64 time, EventStoreType data, EventStoreType data2)
     m_count++;
 }
 
+void EventList::AddEvents(const qint64 * time, const EventStoreType * data, int recs)
+{
+    if (recs<=0) return;
+
+    if (!m_first) {
+        m_first=time[0];
+        m_last=time[0];
+    }
+    if (m_first>time[0]) {
+        // Needs the earlier records shifting, which AddEvent already knows how to do
+        for (int i=0;i<recs;i++) AddEvent(time[i],data[i]);
+        return;
+    }
+
+    int r=m_count;
+    m_count+=recs;
+    m_data.resize(m_count);
+    m_time.resize(m_count);
+
+    EventStoreType * dp=m_data.data()+r;
+    quint32 * tp=m_time.data()+r;
+
+    if (m_update_minmax) {
+        EventDataType min=m_min,max=m_max,val;
+        for (int i=0;i<recs;i++) {
+            val=EventDataType(data[i])*m_gain; // ignoring m_offset
+            if (min>val) min=val;
+            if (max<val) max=val;
+        }
+        m_min=min;
+        m_max=max;
+    }
+    for (int i=0;i<recs;i++) {
+        dp[i]=data[i];
+        tp[i]=time[i]-m_first;
+    }
+    if (m_last<time[recs-1])
+        m_last=time[recs-1];
+}
+
 // Adds a consecutive waveform chunk
 void EventList::AddWaveform(qint64 start, qint16 * data, int recs, qint64 duration)
 {
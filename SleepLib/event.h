@@ -29,6 +29,10 @@ public:
       Note, data2 is only used if second_field is specified in the constructor */
     void AddEvent(qint64 time, EventStoreType data);
     void AddEvent(qint64 time, EventStoreType data, EventStoreType data2);
+
+    /*! \brief Adds recs events in one go, each time (ms since epoch) paired with its data
+      Times must be in ascending order */
+    void AddEvents(const qint64 * time, const EventStoreType * data, int recs);
     void AddWaveform(qint64 start, qint16 * data, int recs, qint64 duration);
     void AddWaveform(qint64 start, unsigned char * data, int recs, qint64 duration);
     void AddWaveform(qint64 start, char * data, int recs, qint64 duration);
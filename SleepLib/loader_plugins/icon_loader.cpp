@@ -8,11 +8,15 @@ Copyright: (c)2012 Mark Watkins
 
 */
 
+#include <QApplication>
 #include <QDir>
 #include <QProgressBar>
 #include <QMessageBox>
-#include <QDataStream>
-#include <QTextStream>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <cctype>
 #include <cmath>
 
 #include "icon_loader.h"
@@ -33,7 +37,6 @@ FPIcon::~FPIcon()
 
 FPIconLoader::FPIconLoader()
 {
-    m_buffer=NULL;
 }
 
 FPIconLoader::~FPIconLoader()
@@ -133,6 +136,168 @@ bool operator<(const FPWaveChunk & a, const FPWaveChunk & b) {
     return (a.st < b.st);
 }
 
+// Every Icon data file starts with a text header this long, its last byte a checksum
+const int fpicon_header_size=0x200;
+
+/*! \class FPIconFile
+    \brief Maps an Icon data file into memory, so records can be decoded right where they lie
+    */
+class FPIconFile
+{
+public:
+    FPIconFile(const QString & filename):m_file(filename) { m_map=NULL; m_data=NULL; m_size=0; }
+    ~FPIconFile() { if (m_map) m_file.unmap(m_map); }
+
+    //! \brief Maps the file, falling back to reading it whole when mapping isn't possible
+    bool open() {
+        if (!m_file.open(QIODevice::ReadOnly)) return false;
+        m_size=m_file.size();
+        if (m_size>0) m_map=m_file.map(0,m_size);
+        if (m_map) {
+            m_data=m_map;
+        } else {
+            m_buffer=m_file.readAll();
+            m_size=m_buffer.size();
+            m_data=(const unsigned char *)m_buffer.constData();
+        }
+        return true;
+    }
+
+    /*! \brief Checks the header checksum, and splits the first num whitespace separated header fields into fields
+        Returns false if the file is too short to have a header */
+    bool readHeader(QStringList & fields, int num, quint8 seed) {
+        if (m_size<fpicon_header_size) return false;
+        if (checksum8(m_data,fpicon_header_size-1,seed)!=m_data[fpicon_header_size-1]) {
+            qDebug() << "Header checksum mismatch" << m_file.fileName();
+        }
+        const unsigned char * p=m_data, * end=m_data+fpicon_header_size;
+        while ((fields.size()<num) && (p<end)) {
+            while ((p<end) && isspace(*p)) p++;
+            const unsigned char * st=p;
+            while ((p<end) && !isspace(*p)) p++;
+            if (p>st) fields.push_back(QString::fromLatin1((const char *)st,p-st));
+        }
+        while (fields.size()<num) fields.push_back(QString());
+        return true;
+    }
+
+    const unsigned char * data() { return m_data; }
+    qint64 size() { return m_size; }
+
+protected:
+    QFile m_file;
+    uchar * m_map;
+    QByteArray m_buffer;
+    const unsigned char * m_data;
+    qint64 m_size;
+};
+
+//! \brief Icon dates & times are packed DOS style into two little endian words
+static inline QDateTime fpiconDateTime(const unsigned char * p)
+{
+    quint16 d=p[1] << 8 | p[0];
+    quint16 t=p[3] << 8 | p[2];
+    return QDateTime(QDate(2000+((d >> 9) & 0x7f),(d >> 5) & 0x0f,d & 0x1f),QTime((t >> 11) & 0x1f,(t >> 5) & 0x3f,(t & 0x1f) * 2),Qt::UTC);
+}
+
+enum FPIconFileType { FPI_Summary, FPI_Detail, FPI_Flow };
+
+/*! \struct FPIconImportQueue
+    \brief What FPIconImport workers share with FPIconLoader::OpenMachine */
+struct FPIconImportQueue {
+    FPIconImportQueue() {
+        loader=NULL;
+        multithreaded=true;
+        finished=0;
+    }
+
+    //! \brief Starts a new batch of size tasks
+    void start(int size) {
+        results.clear();
+        results.resize(size);
+        finished=0;
+    }
+
+    //! \brief Hands task to the thread pool, or runs it right here if not multithreaded
+    void run(QRunnable * task);
+
+    //! \brief Waits for the batch to finish, moving the progress bar from progress_start to progress_end
+    void wait(float progress_start, float progress_end);
+
+    FPIconLoader * loader;
+    bool multithreaded;
+
+    QMutex mutex;
+    //! \brief Signalled every time a worker finishes
+    QWaitCondition changed;
+    QVector<FPIconResult> results;
+    int finished;
+};
+
+/*! \class FPIconImport
+    \brief Decodes one Icon data file on a QThreadPool thread, into its slot of the queues results
+    */
+class FPIconImport:public QRunnable
+{
+public:
+    FPIconImport(FPIconImportQueue * queue, int index, FPIconFileType type, const QString & filename)
+        :m_queue(queue),m_index(index),m_type(type),m_filename(filename) {}
+    virtual void run();
+protected:
+    FPIconImportQueue * m_queue;
+    int m_index;
+    FPIconFileType m_type;
+    QString m_filename;
+};
+
+void FPIconImport::run()
+{
+    FPIconLoader * loader=m_queue->loader;
+    FPIconResult result;
+    switch (m_type) {
+    case FPI_Summary:
+        loader->OpenSummary(m_filename,result);
+        break;
+    case FPI_Detail:
+        loader->OpenDetail(m_filename,result);
+        break;
+    case FPI_Flow:
+        loader->OpenFLW(m_filename,result);
+        break;
+    }
+
+    QMutexLocker lock(&m_queue->mutex);
+    m_queue->results[m_index]=result;
+    m_queue->finished++;
+    m_queue->changed.wakeAll();
+}
+
+void FPIconImportQueue::run(QRunnable * task)
+{
+    if (multithreaded) {
+        QThreadPool::globalInstance()->start(task);
+    } else {
+        task->run();
+        delete task;
+    }
+}
+
+void FPIconImportQueue::wait(float progress_start, float progress_end)
+{
+    int size=results.size();
+    int done;
+    do {
+        mutex.lock();
+        if (finished<size)
+            changed.wait(&mutex,100);
+        done=finished;
+        mutex.unlock();
+
+        if (qprogress && size) qprogress->setValue(progress_start+(float(done)/float(size)*(progress_end-progress_start)));
+        QApplication::processEvents();
+    } while (done<size);
+}
+
 int FPIconLoader::OpenMachine(Machine *mach, QString & path, Profile * profile)
 {
     qDebug() << "Opening FPIcon " << path;
@@ -155,7 +320,6 @@ int FPIconLoader::OpenMachine(Machine *mach, QString & path, Profile * profile)
         fpath=path+"/"+filename;
         if (filename.left(3).toUpper()=="SUM") {
             summary.push_back(fpath);
-            OpenSummary(mach,fpath,profile);
         } else if (filename.left(3).toUpper()=="DET") {
             det.push_back(fpath);
         } else if (filename.left(3).toUpper()=="FLW") {
@@ -164,12 +328,41 @@ int FPIconLoader::OpenMachine(Machine *mach, QString & path, Profile * profile)
             log.push_back(fpath);
         }
     }
+
+    FPIconImportQueue queue;
+    queue.loader=this;
+    queue.multithreaded=PROFILE.session->multithreading();
+
+    // Summaries first, as they're what create the sessions
+    queue.start(summary.size());
+    for (int i=0;i<summary.size();i++) {
+        queue.run(new FPIconImport(&queue,i,FPI_Summary,summary[i]));
+    }
+    queue.wait(0,10);
+    for (int i=0;i<queue.results.size();i++) {
+        mergeSummary(mach,profile,queue.results[i]);
+    }
+
+    // Sessions stays put from here, so detail & flow files can all be decoded at once
+    queue.start(det.size()+flw.size());
+    for (int i=0;i<det.size();i++) {
+        queue.run(new FPIconImport(&queue,i,FPI_Detail,det[i]));
+    }
+    for (int i=0;i<flw.size();i++) {
+        queue.run(new FPIconImport(&queue,det.size()+i,FPI_Flow,flw[i]));
+    }
+    queue.wait(10,90);
     for (int i=0;i<det.size();i++) {
-        OpenDetail(mach,det[i],profile);
+        mergeDetail(queue.results[i]);
     }
     for (int i=0;i<flw.size();i++) {
-        OpenFLW(mach,flw[i],profile);
+        mergeFLW(queue.results[det.size()+i]);
+    }
+    if (Sessions.isEmpty()) { // nothing new, and nothing to list below
+        mach->Save();
+        return true;
     }
+
     SessionID zz,sid,st;
     float hours,dur,mins;
 
@@ -245,64 +438,40 @@ int FPIconLoader::OpenMachine(Machine *mach, QString & path, Profile * profile)
 }
 
 
-bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
+bool FPIconLoader::OpenFLW(QString filename, FPIconResult & result)
 {
-    QByteArray data;
     quint16 t1;
     quint32 ts;
     double ti;
-    qint8 b;
     EventList * flow=NULL, * pressure=NULL, *leak=NULL;
     QDateTime datetime;
-    quint8 a1,a2;
-    unsigned char * buf, *endbuf;
+    const unsigned char * buf, *endbuf;
 
     int month,day,year,hour,minute,second;
 
     long pos=0;
 
     qDebug() << filename;
-    QByteArray header;
-    QFile file(filename);
-    if (!file.open(QFile::ReadOnly)) {
+    FPIconFile file(filename);
+    if (!file.open()) {
         qDebug() << "Couldn't open" << filename;
         return false;
     }
-    header=file.read(0x200);
-    if (header.size()!=0x200) {
+    QStringList hdr;
+    if (!file.readHeader(hdr,3,0xff) || (file.size()<fpicon_header_size+4)) {
         qDebug() << "Short file" << filename;
         return false;
     }
-    unsigned char hsum=0xff;
-    for (int i=0;i<0x1ff;i++) {
-        hsum+=header[i];
-    }
-    if (hsum!=header[0x1ff]) {
-        qDebug() << "Header checksum mismatch" << filename;
-    }
-    QTextStream htxt(&header);
-    QString h1,version,fname,serial,model,type;
-    htxt >> h1;
-    htxt >> version;
-    htxt >> fname;
-    htxt >> serial;
-    htxt >> model;
-    htxt >> type;
+    QString fname=hdr[2];
 
     fname.chop(4);
     QString num=fname.right(4);
     int filenum=num.toInt();
 
-    data=file.readAll();
-
-    buf=(unsigned char *)data.data();
-    endbuf=buf+data.size();
-
-    a1=*buf++;
-    a2=*buf++;
-    t1=a2 << 8 | a1;
-    pos+=2;
+    buf=file.data()+fpicon_header_size;
+    endbuf=file.data()+file.size();
 
+    t1=buf[1] << 8 | buf[0];
     if (t1==0xfafe)  // End of file marker..
     {
         qDebug() << "FaFE observed in" << filename;
@@ -313,17 +482,15 @@ bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
     month=((t1 >> 5) & 0x0f);
     year=2000+((t1 >> 9) & 0x7f);
 
-    a1=*buf++;
-    a2=*buf++;
-
-    t1=a2 << 8 | a1;
+    t1=buf[3] << 8 | buf[2];
 
     // Why the heck does F&P do this? This affects the MINUTES field and the HOURS field.
     // But is clearly not a valid UTC conversion.. Bug? Or idiotic obfuscation attempt?
     // It would of made (idiotic) sense if they shifted the bits on bit further to the right.
     t1-=0xc0;
 
-    pos+=2;
+    buf+=4;
+    pos+=4;
 
     second=(t1 & 0x1f) * 2;
     minute=(t1 >> 5) & 0x3f;
@@ -332,43 +499,27 @@ bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
     datetime=QDateTime(QDate(year,month,day),QTime(hour,minute,second),Qt::UTC);
 
     QDate date;
-    QTime time;
     if (!datetime.isValid() || (datetime.date()<QDate(2010,1,1))) {
         pos=0;
         buf-=4;
         datetime=QDateTime(QDate(2000,1,1),QTime(0,0,0));
-        date=datetime.date();
-        ts=datetime.toTime_t();
-    }  else {
-        date=datetime.date();
-        time=datetime.time();
-        ts=datetime.toTime_t();
     }
+    date=datetime.date();
+    ts=datetime.toTime_t();
 
-    FLWDate[filenum]=date;
+    result.filenum=filenum;
+    result.date=date;
+    result.ts=ts;
 
     ti=qint64(ts)*1000L;
     qint64 st=ti;
 
-    EventStoreType pbuf[256];
-
-    QMap<SessionID, Session *>::iterator sit=Sessions.find(ts);
-
-    Session *sess;
-
-    if (sit!=Sessions.end()) {
-        sess=sit.value();
-        qDebug() << filenum << ":" << date << sess->session() << ":" << sess->hours()*60.0;
-    } else {
-        sess=NULL;
-        qDebug() << filenum << ":" << date << "couldn't find matching session for" << ts;
-    }
-
-
     const double rate=1000.0/50.0;
 
+    // Each chunk is decoded here in full, then handed to its EventLists in one go
+    QVector<EventStoreType> fbuf, lkbuf, prbuf;
+    QVector<qint64> times;
 
-    int count;
     for (int chunks=0;buf<endbuf;++chunks) { // each chunk is a seperate session
 
         flow=new EventList(EVL_Waveform,1.0,0,0,0,rate);
@@ -379,26 +530,23 @@ bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
         leak->setFirst(ti);
         pressure->setFirst(ti);
 
-        FLWMapFlow[filenum].push_back(flow);
-        FLWMapLeak[filenum].push_back(leak);
-        FLWMapPres[filenum].push_back(pressure);
-        FLWTS[filenum].push_back(ti);
+        FPFlowChunk chunk(ti,flow,leak,pressure);
+        fbuf.resize(0);
+        lkbuf.resize(0);
+        prbuf.resize(0);
+        times.resize(0);
 
-        count=0;
         int len;
         qint16 pr;
         quint16 lkaj;
         do {
-            unsigned char * p=buf,*p2;
+            const unsigned char * p=buf,*p2;
 
             // scan ahead to 0xffff marker
             p2=buf+103;
             if (p2>endbuf)
                 break;
-            if (!((p2[0]==0xff) && (p2[1]==0xff))) {
-                if (count>0) {
-                    int i=5;
-                }
+            if (!((p2+1<endbuf) && (p2[0]==0xff) && (p2[1]==0xff))) {
                 do {
                     while ((*p++ != 0xff) && (p < endbuf)) {
                         pos++;
@@ -410,7 +558,6 @@ bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
                 if (p >= endbuf)
                     break;
             } else {
-                //if (count>0)
                 p=p2+2;
             }
             p2=p-5;
@@ -419,41 +566,22 @@ bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
             lkaj=p2[2];  // Could this value perhaps be Leak???
             len/=2;
 
-            count++;
-
-            if (pr<0) {
-                quint16 z3=pr;
-                int i=5;
-            }
-
-            if (leak) {
-                leak->AddEvent(ti,lkaj);
-            }
-            if (pressure) {
-                pressure->AddEvent(ti,pr);
-            }
-
-            if (flow) {
-                qint16 tmp;
-                unsigned char * bb=(unsigned char *)buf;
-                char c;
-                if (len>50) {
-                    int i=5;
-                }
-
-                EventDataType val;
-                for (int i=0;i<len;i++) {
-                    //c=bb[1];
-                    tmp=bb[1] << 8 | bb[0];
-                    val=(EventDataType(tmp)/100.0)-lkaj;
-                    if (val<-128) val=-128;
-                    else if (val>128) val=128;
-                    bb+=2;
-
-                    pbuf[i]=val;
-                }
-
-                flow->AddWaveform(ti,pbuf,len,rate);
+            times.push_back(ti);
+            lkbuf.push_back(lkaj);
+            prbuf.push_back(pr);
+
+            int r=fbuf.size();
+            fbuf.resize(r+len);
+            EventStoreType * dp=fbuf.data()+r;
+            const unsigned char * bb=buf;
+            EventDataType val;
+            for (int i=0;i<len;i++) {
+                val=(EventDataType(qint16(bb[1] << 8 | bb[0]))/100.0)-lkaj;
+                if (val<-128) val=-128;
+                else if (val>128) val=128;
+                bb+=2;
+
+                dp[i]=val;
             }
 
             ti+=len*rate;
@@ -468,315 +596,274 @@ bool FPIconLoader::OpenFLW(Machine * mach,QString filename, Profile * profile)
                 break;
             }
         } while (buf < endbuf);
-//        pressure->setType(EVL_Waveform);
-//        pressure->getTime().clear();
-//        leak->getTime().clear();
-//        leak->setType(EVL_Waveform);
-
-        if (sess && FLWMapFlow[filenum].size()==1 && (st==sess->first())) {
-            sess->eventlist[CPAP_FlowRate].push_back(FLWMapFlow[filenum].at(0));
-            sess->eventlist[CPAP_Leak].push_back(FLWMapLeak[filenum].at(0));
-            sess->eventlist[CPAP_MaskPressure].push_back(FLWMapPres[filenum].at(0));
-//            FLWMapFlow[filenum].erase(FLWMapFlow[filenum].begin());
-//            FLWMapLeak[filenum].erase(FLWMapLeak[filenum].begin());
-//            FLWMapPres[filenum].erase(FLWMapPres[filenum].begin());
-        }
 
+        if (fbuf.size()>0) {
+            flow->AddWaveform(chunk.start,fbuf.data(),fbuf.size(),qint64(fbuf.size()*rate));
+        }
+        leak->AddEvents(times.constData(),lkbuf.constData(),times.size());
+        pressure->AddEvents(times.constData(),prbuf.constData(),times.size());
 
         qDebug() << ts << dec << double(ti-st)/60000.0;
-        FLWDuration[filenum].push_back(ti-st);
+        chunk.duration=ti-st;
+        result.flow.push_back(chunk);
         st=ti;
-    } while (buf < endbuf);
+    }
+
+    return true;
+}
+
+void FPIconLoader::mergeFLW(FPIconResult & result)
+{
+    int filenum=result.filenum;
+    QDate date=result.date;
+    if (result.flow.isEmpty() && !result.ts) return; // never got past the header
+
+    FLWDate[filenum]=date;
+
+    Session *sess;
+    QMap<SessionID, Session *>::iterator sit=Sessions.find(result.ts);
+    if (sit!=Sessions.end()) {
+        sess=sit.value();
+        qDebug() << filenum << ":" << date << sess->session() << ":" << sess->hours()*60.0;
+    } else {
+        sess=NULL;
+        qDebug() << filenum << ":" << date << "couldn't find matching session for" << result.ts;
+    }
 
+    for (int i=0;i<result.flow.size();i++) {
+        const FPFlowChunk & chunk=result.flow.at(i);
+        FLWMapFlow[filenum].push_back(chunk.flow);
+        FLWMapLeak[filenum].push_back(chunk.leak);
+        FLWMapPres[filenum].push_back(chunk.pressure);
+        FLWTS[filenum].push_back(chunk.start);
+        FLWDuration[filenum].push_back(chunk.duration);
+
+        if (sess && FLWMapFlow[filenum].size()==1 && (chunk.start==sess->first())) {
+            sess->eventlist[CPAP_FlowRate].push_back(chunk.flow);
+            sess->eventlist[CPAP_Leak].push_back(chunk.leak);
+            sess->eventlist[CPAP_MaskPressure].push_back(chunk.pressure);
+        }
+    }
 
     QList<Session *> values = SessDate.values(date);
     for (int i = 0; i < values.size(); ++i) {
         sess=values.at(i);
         qDebug() << date << sess->session() << ":" << QString::number(sess->hours()*60.0,'f',0);
     }
-    return true;
 }
 
-bool FPIconLoader::OpenSummary(Machine * mach,QString filename, Profile * profile)
+// Bytes per SUM file record
+const int fpicon_summary_size=0x1d;
+
+bool FPIconLoader::OpenSummary(QString filename, FPIconResult & result)
 {
     qDebug() << filename;
-    QByteArray header;
-    QFile file(filename);
-    if (!file.open(QFile::ReadOnly)) {
+    FPIconFile file(filename);
+    if (!file.open()) {
         qDebug() << "Couldn't open" << filename;
         return false;
     }
-    header=file.read(0x200);
-    if (header.size()!=0x200) {
+    QStringList hdr;
+    if (!file.readHeader(hdr,6,0xff)) {
         qDebug() << "Short file" << filename;
         return false;
     }
-    unsigned char hsum=0xff;
-    for (int i=0;i<0x1ff;i++) {
-        hsum+=header[i];
-    }
-    if (hsum!=header[0x1ff]) {
-        qDebug() << "Header checksum mismatch" << filename;
-    }
-    QTextStream htxt(&header);
-    QString h1,version,fname,serial,model,type;
-    htxt >> h1;
-    htxt >> version;
-    htxt >> fname;
-    htxt >> serial;
-    htxt >> model;
-    htxt >> type;
-    mach->properties[STR_PROP_Model]=model+" "+type;
-
-
-    QByteArray data;
-    data=file.readAll();
-    //long size=data.size(),pos=0;
-    QDataStream in(data);
-    in.setVersion(QDataStream::Qt_4_6);
-    in.setByteOrder(QDataStream::LittleEndian);
-
-    quint16 t1,t2;
-    quint32 ts;
-    //QByteArray line;
-    unsigned char a1,a2, a3,a4, a5, p1, p2,  p3, p4, p5, j1, j2, j3 ,j4,j5,j6,j7, x1, x2;
-
-    quint16 d1,d2,d3;
+    QString model=hdr[4], type=hdr[5];
+    result.model=model+" "+type;
 
+    const unsigned char * p=file.data()+fpicon_header_size;
+    const unsigned char * end=file.data()+file.size();
 
+    result.summary.reserve((end-p)/fpicon_summary_size);
+    FPSummaryRecord rec;
     QDateTime datetime;
 
-    int runtime,usage;
-
-    int day,month,year,hour,minute,second;
-    QDate date;
-
-    do {
-        in >> a1;
-        in >> a2;
-        t1=a2 << 8 | a1;
-
-        if (t1==0xfafe)
+    // Fixed size records, decoded straight out of the file
+    for (;p+fpicon_summary_size<=end;p+=fpicon_summary_size) {
+        if ((p[1] << 8 | p[0])==0xfafe)
             break;
 
-        day=t1 & 0x1f;
-        month=(t1 >> 5) & 0x0f;
-        year=2000+((t1 >> 9) & 0x7f);
+        datetime=fpiconDateTime(p);
+        rec.date=datetime.date();
+        rec.ts=datetime.toTime_t();
 
-        in >> a1;
-        in >> a2;
+        // the following two quite often match in value
+        // 0x04 Run Time, 0x05 Usage Time
+        rec.usage=p[0x05] * 360; // durations are in tenth of an hour intervals
 
-        t1=a2 << 8 | a1;
+        // 0x06 Ramps???, 0x07 a pressure value?, 0x08 ?? varies.. always less than 90% leak..
+        // 0x09, 0x0b, 0x0d 90% Leak value.. (16bit)
 
-        second=(t1 & 0x1f) * 2;
-        minute=(t1 >> 5) & 0x3f;
-        hour=(t1 >> 11) & 0x1f;
+        rec.p1=p[0x0f];
+        rec.p2=p[0x10];
 
-        datetime=QDateTime(QDate(year,month,day),QTime(hour,minute,second),Qt::UTC);
+        // 0x11 ?
+        rec.apnea=p[0x12];     // Apnea Events
+        rec.hypopnea=p[0x13];  // Hypopnea events
+        // 0x14 Flow Limitation events, 0x15, 0x16, 0x17 ?
 
-        date=datetime.date();
-        ts=datetime.toTime_t();
+        rec.p3=p[0x18];
+        rec.p4=p[0x19];
+        // 0x1a, 0x1b ?
+        rec.humid=p[0x1c];     // humidifier setting
 
-        // the following two quite often match in value
-        in >> a1;  // 0x04 Run Time
-        in >> a2;  // 0x05 Usage Time
-        runtime=a1 * 360; // durations are in tenth of an hour intervals
-        usage=a2 * 360;
-
-        in >> a3;  // 0x06  // Ramps???
-        in >> a4;  // 0x07  // a pressure value?
-        in >> a5;  // 0x08  // ?? varies.. always less than 90% leak..
-
-        in >> d1;  // 0x09
-        in >> d2;  // 0x0b
-        in >> d3;  // 0x0d   // 90% Leak value..
-
-        in >> p1;  // 0x0f
-        in >> p2;  // 0x10
-
-        in >> j1;  // 0x11
-        in >> j2;  // 0x12  // Apnea Events
-        in >> j3;  // 0x13  // Hypopnea events
-        in >> j4;  // 0x14  // Flow Limitation events
-        in >> j5;  // 0x15
-        in >> j6;  // 0x16
-        in >> j7;  // 0x17
-
-        in >> p3;  // 0x18
-        in >> p4;  // 0x19
-        in >> p5;  // 0x1a
-
-        in >> x1;  // 0x1b
-        in >> x2;  // 0x1c    // humidifier setting
-
-        if (!mach->SessionExists(ts)) {
-            Session *sess=new Session(mach,ts);
-            sess->really_set_first(qint64(ts)*1000L);
-            sess->really_set_last(qint64(ts+usage)*1000L);
-            sess->SetChanged(true);
-            sess->setCount(CPAP_Obstructive, j2);
-            sess->setCount(CPAP_Hypopnea, j3);
-            SessDate.insert(date,sess);
-//            sess->setCount(CPAP_Obstructive,j1);
-//            sess->setCount(CPAP_Hypopnea,j2);
-//            sess->setCount(CPAP_ClearAirway,j3);
-//            sess->setCount(CPAP_Apnea,j4);
-            //sess->setCount(CPAP_,j5);
-            if (p1!=p2) {
-                sess->settings[CPAP_Mode]=(int)MODE_APAP;
-                sess->settings[CPAP_PressureMin]=p4/10.0;
-                sess->settings[CPAP_PressureMax]=p3/10.0;
-            } else {
-                sess->settings[CPAP_Mode]=(int)MODE_CPAP;
-                sess->settings[CPAP_Pressure]=p1/10.0;
-            }
-            sess->settings[CPAP_HumidSetting]=x2;
-            //sess->settings[CPAP_PresReliefType]=PR_SENSAWAKE;
-            Sessions[ts]=sess;
-            mach->AddSession(sess,profile);
-        }
-    } while (!in.atEnd());
+        result.summary.push_back(rec);
+    }
 
     return true;
 }
 
-bool FPIconLoader::OpenDetail(Machine * mach, QString filename, Profile * profile)
+void FPIconLoader::mergeSummary(Machine * mach, Profile * profile, FPIconResult & result)
+{
+    if (result.model.isEmpty()) return;
+    mach->properties[STR_PROP_Model]=result.model;
+
+    for (int i=0;i<result.summary.size();i++) {
+        const FPSummaryRecord & rec=result.summary.at(i);
+        SessionID ts=rec.ts;
+        if (mach->SessionExists(ts)) continue;
+
+        Session *sess=new Session(mach,ts);
+        sess->really_set_first(qint64(ts)*1000L);
+        sess->really_set_last(qint64(ts+rec.usage)*1000L);
+        sess->SetChanged(true);
+        sess->setCount(CPAP_Obstructive, rec.apnea);
+        sess->setCount(CPAP_Hypopnea, rec.hypopnea);
+        SessDate.insert(rec.date,sess);
+        if (rec.p1!=rec.p2) {
+            sess->settings[CPAP_Mode]=(int)MODE_APAP;
+            sess->settings[CPAP_PressureMin]=rec.p4/10.0;
+            sess->settings[CPAP_PressureMax]=rec.p3/10.0;
+        } else {
+            sess->settings[CPAP_Mode]=(int)MODE_CPAP;
+            sess->settings[CPAP_Pressure]=rec.p1/10.0;
+        }
+        sess->settings[CPAP_HumidSetting]=rec.humid;
+        //sess->settings[CPAP_PresReliefType]=PR_SENSAWAKE;
+        Sessions[ts]=sess;
+        mach->AddSession(sess,profile);
+    }
+}
+
+// DET file layout: an index of 7 byte entries, then 5 byte records, three to an index step
+const int fpicon_detail_index_size=0x800;
+const int fpicon_detail_entry_size=7;
+const int fpicon_detail_record_size=5;
+
+bool FPIconLoader::OpenDetail(QString filename, FPIconResult & result)
 {
     qDebug() << filename;
-    QByteArray header;
-    QFile file(filename);
-    if (!file.open(QFile::ReadOnly)) {
+    FPIconFile file(filename);
+    if (!file.open()) {
         qDebug() << "Couldn't open" << filename;
         return false;
     }
-    header=file.read(0x200);
-    if (header.size()!=0x200) {
+    QStringList hdr;
+    if (!file.readHeader(hdr,0,0)) {
         qDebug() << "Short file" << filename;
         return false;
     }
-    unsigned char hsum=0;
-    for (int i=0;i<0x1ff;i++) {
-        hsum+=header[i];
-    }
-    if (hsum!=header[0x1ff]) {
-        qDebug() << "Header checksum mismatch" << filename;
-    }
-
-    QByteArray index;
-    index=file.read(0x800);
-    long size=index.size(),pos=0;
-    QDataStream in(index);
-
-    in.setVersion(QDataStream::Qt_4_6);
-    in.setByteOrder(QDataStream::LittleEndian);
-    quint32 ts;
-    QDateTime datetime;
-    QDate date;
-    QTime time;
-    //FPDetIdx *idx=(FPDetIdx *)index.data();
 
+    const unsigned char * index=file.data()+fpicon_header_size;
+    qint64 isize=qMin(qint64(fpicon_detail_index_size),file.size()-fpicon_header_size);
+    const unsigned char * data=index+isize;
+    qint64 dsize=file.size()-fpicon_header_size-isize;
 
     QVector<quint32> times;
     QVector<quint16> start;
     QVector<quint8> records;
 
-    quint16 t1;
-    quint16 strt;
-    quint8 recs,z1,z2;
-
-
-    int day,month,year,hour,minute,second;
-
-    int totalrecs=0;
-    do {
-        in >> z1;
-        in >> z2;
-        t1=z2 << 8 | z1;
-
-        if (t1==0xfafe)
+    quint32 ts;
+    for (int i=0;i+fpicon_detail_entry_size<=isize;i+=fpicon_detail_entry_size) {
+        const unsigned char * e=index+i;
+        if ((e[1] << 8 | e[0])==0xfafe)
             break;
 
-        day=t1 & 0x1f;
-        month=(t1 >> 5) & 0x0f;
-        year=2000+((t1 >> 9) & 0x7f);
-
-        in >> z1;
-        in >> z2;
-        t1=z2 << 8 | z1;
-
-        second=(t1 & 0x1f) * 2;
-        minute=(t1 >> 5) & 0x3f;
-        hour=(t1 >> 11) & 0x1f;
-
-        datetime=QDateTime(QDate(year,month,day),QTime(hour,minute,second),Qt::UTC);
-        //datetime=datetime.toTimeSpec(Qt::UTC);
-
-        ts=datetime.toTime_t();
-
-        date=datetime.date();
-        time=datetime.time();
-        in >> strt;
-        in >> recs;
-        totalrecs+=recs;
+        ts=fpiconDateTime(e).toTime_t();
         if (Sessions.contains(ts)) {
             times.push_back(ts);
-            start.push_back(strt);
-            records.push_back(recs);
+            start.push_back(e[5] << 8 | e[4]);
+            records.push_back(e[6]);
         }
-    } while (!in.atEnd());
-
-    QByteArray databytes=file.readAll();
+    }
 
-    in.setVersion(QDataStream::Qt_4_6);
-    in.setByteOrder(QDataStream::BigEndian);
     // 5 byte repeating patterns
-
-    quint8 * data=(quint8 *)databytes.data();
+    QVector<qint64> evtime, oatime, htime, fltime;
+    QVector<EventStoreType> pr, lk, flg, oa, h, fl;
 
     qint64 ti;
-    quint8 pressure,leak, a1,a2,a3;
     SessionID sessid;
-    Session *sess;
-    int idx;
     for (int r=0;r<start.size();r++) {
         sessid=times[r];
-        sess=Sessions[sessid];
         ti=qint64(sessid)*1000L;
-        sess->really_set_first(ti);
-        EventList * LK=sess->AddEventList(CPAP_LeakTotal,EVL_Event,1);
-        EventList * PR=sess->AddEventList(CPAP_Pressure,EVL_Event,0.1);
-        EventList * FLG=sess->AddEventList(CPAP_FLG,EVL_Event);
-        EventList * OA=sess->AddEventList(CPAP_Obstructive,EVL_Event);
-        EventList * H=sess->AddEventList(CPAP_Hypopnea,EVL_Event);
-        EventList * FL=sess->AddEventList(CPAP_FlowLimit,EVL_Event);
-
-        unsigned stidx=start[r];
-        int rec=records[r];
-
-        idx=stidx*15;
-        for (int i=0;i<rec;i++) {
-            for (int j=0;j<3;j++) {
-                pressure=data[idx];
-                leak=data[idx+1];
-                a1=data[idx+2];
-                a2=data[idx+3];
-                a3=data[idx+4];
-                PR->AddEvent(ti,pressure);
-                LK->AddEvent(ti,leak);
-                if (a1>0) OA->AddEvent(ti,a1);
-                if (a2>0) H->AddEvent(ti,a2);
-                if (a3>0) FL->AddEvent(ti,a3);
-                FLG->AddEvent(ti,a3);
-                ti+=120000L;
-                idx+=5;
-            }
+
+        int n=records[r]*3;
+        qint64 idx=qint64(start[r])*3*fpicon_detail_record_size;
+        if (idx+n*fpicon_detail_record_size > dsize) {
+            qDebug() << "Truncated detail records for session" << sessid << filename;
+            n=(idx<dsize) ? (dsize-idx)/fpicon_detail_record_size : 0;
+        }
+        evtime.resize(n); pr.resize(n); lk.resize(n); flg.resize(n);
+        oatime.resize(0); htime.resize(0); fltime.resize(0);
+        oa.resize(0); h.resize(0); fl.resize(0);
+
+        const unsigned char * d=data+idx;
+        for (int i=0;i<n;i++) {
+            evtime[i]=ti;
+            pr[i]=d[0];
+            lk[i]=d[1];
+            flg[i]=d[4];
+            if (d[2]>0) { oatime.push_back(ti); oa.push_back(d[2]); }
+            if (d[3]>0) { htime.push_back(ti); h.push_back(d[3]); }
+            if (d[4]>0) { fltime.push_back(ti); fl.push_back(d[4]); }
+            ti+=120000L;
+            d+=fpicon_detail_record_size;
         }
-      //  sess->really_set_last(ti-360000L);
-//        sess->SetChanged(true);
- //       mach->AddSession(sess,profile);
+
+        FPDetailRecord det;
+        det.session=sessid;
+        det.leak=new EventList(EVL_Event,1);
+        det.pressure=new EventList(EVL_Event,0.1);
+        det.flg=new EventList(EVL_Event);
+        det.obstructive=new EventList(EVL_Event);
+        det.hypopnea=new EventList(EVL_Event);
+        det.flowlimit=new EventList(EVL_Event);
+
+        det.pressure->AddEvents(evtime.constData(),pr.constData(),n);
+        det.leak->AddEvents(evtime.constData(),lk.constData(),n);
+        det.flg->AddEvents(evtime.constData(),flg.constData(),n);
+        det.obstructive->AddEvents(oatime.constData(),oa.constData(),oa.size());
+        det.hypopnea->AddEvents(htime.constData(),h.constData(),h.size());
+        det.flowlimit->AddEvents(fltime.constData(),fl.constData(),fl.size());
+
+        result.detail.push_back(det);
     }
 
-    return 1;
+    return true;
+}
+
+void FPIconLoader::mergeDetail(FPIconResult & result)
+{
+    // Lists go on in the order AddEventList used to create them
+    for (int i=0;i<result.detail.size();i++) {
+        const FPDetailRecord & det=result.detail.at(i);
+        Session *sess=Sessions[det.session];
+        sess->really_set_first(qint64(det.session)*1000L);
+
+        sess->eventlist[CPAP_LeakTotal].push_back(det.leak);
+        sess->eventlist[CPAP_Pressure].push_back(det.pressure);
+        sess->eventlist[CPAP_FLG].push_back(det.flg);
+        sess->eventlist[CPAP_Obstructive].push_back(det.obstructive);
+        sess->eventlist[CPAP_Hypopnea].push_back(det.hypopnea);
+        sess->eventlist[CPAP_FlowLimit].push_back(det.flowlimit);
+
+        sess->setChannelDirty(CPAP_LeakTotal);
+        sess->setChannelDirty(CPAP_Pressure);
+        sess->setChannelDirty(CPAP_FLG);
+        sess->setChannelDirty(CPAP_Obstructive);
+        sess->setChannelDirty(CPAP_Hypopnea);
+        sess->setChannelDirty(CPAP_FlowLimit);
+    }
 }
 
 
@@ -22,7 +22,7 @@ Copyright: (c)2012 Mark Watkins
 //********************************************************************************************
 // Please INCREMENT the following value when making changes to this loaders implementation.
 //
-const int fpicon_data_version=2;
+const int fpicon_data_version=3;
 //
 //********************************************************************************************
 
@@ -37,10 +37,76 @@ public:
 };
 
 
-const int fpicon_load_buffer_size=1024*1024;
+const QString fpicon_class_name=STR_MACH_FPIcon;
 
+/*! \struct FPSummaryRecord
+    \brief One sessions worth of an Icon SUM file, as decoded off the disk */
+struct FPSummaryRecord {
+    FPSummaryRecord() {
+        ts=0; usage=0; apnea=0; hypopnea=0;
+        p1=p2=p3=p4=0; humid=0;
+    }
+    FPSummaryRecord(const FPSummaryRecord & copy) {
+        ts=copy.ts; date=copy.date; usage=copy.usage;
+        apnea=copy.apnea; hypopnea=copy.hypopnea;
+        p1=copy.p1; p2=copy.p2; p3=copy.p3; p4=copy.p4;
+        humid=copy.humid;
+    }
+    SessionID ts;
+    QDate date;
+    int usage;
+    quint8 apnea, hypopnea;
+    quint8 p1, p2, p3, p4;
+    quint8 humid;
+};
 
-const QString fpicon_class_name=STR_MACH_FPIcon;
+/*! \struct FPDetailRecord
+    \brief The EventLists an Icon DET file holds for one session, not yet attached to it */
+struct FPDetailRecord {
+    FPDetailRecord() {
+        session=0;
+        pressure=leak=flg=obstructive=hypopnea=flowlimit=NULL;
+    }
+    FPDetailRecord(const FPDetailRecord & copy) {
+        session=copy.session;
+        pressure=copy.pressure; leak=copy.leak; flg=copy.flg;
+        obstructive=copy.obstructive; hypopnea=copy.hypopnea; flowlimit=copy.flowlimit;
+    }
+    SessionID session;
+    EventList * pressure, * leak, * flg;
+    EventList * obstructive, * hypopnea, * flowlimit;
+};
+
+/*! \struct FPFlowChunk
+    \brief One continuous stretch of an Icon FLW file */
+struct FPFlowChunk {
+    FPFlowChunk() { start=0; duration=0; flow=leak=pressure=NULL; }
+    FPFlowChunk(qint64 st, EventList * f, EventList * l, EventList * p) { start=st; duration=0; flow=f; leak=l; pressure=p; }
+    FPFlowChunk(const FPFlowChunk & copy) {
+        start=copy.start; duration=copy.duration;
+        flow=copy.flow; leak=copy.leak; pressure=copy.pressure;
+    }
+    qint64 start;
+    qint64 duration;
+    EventList * flow, * leak, * pressure;
+};
+
+/*! \struct FPIconResult
+    \brief Whatever parsing a single Icon data file produced, for OpenMachine to merge in file order */
+struct FPIconResult {
+    FPIconResult() { filenum=0; ts=0; }
+
+    //! \brief Model & type string from a SUM file header
+    QString model;
+    QVector<FPSummaryRecord> summary;
+
+    QVector<FPDetailRecord> detail;
+
+    int filenum;
+    QDate date;
+    SessionID ts;
+    QVector<FPFlowChunk> flow;
+};
 
 /*! \class FPIconLoader
     \brief Loader for Fisher & Paykel Icon data
@@ -58,9 +124,14 @@ public:
 
     int OpenMachine(Machine *mach, QString & path, Profile * profile);
 
-    bool OpenSummary(Machine *mach, QString path, Profile * profile);
-    bool OpenDetail(Machine *mach, QString path, Profile * profile);
-    bool OpenFLW(Machine * mach,QString filename, Profile * profile);
+    //! \brief Decodes the session summaries in SUM file path into result. Touches nothing shared
+    bool OpenSummary(QString path, FPIconResult & result);
+
+    //! \brief Decodes DET file path's events for known Sessions into result (Sessions must not change meanwhile)
+    bool OpenDetail(QString path, FPIconResult & result);
+
+    //! \brief Decodes FLW file filename's waveform chunks into result. Touches nothing shared
+    bool OpenFLW(QString filename, FPIconResult & result);
 
     //! \brief Returns SleepLib database version of this F&P Icon loader
     virtual int Version() { return fpicon_data_version; }
@@ -75,6 +146,15 @@ public:
     static void Register();
 
 protected:
+    //! \brief Creates the sessions a SUM file described, on the GUI thread
+    void mergeSummary(Machine * mach, Profile * profile, FPIconResult & result);
+
+    //! \brief Attaches a DET files EventLists to their sessions
+    void mergeDetail(FPIconResult & result);
+
+    //! \brief Files a FLW files chunks away, attaching the first to its session if it matches
+    void mergeFLW(FPIconResult & result);
+
     QString last;
     QHash<QString,Machine *> MachList;
     QMap<SessionID, Session *> Sessions;
@@ -85,8 +165,6 @@ protected:
     QMap<int,QList<qint64> > FLWDuration;
     QMap<int,QList<qint64> > FLWTS;
     QMap<int,QDate> FLWDate;
-
-    unsigned char * m_buffer;
 };
 
 #endif // ICON_LOADER_H
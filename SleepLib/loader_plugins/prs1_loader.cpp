@@ -15,8 +15,16 @@ Copyright: (c)2011 Mark Watkins
 #include <QFile>
 #include <QMessageBox>
 #include <QProgressBar>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSet>
 #include <QDebug>
 #include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "SleepLib/schema.h"
 #include "prs1_loader.h"
 #include "SleepLib/session.h"
@@ -41,61 +49,16 @@ extern QProgressBar *qprogress;
 
 QHash<int,QString> ModelMap;
 
-#define PRS1_CRC_CHECK
-
-#ifdef PRS1_CRC_CHECK
-typedef quint16 crc_t;
-
-static const crc_t crc_table[256] = {
-    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
-
-crc_t CRC16(const unsigned char *data, size_t data_len)
-{
-    crc_t crc=0;
-    unsigned int tbl_idx;
-
-    while (data_len--) {
-        tbl_idx = (crc ^ *data) & 0xff;
-        crc = (crc_table[tbl_idx] ^ (crc >> 8)) & 0xffff;
+#ifdef DEBUG_EFFICIENCY
+#include <QElapsedTimer>  // only available in 4.8
 
-        data++;
-    }
-    return crc & 0xffff;
-}
+// Time spent verifying chunk CRCs, to keep an eye on what leaving them on costs
+static QMutex crc_mutex;
+static qint64 crc_time=0;
+static qint64 crc_bytes=0;
 #endif
 
+
 PRS1::PRS1(Profile *p,MachineID id):CPAP(p,id)
 {
     m_class=prs1_class_name;
@@ -118,10 +81,145 @@ struct WaveHeaderList {
 };
 
 
+// Smallest read PRS1Stream bothers with
+const int prs1_stream_window=65536;
+
+/*! \class PRS1Stream
+    \brief Reads a PRS1 data file through a small sliding window, so files of any size need bounded memory
+    */
+class PRS1Stream
+{
+public:
+    PRS1Stream(const QString & filename):m_file(filename) { m_start=0; m_length=0; }
+
+    bool open() { return m_file.open(QIODevice::ReadOnly); }
+    qint64 size() { return m_file.size(); }
+
+    //! \brief Returns len bytes from pos, or NULL if the file ends first. Only valid until the next call
+    unsigned char * read(qint64 pos, int len) {
+        if ((pos<m_start) || (pos+len>m_start+m_length)) {
+            // Reads only move forwards, so just refill from pos
+            if (m_buffer.size()<len) m_buffer.resize(qMax(len,prs1_stream_window));
+            if (!m_file.seek(pos)) return NULL;
+            qint64 br=m_file.read((char *)m_buffer.data(),m_buffer.size());
+            m_start=pos;
+            m_length=(br>0) ? br : 0;
+            if (len>m_length) return NULL;
+        }
+        return &m_buffer.data()[pos-m_start];
+    }
+
+protected:
+    QFile m_file;
+    QVector<unsigned char> m_buffer;
+    qint64 m_start;
+    qint64 m_length;
+};
+
+#ifdef __SSE2__
+// 16 samples to a register. The scalar loops below finish off whatever's left
+
+//! \brief Widens the low & high 8 of 16 8bit samples, zero or sign extending to suit T
+template <class T> static inline void widen16(__m128i v, __m128i & lo, __m128i & hi);
+template <> inline void widen16<unsigned char>(__m128i v, __m128i & lo, __m128i & hi)
+{
+    __m128i zero=_mm_setzero_si128();
+    lo=_mm_unpacklo_epi8(v,zero);
+    hi=_mm_unpackhi_epi8(v,zero);
+}
+template <> inline void widen16<signed char>(__m128i v, __m128i & lo, __m128i & hi)
+{
+    __m128i sign=_mm_cmpgt_epi8(_mm_setzero_si128(),v);
+    lo=_mm_unpacklo_epi8(v,sign);
+    hi=_mm_unpackhi_epi8(v,sign);
+}
+
+//! \brief Widens the even bytes of 8 interleaved pairs (the first of each pair, being little endian)
+template <class T> static inline __m128i widenEven(__m128i v);
+template <> inline __m128i widenEven<unsigned char>(__m128i v) { return _mm_and_si128(v,_mm_set1_epi16(0xff)); }
+template <> inline __m128i widenEven<signed char>(__m128i v) { return _mm_srai_epi16(_mm_slli_epi16(v,8),8); }
+
+//! \brief Widens the odd bytes of 8 interleaved pairs
+template <class T> static inline __m128i widenOdd(__m128i v);
+template <> inline __m128i widenOdd<unsigned char>(__m128i v) { return _mm_srli_epi16(v,8); }
+template <> inline __m128i widenOdd<signed char>(__m128i v) { return _mm_srai_epi16(v,8); }
+#endif
+
+//! \brief Widens len 8bit samples into dest, zero extending if T is unsigned char or sign extending if signed char
+template <class T> static inline void widenSamples(const unsigned char * src, int len, EventStoreType * dest)
+{
+    int i=0;
+#ifdef __SSE2__
+    __m128i lo,hi;
+    for (;i+16<=len;i+=16) {
+        widen16<T>(_mm_loadu_si128((const __m128i *)(src+i)),lo,hi);
+        _mm_storeu_si128((__m128i *)(dest+i),lo);
+        _mm_storeu_si128((__m128i *)(dest+i+8),hi);
+    }
+#endif
+    const T * sp=(const T *)src;
+    for (;i<len;i++) dest[i]=EventStoreType(sp[i]);
+}
+
+//! \brief Splits duration seconds of a waveform block into each signals EventList storage, widening as it goes
+template <class T0, class T1> static void deinterleaveBlock(const unsigned char * buf, int duration, int il0, int il1, EventStoreType * d0, EventStoreType * d1)
+{
+    if ((il0==1) && (il1==1)) {
+        // One sample each per second, pairs alternate
+        int i=0;
+#ifdef __SSE2__
+        for (;i+8<=duration;i+=8) {
+            __m128i v=_mm_loadu_si128((const __m128i *)buf);
+            _mm_storeu_si128((__m128i *)d0,widenEven<T0>(v));
+            _mm_storeu_si128((__m128i *)d1,widenOdd<T1>(v));
+            buf+=16; d0+=8; d1+=8;
+        }
+#endif
+        for (;i<duration;i++) {
+            *d0++=EventStoreType(T0(*buf++));
+            *d1++=EventStoreType(T1(*buf++));
+        }
+        return;
+    }
+    for (int i=0;i<duration;i++) {
+        widenSamples<T0>(buf,il0,d0);
+        buf+=il0; d0+=il0;
+        widenSamples<T1>(buf,il1,d1);
+        buf+=il1; d1+=il1;
+    }
+}
+
+//! \brief Grows EventList a's waveform storage by recs samples, and returns where to write them
+static inline EventStoreType * growWaveform(EventList * a, int recs)
+{
+    int r=a->count();
+    a->rawDataResize(r+recs);
+    return a->rawData()+r;
+}
+
+//! \brief Does what AddWaveform would have once a waveform filled in place is complete: sets the rate, timespan & min/max
+static void finishWaveform(EventList * a, qint64 start, qint64 duration)
+{
+    int cnt=a->count();
+    a->setRate(double(duration)/double(cnt));
+    a->setFirst(start);
+    a->setLast(start+duration);
+    if (!a->update_minmax() || !cnt) return;
+
+    EventStoreType * dp=a->rawData();
+    EventStoreType mn=dp[0],mx=dp[0];
+    for (int i=1;i<cnt;i++) {
+        if (mn>dp[i]) mn=dp[i];
+        if (mx<dp[i]) mx=dp[i];
+    }
+    // Gain is always positive here, so the ordering holds
+    a->setMin(EventDataType(mn)*a->gain());
+    a->setMax(EventDataType(mx)*a->gain());
+}
+
 PRS1Loader::PRS1Loader()
 {
     //genCRCTable();
-    m_buffer=NULL;
 }
 
 PRS1Loader::~PRS1Loader()
@@ -215,7 +313,6 @@ int PRS1Loader::Open(QString & path,Profile *profile)
 
     if (SerialNumbers.empty()) return 0;
 
-    m_buffer=new unsigned char [max_load_buffer_size]; //allocate once and reuse.
     Machine *m;
     for (sn=SerialNumbers.begin(); sn!=SerialNumbers.end(); sn++) {
         QString s=*sn;
@@ -229,7 +326,6 @@ int PRS1Loader::Open(QString & path,Profile *profile)
             delete m;
         }
     }
-    delete [] m_buffer;
     return PRS1List.size();
 }
 
@@ -274,10 +370,120 @@ bool PRS1Loader::ParseProperties(Machine *m,QString filename)
     return true;
 }
 
+/*! \struct PRS1ImportQueue
+    \brief What PRS1Import workers share with PRS1Loader::OpenMachine
+
+    Each worker builds its own sessions, handing them over in its slot of results under mutex.
+    */
+struct PRS1ImportQueue {
+    PRS1ImportQueue() {
+        loader=NULL;
+        machine=NULL;
+        multithreaded=true;
+        finished=0;
+    }
+
+    //! \brief Starts a new batch of size tasks
+    void start(int size) {
+        results.clear();
+        results.resize(size);
+        finished=0;
+    }
+
+    //! \brief Hands task to the thread pool, or runs it right here if not multithreaded
+    void run(QRunnable * task);
+
+    //! \brief Waits for the batch to finish, moving the progress bar from progress_start to progress_end
+    void wait(float progress_start, float progress_end);
+
+    PRS1Loader * loader;
+    Machine * machine;
+    bool multithreaded;
+
+    QMutex mutex;
+    //! \brief Signalled every time a worker finishes
+    QWaitCondition changed;
+    QVector<QHash<SessionID, Session *> > results;
+    int finished;
+};
+
+/*! \class PRS1Import
+    \brief Parses PRS1 data files on a QThreadPool thread
+
+    Without a session, the files are summaries, and the sessions they create end up in results.
+    With one, they're that sessions event & waveform files, which nothing else touches meanwhile.
+    */
+class PRS1Import:public QRunnable
+{
+public:
+    PRS1Import(PRS1ImportQueue * queue, int index, Session * session, const QStringList & files)
+        :m_queue(queue),m_index(index),m_session(session),m_files(files) {}
+    virtual void run();
+protected:
+    PRS1ImportQueue * m_queue;
+    int m_index;
+    Session * m_session;
+    QStringList m_files;
+};
+
+void PRS1Import::run()
+{
+    PRS1Loader * loader=m_queue->loader;
+    QHash<SessionID, Session *> sessions;
+    if (m_session) sessions[m_session->session()]=m_session;
+
+    for (int i=0;i<m_files.size();i++) {
+        const QString & name=m_files.at(i);
+        if (!m_session) {
+            loader->OpenFile(m_queue->machine,name,sessions);
+        } else if (name.endsWith(".002")) {
+            loader->OpenFile(m_queue->machine,name,sessions);
+        } else if (name.endsWith(".005")) {
+            loader->OpenWaveforms(m_session,name);
+        }
+    }
+
+    QMutexLocker lock(&m_queue->mutex);
+    if (!m_session) m_queue->results[m_index]=sessions;
+    m_queue->finished++;
+    m_queue->changed.wakeAll();
+}
+
+void PRS1ImportQueue::run(QRunnable * task)
+{
+    if (multithreaded) {
+        QThreadPool::globalInstance()->start(task);
+    } else {
+        task->run();
+        delete task;
+    }
+}
+
+void PRS1ImportQueue::wait(float progress_start, float progress_end)
+{
+    int size=results.size();
+    int done;
+    do {
+        mutex.lock();
+        if (finished<size)
+            changed.wait(&mutex,100);
+        done=finished;
+        mutex.unlock();
+
+        if (qprogress && size) qprogress->setValue(progress_start+(float(done)/float(size)*(progress_end-progress_start)));
+        QApplication::processEvents();
+    } while (done<size);
+}
+
 int PRS1Loader::OpenMachine(Machine *m,QString path,Profile *profile)
 {
 
     qDebug() << "Opening PRS1 " << path;
+#ifdef DEBUG_EFFICIENCY
+    QElapsedTimer time;
+    time.start();
+    crc_time=crc_bytes=0;
+#endif
     QDir dir(path);
     if (!dir.exists() || (!dir.isReadable()))
          return false;
@@ -311,6 +517,16 @@ int PRS1Loader::OpenMachine(Machine *m,QString path,Profile *profile)
     int cnt=0;
     bool ok;
 
+    // Files that weren't imported before (or have changed since), by path relative to the card
+    ImportIndex index;
+    index.load(m);
+    QHash<QString,QFileInfo> newinfo;
+    QHash<QString,SessionID> newsid;
+    QSet<SessionID> touched, replaced;
+    SessionID imported;
+    QString relpath;
+    QList<QPair<SessionID,QString> > summaries;
+
     new_sessions.clear();
     for (QList<QString>::iterator p=paths.begin(); p!=paths.end(); p++) {
         dir.setPath(*p);
@@ -330,38 +546,79 @@ int PRS1Loader::OpenMachine(Machine *m,QString path,Profile *profile)
             if (!ok)
                 continue;
 
-            if (m->SessionExists(sid))
-                continue; // could skip this and error check data by reloading summary.
+            // A file that came to nothing before can still belong to a session whose summary has
+            // turned up since, so only whole sessions are skipped, further down
+            relpath=QFileInfo(*p).fileName()+"/"+fi.fileName();
+            if (!index.unchanged(relpath,fi,&imported)) {
+                if (index.contains(relpath)) {
+                    qDebug() << "PRS1 file" << relpath << "has changed since it was imported";
+                    if (m->SessionExists(sid)) replaced.insert(sid);
+                }
+                newinfo[relpath]=fi;
+                newsid[relpath]=sid;
+                touched.insert(sid);
+            } else if (imported) {
+                touched.insert(sid);
+            }
 
             if ((ext==1) || (ext==0)) {
-                OpenFile(m,fi.canonicalFilePath()); // Open just the summary files first round
+                summaries.push_back(qMakePair(sid,fi.canonicalFilePath())); // Open just the summary files first round
             } else {
                 sessfiles[sid].push_back(fi.canonicalFilePath()); // and keep the rest of the names
             }
         }
     }
-    cnt=0;
-    size=new_sessions.size();
-    for (QHash<SessionID, Session *>::iterator it=new_sessions.begin();it!=new_sessions.end();it++) {
-        sid=it.key();
-
-        if (sessfiles.contains(sid)) {
-            for (int j=0;j<sessfiles[sid].size();j++) {
-                QString name=sessfiles[sid][j];
-                if (name.endsWith(".002")) {
-                    OpenFile(m,name);
-                } else if (name.endsWith(".005")) {
-                    OpenWaveforms(sid,name);
-                }
-            }
-        }
-        // sessions are fully loaded here..
 
-        if ((++cnt % 10)==0) {
-            if (qprogress) qprogress->setValue(0.0+(float(cnt)/float(size)*100.0));
-            QApplication::processEvents();
+    // Sessions with changed files are thrown away and imported again, as purging their day would
+    for (QSet<SessionID>::iterator it=replaced.begin();it!=replaced.end();it++) {
+        qDebug() << "Reimporting PRS1 session" << *it;
+        m->RemoveSession(*it);
+    }
+
+    QStringList summaryfiles;
+    for (int i=0;i<summaries.size();i++) {
+        sid=summaries.at(i).first;
+
+        // Skip sessions whose files were all imported before, and came to nothing
+        if (!touched.contains(sid))
+            continue;
+
+        if (m->SessionExists(sid))
+            continue; // could skip this and error check data by reloading summary.
+
+        summaryfiles.push_back(summaries.at(i).second);
+    }
+
+    PRS1ImportQueue queue;
+    queue.loader=this;
+    queue.machine=m;
+    queue.multithreaded=PROFILE.session->multithreading();
+
+    // Summaries first, as they're what create the sessions
+    queue.start(summaryfiles.size());
+    for (int i=0;i<summaryfiles.size();i++) {
+        queue.run(new PRS1Import(&queue,i,NULL,QStringList(summaryfiles.at(i))));
+    }
+    queue.wait(0,10);
+
+    // Gather them up in file order, so a later summary of the same session wins, as it always has
+    for (int i=0;i<queue.results.size();i++) {
+        QHash<SessionID, Session *> & results=queue.results[i];
+        for (QHash<SessionID, Session *>::iterator it=results.begin();it!=results.end();it++) {
+            QHash<SessionID, Session *>::iterator ns=new_sessions.find(it.key());
+            if (ns!=new_sessions.end()) delete ns.value();
+            new_sessions[it.key()]=it.value();
         }
     }
+
+    // Then each sessions event & waveform files, one session to a task
+    queue.start(new_sessions.size());
+    cnt=0;
+    for (QHash<SessionID, Session *>::iterator it=new_sessions.begin();it!=new_sessions.end();it++) {
+        queue.run(new PRS1Import(&queue,cnt++,it.value(),sessfiles.value(it.key())));
+    }
+    queue.wait(10,100);
+    // sessions are fully loaded here..
     // strictly can do this in the above loop, but this is cautionary
     cnt=0;
     //QVector<SessionID> KillList;
@@ -435,6 +692,23 @@ int PRS1Loader::OpenMachine(Machine *m,QString path,Profile *profile)
     m->properties[STR_PROP_DataVersion]=QString::number(prs1_data_version);
     m->properties[STR_PROP_LastImported]=QDateTime::currentDateTime().toString(Qt::ISODate);
     m->Save(); // Save any new sessions to disk in our format
+
+#ifdef DEBUG_EFFICIENCY
+    {
+        // CRC time is summed over all threads, so compare it with the work, not the wall clock
+        qint64 ns=time.nsecsElapsed();
+        qDebug() << "PRS1 chunk CRC checks took" << double(crc_time)/1000000.0 << "ms over" << crc_bytes << "bytes, against"
+                 << double(ns)/1000000.0 << "ms for the whole import";
+    }
+#endif
+
+    // Only now they're safely stored, remember which files went where
+    for (QHash<QString,QFileInfo>::iterator fi=newinfo.begin();fi!=newinfo.end();fi++) {
+        sid=newsid[fi.key()];
+        index.add(fi.key(),fi.value(),m->SessionExists(sid) ? sid : 0);
+    }
+    index.save();
+
     if (qprogress) qprogress->setValue(100);
 
     return cnt;
@@ -453,7 +727,7 @@ int PRS1Loader::OpenMachine(Machine *m,QString path,Profile *profile)
 
 //};// __attribute__((packed));
 
-bool PRS1Loader::ParseSummary(Machine *mach, qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, int family, int familyVersion)
+bool PRS1Loader::ParseSummary(QHash<SessionID, Session *> & sessions, Machine *mach, qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, int family, int familyVersion)
 {
     if (mach->SessionExists(sequence))
         return false;
@@ -600,14 +874,16 @@ bool PRS1Loader::ParseSummary(Machine *mach, qint32 sequence, quint32 timestamp,
         session->setCph(CPAP_RERA,float(rc/hours));
         session->setCph(CPAP_FlowLimit,float(fc/hours));
     }
-    new_sessions[sequence]=session;
+    QHash<SessionID, Session *>::iterator it=sessions.find(sequence);
+    if (it!=sessions.end()) delete it.value();
+    sessions[sequence]=session;
     return true;
 }
-bool PRS1Loader::Parse002v5(qint32 sequence, quint32 timestamp, unsigned char *buffer, quint16 size)
+bool PRS1Loader::Parse002v5(QHash<SessionID, Session *> & sessions, qint32 sequence, quint32 timestamp, unsigned char *buffer, quint16 size)
 {
-    if (!new_sessions.contains(sequence))
+    if (!sessions.contains(sequence))
         return false;
-    Session *session=new_sessions[sequence];
+    Session *session=sessions[sequence];
 
     ChannelID Codes[]={
         PRS1_00, PRS1_01, CPAP_Pressure, CPAP_EPAP, CPAP_PressurePulse, CPAP_Obstructive,
@@ -896,9 +1172,9 @@ bool PRS1Loader::Parse002v5(qint32 sequence, quint32 timestamp, unsigned char *b
 
 }
 
-bool PRS1Loader::Parse002(qint32 sequence, quint32 timestamp, unsigned char *buffer, quint16 size, int family, int familyVersion)
+bool PRS1Loader::Parse002(QHash<SessionID, Session *> & sessions, qint32 sequence, quint32 timestamp, unsigned char *buffer, quint16 size, int family, int familyVersion)
 {
-    if (!new_sessions.contains(sequence))
+    if (!sessions.contains(sequence))
         return false;
 
     unsigned char code;
@@ -910,7 +1186,7 @@ bool PRS1Loader::Parse002(qint32 sequence, quint32 timestamp, unsigned char *buf
     quint64 pos;
     qint64 t=qint64(timestamp)*1000L,tt;
 
-    Session *session=new_sessions[sequence];
+    Session *session=sessions[sequence];
     session->updateFirst(t);
 
 
@@ -1148,7 +1424,7 @@ bool PRS1Loader::Parse002(qint32 sequence, quint32 timestamp, unsigned char *buf
 //    return true;
 //}
 
-bool PRS1Loader::OpenFile(Machine *mach, QString filename)
+bool PRS1Loader::OpenFile(Machine *mach, QString filename, QHash<SessionID, Session *> & sessions)
 {
     int sequence,family, familyVersion;
     quint32 timestamp;
@@ -1163,29 +1439,34 @@ bool PRS1Loader::OpenFile(Machine *mach, QString filename)
     quint16 interleave,duration,num_signals;
     quint8  sample_format;
 
-    QFile f(filename);
-    if (!f.exists())
-        return false;
-
-    if (!f.open(QIODevice::ReadOnly))
+    PRS1Stream f(filename);
+    if (!f.open())
         return false;
 
+#ifdef DEBUG_EFFICIENCY
+    qint64 crcns=0, crcbytes=0;
+#endif
     qint64 filesize=f.size();
-    if (f.read((char *)m_buffer,filesize)<filesize) {
-        qDebug() << "Couldn't read full file" << filename;
-        return false;
-    }
     pos=0;
     bool wasfaulty=false, faulty=false;
     for (chunk=0;pos<filesize;++chunk, pos+=size) {
-        header=&m_buffer[pos];
-        if (header[0]!=PRS1_MAGIC_NUMBER) {
+        header=f.read(pos,3);
+        if (!header || (header[0]!=PRS1_MAGIC_NUMBER)) {
             if (chunk==0)
                 return false;
             break;
         }
 
         size=(header[2] << 8) | header[1];
+
+        // Bring in the whole chunk, plus the first byte of the next one when there is one
+        header=f.read(pos,qMin(qint64(size)+1,filesize-pos));
+        if (!header || (pos+size>filesize) || (size<16)) {
+            qDebug() << "File" << filename << "has a truncated chunk at" << pos;
+            if (chunk==0)
+                return false;
+            break;
+        }
         htype=header[3]; // 00 = normal // 01=waveform // could be a bool?
         Q_UNUSED(htype);
         family=header[4]; // == 5
@@ -1198,7 +1479,7 @@ bool PRS1Loader::OpenFile(Machine *mach, QString filename)
             duration=header[0xf] | header[0x10] << 8;    // block duration in seconds
             Q_UNUSED(duration);
             num_signals=header[0x12] | header[0x13] << 8;
-            if (num_signals>2) {
+            if ((num_signals>2) || (0x14+num_signals*3>size)) {
                 qWarning() << "More than 2 Waveforms in " << filename;
                 return false;
             }
@@ -1214,9 +1495,13 @@ bool PRS1Loader::OpenFile(Machine *mach, QString filename)
 
         } else hl=16;
 
+        if (hl+2>size) {
+            qDebug() << "File" << filename << "has a truncated chunk at" << pos;
+            break;
+        }
+
         wasfaulty=faulty;
-        sum=0;
-        for (int i=0; i<hl-1; i++) sum+=header[i];
+        sum=checksum8(header,hl-1);
         unsigned char c8=header[hl-1];
         if (sum!=c8) {
             if (chunk==0) {
@@ -1234,15 +1519,21 @@ bool PRS1Loader::OpenFile(Machine *mach, QString filename)
 
         data=&header[hl];
 
-#ifdef PRS1_CRC_CHECK
+#ifdef DEBUG_EFFICIENCY
+        QElapsedTimer crctime;
+        crctime.start();
+#endif
         c16=CRC16(data,datasize);
+#ifdef DEBUG_EFFICIENCY
+        crcns+=crctime.nsecsElapsed();
+        crcbytes+=datasize;
+#endif
         crc=(data[datasize+1] << 8) | data[datasize];
         if (crc!=c16) {
             qDebug() << "File" << filename << "failed CRC check at chunk" << chunk << "wanted" << crc << "got" << c16;
             faulty=true;
             continue;
         }
-#endif
 
         if (wasfaulty) {
             qDebug() << "Managed to continue with next block";
@@ -1252,66 +1543,69 @@ bool PRS1Loader::OpenFile(Machine *mach, QString filename)
         //qDebug() << "Loading" << filename << sequence << timestamp << size;
         //if (ext==0) ParseCompliance(data,size);
         if (ext<=1) {
-            ParseSummary(mach,sequence,timestamp,data,datasize,family,familyVersion);
+            ParseSummary(sessions,mach,sequence,timestamp,data,datasize,family,familyVersion);
         } else if (ext==2) {
             if (family==5) {
-               if (!Parse002v5(sequence,timestamp,data,datasize)) {
+               if (!Parse002v5(sessions,sequence,timestamp,data,datasize)) {
                    qDebug() << "in file: " << filename;
                }
             } else {
-               Parse002(sequence,timestamp,data,datasize, family, familyVersion);
+               Parse002(sessions,sequence,timestamp,data,datasize, family, familyVersion);
             }
         } else if (ext==5) {
             //ParseWaveform(mach,sequence,timestamp,data,datasize,duration,num_signals,interleave,sample_format);
         }
     }
+#ifdef DEBUG_EFFICIENCY
+    crc_mutex.lock();
+    crc_time+=crcns;
+    crc_bytes+=crcbytes;
+    crc_mutex.unlock();
+#endif
     return true;
 }
 
 
-bool PRS1Loader::OpenWaveforms(SessionID sid, QString filename)
+bool PRS1Loader::OpenWaveforms(Session * session, QString filename)
 {
-    Session * session=new_sessions[sid];
     //int sequence,seconds,br,htype,version,numsignals;
-    QFile file(filename);
-    if (!file.open(QIODevice::ReadOnly)) {
+    PRS1Stream file(filename);
+    if (!file.open()) {
         qWarning() << "Couldn't open waveform file" << filename;
         return false;
     }
 
-    int pos,br,size=file.size();
-    if (size>max_load_buffer_size) {
-        qWarning() << "Waveform too big, increase max_load_buffer_size in PRS1Loader sourcecode" << filename;
-        return false;
-    }
-
-    br=file.read((char *)m_buffer,size);
-    if (br<size) {
-        qWarning() << "Couldn't read waveform data.. Disk error?" << filename;
-        return false;
-    }
+    qint64 pos,size=file.size();
+    unsigned char * buf=file.read(0,0x14);
 
     // Look at the initial header and assume this header size for the lot.
-    if ((m_buffer[0]!=2) || (m_buffer[6]!=0x05)) {
+    if (!buf || (buf[0]!=2) || (buf[6]!=0x05)) {
         qWarning() << "Not correct waveform format" << filename;
         return false;
     }
-    //quint8 version=m_buffer[4];
-    quint32 start=m_buffer[0xb] | m_buffer[0xc] << 8 | m_buffer[0xd] << 16 | m_buffer[0x0e] << 24;
+    //quint8 version=buf[4];
+    quint32 start=buf[0xb] | buf[0xc] << 8 | buf[0xd] << 16 | buf[0x0e] << 24;
 
     session->updateFirst(qint64(start)*1000L);
 
-    quint16 num_signals=m_buffer[0x12] | m_buffer[0x13] << 8;
-    if (num_signals>2) {
+    quint16 num_signals=buf[0x12] | buf[0x13] << 8;
+    if ((num_signals==0) || (num_signals>2)) {
         qWarning() << "More than 2 Waveforms in " << filename;
         return false;
     }
+    buf=file.read(0,0x14+num_signals*3);
+    if (!buf) {
+        qWarning() << "Not correct waveform format" << filename;
+        return false;
+    }
     pos=0x14+(num_signals-1)*3;
     vector<WaveHeaderList> whl;
+    int blocksize=0;
     // add the in reverse...
     for (int i=0;i<num_signals;i++) {
-        quint16 interleave=m_buffer[pos] | m_buffer[pos+1] << 8;
-        quint8  sample_format=m_buffer[pos+2];
+        quint16 interleave=buf[pos] | buf[pos+1] << 8;
+        quint8  sample_format=buf[pos+2];
+        blocksize+=interleave;
         whl.push_back(WaveHeaderList(interleave,sample_format));
         pos-=3;
     }
@@ -1325,29 +1619,22 @@ bool PRS1Loader::OpenWaveforms(SessionID sid, QString filename)
     lasttimestamp=start;
     duration=0;
     int corrupt=0;
-    char waveform[2][500000];
-    int wlength[2];
-    qint64 wdur[2];
-    //EventList *evl[num_signals];
-    for (int i=0;i<num_signals;i++) {
-        wlength[i]=0;
-        wdur[i]=0;
-        //evl[i]=NULL;
+    // Samples are widened straight into each signals EventList, started on the first block after each resync
+    EventList *evl[2]={NULL,NULL};
+    qint64 wdur[2]={0,0};
+    bool usigned[2];
+    for (int i=0;i<num_signals;i++) usigned[i]=whl[i].sample_format!=0;
 
-        //waveform[i].resize(500000);
-    }
-    //SampleFormat *wf[num_signals];
-    //EventList *FlowData=EventList(CPAP_FlowRate, EVL_Waveform,1,0,-128,128);
-    //EventList *MaskData=EventList(CPAP_MaskPressure, EVL_Waveform,1,0,-128,128);
-
-    //QString FlowRate=CPAP_FlowRate;
-    //QString MaskPressure="MaskPressure";
     ChannelID wc[2]={CPAP_FlowRate,CPAP_MaskPressure};
+    EventDataType wgain[2]={1,0.1F};
     do {
-        timestamp=m_buffer[pos+0xb] | m_buffer[pos+0xc] << 8 | m_buffer[pos+0xd] << 16 | m_buffer[pos+0x0e] << 24;
-        register unsigned char sum8=0;
-        for (int i=0;i<hl;i++) sum8+=m_buffer[pos+i];
-        if (m_buffer[pos+hl]!=sum8) {
+        buf=file.read(pos,hl+1);
+        if (!buf) {
+            qDebug() << "Truncated waveform block" << block << filename;
+            break;
+        }
+        timestamp=buf[0xb] | buf[0xc] << 8 | buf[0xd] << 16 | buf[0x0e] << 24;
+        if (buf[hl]!=checksum8(buf,hl)) {
             if (block==0) {
                 qDebug() << "Faulty Header Checksum, aborting" << filename;
                 return false;
@@ -1365,50 +1652,32 @@ bool PRS1Loader::OpenWaveforms(SessionID sid, QString filename)
                 if (diff>0)
                     start-=diff;
             }
-            length=m_buffer[pos+0x1] | m_buffer[pos+0x2] << 8;      // block length in bytes
-            duration=m_buffer[pos+0xf] | m_buffer[pos+0x10] << 8;    // block duration in seconds
+            length=buf[0x1] | buf[0x2] << 8;      // block length in bytes
+            duration=buf[0xf] | buf[0x10] << 8;    // block duration in seconds
 
 
             if (diff<0) {
                 qDebug() << "Padding waveform to keep sync" << block;
                 //diff=qAbs(diff);
                 for (int i=0;i<num_signals;i++) {
-                    for (int j=0;j<diff;j++) {
-                        for (int k=0;k<whl[i].interleave;k++)
-                            waveform[i][wlength[i]++]=0;
-                    }
                     wdur[i]+=diff;
                 }
 
             } else
-            if (diff>0 && wlength[0]>0)  {
+            if (diff>0 && evl[0] && evl[0]->count()>0)  {
                 qDebug() << "Timestamp resync" << block << diff << corrupt << duration << timestamp-lasttimestamp << filename;
 
 
                 for (int i=0;i<num_signals;i++) {
-                    double rate=(double(wdur[i])*1000.0)/double(wlength[i]);
-                    double gain;
-                    if (i==1) gain=0.1; else gain=1;
-                    EventList *a=session->AddEventList(wc[i],EVL_Waveform,gain,0,0,0,rate);
-                    //EventList *a=new EventList(wc[i],EVL_Waveform,gain,0,0,0,rate);
-                    //session->machine()->registerChannel(wc[i]);
-                    if (whl[i].sample_format)
-                        a->AddWaveform(qint64(start)*1000L,(unsigned char *)waveform[i],wlength[i],qint64(wdur[i])*1000L);
-                    else {
-                        a->AddWaveform(qint64(start)*1000L,(char *)waveform[i],wlength[i],qint64(wdur[i])*1000L);
-                    }
+                    if (!evl[i]) evl[i]=session->AddEventList(wc[i],EVL_Waveform,wgain[i]);
+                    finishWaveform(evl[i],qint64(start)*1000L,qint64(wdur[i])*1000L);
                     if (wc[i]==CPAP_FlowRate) {
-                        a->setMax(120);
-                        a->setMin(-120);
-                    } else if (wc[i]==CPAP_MaskPressure) {
-//                       int v=ceil(a->Max()/5);
-//                        a->setMax(v*5);
-//                        v=floor(a->Min()/5);
-//                        a->setMin(v*5);
+                        evl[i]->setMax(120);
+                        evl[i]->setMin(-120);
                     }
 
                     session->updateLast(start+(qint64(wdur[i])*1000L));
-                    wlength[i]=0;
+                    evl[i]=NULL;
                     wdur[i]=0;
                 }
                 start=timestamp;
@@ -1418,22 +1687,32 @@ bool PRS1Loader::OpenWaveforms(SessionID sid, QString filename)
 
         pos+=hl+1;
         //qDebug() <<  (duration*num_signals*whl[0].interleave) << duration;
+        buf=file.read(pos,duration*blocksize);
+        if (!buf) {
+            qDebug() << "Truncated waveform block" << block << filename;
+            break;
+        }
+        for (int i=0;i<num_signals;i++) {
+            if (!evl[i]) evl[i]=session->AddEventList(wc[i],EVL_Waveform,wgain[i]);
+        }
         if (num_signals==1) { // no interleave.. this is much quicker.
             int bs=duration*whl[0].interleave;
-            memcpy((char *)&(waveform[0])[wlength[0]],(char *)&m_buffer[pos],bs);
-
-            wlength[0]+=bs;
-
-            pos+=bs;
+            EventStoreType * d0=growWaveform(evl[0],bs);
+            if (usigned[0]) widenSamples<unsigned char>(buf,bs,d0);
+            else widenSamples<signed char>(buf,bs,d0);
         } else {
-            for (int i=0;i<duration;i++) {
-                for (int s=0;s<num_signals;s++) {
-                    memcpy((char *)&(waveform[s])[wlength[s]],(char *)&m_buffer[pos],whl[s].interleave);
-                    wlength[s]+=whl[s].interleave;
-                    pos+=whl[s].interleave;
-                }
+            int il0=whl[0].interleave, il1=whl[1].interleave;
+            EventStoreType * d0=growWaveform(evl[0],duration*il0);
+            EventStoreType * d1=growWaveform(evl[1],duration*il1);
+            if (usigned[0]) {
+                if (usigned[1]) deinterleaveBlock<unsigned char,unsigned char>(buf,duration,il0,il1,d0,d1);
+                else deinterleaveBlock<unsigned char,signed char>(buf,duration,il0,il1,d0,d1);
+            } else {
+                if (usigned[1]) deinterleaveBlock<signed char,unsigned char>(buf,duration,il0,il1,d0,d1);
+                else deinterleaveBlock<signed char,signed char>(buf,duration,il0,il1,d0,d1);
             }
         }
+        pos+=duration*blocksize;
         for (int i=0;i<num_signals;i++) wdur[i]+=duration;
         pos+=2;
         block++;
@@ -1441,20 +1720,11 @@ bool PRS1Loader::OpenWaveforms(SessionID sid, QString filename)
     } while (pos<size);
 
     for (int i=0;i<num_signals;i++) {
-        double rate=(double(wdur[i])*1000.0)/double(wlength[i]);
-        double gain;
-        if (i==1) gain=0.1; else gain=1;
-        EventList *a=session->AddEventList(wc[i],EVL_Waveform,gain,0,0,0,rate);
-
-        if (whl[i].sample_format)
-            a->AddWaveform(qint64(start)*1000L,(unsigned char *)waveform[i],wlength[i],qint64(wdur[i])*1000L);
-        else {
-            a->AddWaveform(qint64(start)*1000L,(char *)waveform[i],wlength[i],qint64(wdur[i])*1000L);
-        }
+        if (!evl[i]) evl[i]=session->AddEventList(wc[i],EVL_Waveform,wgain[i]);
+        finishWaveform(evl[i],qint64(start)*1000L,qint64(wdur[i])*1000L);
         if (wc[i]==CPAP_FlowRate) {
-            a->setMax(120);
-            a->setMin(-120);
-        } else if (wc[i]==CPAP_MaskPressure) {
+            evl[i]->setMax(120);
+            evl[i]->setMin(-120);
         }
         session->updateLast(start+qint64(wdur[i])*1000L);
     }
@@ -22,7 +22,7 @@ Copyright: (c)2011 Mark Watkins
 //********************************************************************************************
 // Please INCREMENT the following value when making changes to this loaders implementation.
 //
-const int prs1_data_version=10;
+const int prs1_data_version=11;
 //
 //********************************************************************************************
 
@@ -37,9 +37,6 @@ public:
 };
 
 
-const int max_load_buffer_size=1024*1024;
-
-
 const QString prs1_class_name=STR_MACH_PRS1;
 
 /*! \class PRS1Loader
@@ -65,6 +62,8 @@ public:
     //! \brief Register this Module to the list of Loaders, so it knows to search for PRS1 data.
     static void Register();
 protected:
+    friend class PRS1Import;
+
     QString last;
     QHash<QString,Machine *> PRS1List;
 
@@ -78,26 +77,26 @@ protected:
     //bool OpenEvents(Session *session,QString filename);
 
     //! \brief Parse a .005 waveform file, extracting Flow Rate waveform (and Mask Pressure data if available)
-    bool OpenWaveforms(SessionID sid, QString filename);
+    bool OpenWaveforms(Session * session, QString filename);
 
     // //! \brief ParseWaveform chunk.. Currently unused, as the old one works fine.
     //bool ParseWaveform(qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, quint16 duration, quint16 num_signals, quint16 interleave, quint8 sample_format);
 
-    //! \brief Parse a data chunk from the .000 (brick) and .001 (summary) files.
-    bool ParseSummary(Machine *mach, qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, int family, int familyVersion);
+    //! \brief Parse a data chunk from the .000 (brick) and .001 (summary) files, adding the new Session to sessions
+    bool ParseSummary(QHash<SessionID, Session *> & sessions, Machine *mach, qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, int family, int familyVersion);
 
     //! \brief Parse a single data chunk from a .002 file containing event data for a standard system one machine
-    bool Parse002(qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, int family, int familyVersion);
+    bool Parse002(QHash<SessionID, Session *> & sessions, qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size, int family, int familyVersion);
 
     //! \brief Parse a single data chunk from a .002 file containing event data for a family 5 ASV machine (which has a different format)
-    bool Parse002v5(qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size);
+    bool Parse002v5(QHash<SessionID, Session *> & sessions, qint32 sequence, quint32 timestamp, unsigned char *data, quint16 size);
 
-    //! \brief Open a PRS1 data file, and break into data chunks, delivering them to the correct parser.
-    bool OpenFile(Machine *mach, QString filename);
+    /*! \brief Open a PRS1 data file, and break into data chunks, delivering them to the correct parser.
+        Only touches the Sessions in sessions, so separate files can be opened on separate threads */
+    bool OpenFile(Machine *mach, QString filename, QHash<SessionID, Session *> & sessions);
 
     //bool Parse002(Session *session,unsigned char *buffer,int size,qint64 timestamp,long fpos);
     //bool Parse002ASV(Session *session,unsigned char *buffer,int size,qint64 timestamp,long fpos);
-    unsigned char * m_buffer;
     QHash<SessionID, Session *> extra_session;
 
     //! \brief PRS1 Data files can store multiple sessions, so store them in this list for later processing.
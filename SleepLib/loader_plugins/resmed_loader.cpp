@@ -16,6 +16,11 @@ Copyright: (c)2011 Mark Watkins
 #include <QFile>
 #include <QMessageBox>
 #include <QProgressBar>
+#include <QStatusBar>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QMutex>
+#include <QWaitCondition>
 #include <QDebug>
 #include <cmath>
 
@@ -28,22 +33,30 @@ Copyright: (c)2011 Mark Watkins
 #endif
 
 extern QProgressBar *qprogress;
+extern QStatusBar *qstatusbar;
 QHash<int,QString> RMS9ModelMap;
 QHash<ChannelID, QVector<QString> > resmed_codes;
 
 // Looks up foreign language Signal names that match this channelID
 EDFSignal * EDFParser::lookupSignal(ChannelID ch)
 {
+    QHash<ChannelID,EDFSignal *>::iterator mi=m_channels.find(ch);
+    if (mi!=m_channels.end()) return mi.value();
+
     QHash<ChannelID, QVector<QString> >::iterator ci;
     QHash<QString,EDFSignal *>::iterator jj;
+    EDFSignal * sig=NULL;
     ci=resmed_codes.find(ch);
-    if (ci==resmed_codes.end()) return NULL;
-    for (int i=0;i<ci.value().size();i++) {
-        jj=lookup.find(ci.value()[i]);
-        if (jj==lookup.end()) continue;
-        return jj.value();
+    if (ci!=resmed_codes.end()) {
+        for (int i=0;i<ci.value().size();i++) {
+            jj=lookup.find(ci.value()[i]);
+            if (jj==lookup.end()) continue;
+            sig=jj.value();
+            break;
+        }
     }
-    return NULL;
+    m_channels[ch]=sig;
+    return sig;
 }
 EDFSignal * EDFParser::lookupName(QString name)
 {
@@ -54,19 +67,49 @@ EDFSignal * EDFParser::lookupName(QString name)
 
 
 
+qint16 * EDFSignal::samples()
+{
+    if (data || !records) return data;
+
+    if ((stride==nr*2) || (num_records<=1)) {
+        // Only signal in the file, or a single record: the samples are already laid out end to end
+        data=(qint16 *)records;
+        owned=false;
+        return data;
+    }
+
+    data=new qint16 [nr*num_records];
+    owned=true;
+
+    const char * src=records;
+    qint16 * dst=data;
+    for (long x=0;x<num_records;x++) {
+        // big endian will probably screw up without swapping here..
+        memcpy((char *)dst,src,nr*2);
+        dst+=nr;
+        src+=stride;
+    }
+    return data;
+}
+
 EDFParser::EDFParser(QString name)
 {
     buffer=NULL;
+    m_map=NULL;
+    m_gz=NULL;
     Open(name);
 }
 EDFParser::~EDFParser()
 {
     QVector<EDFSignal *>::iterator s;
     for (s=edfsignals.begin();s!=edfsignals.end();s++) {
-        if ((*s)->data) delete [] (*s)->data;
         delete *s;
     }
-    if (buffer) delete [] buffer;
+    if (m_gz) gzclose(m_gz);
+    if (m_map) {
+        m_file.unmap(m_map);
+        m_file.close();
+    } else if (buffer) delete [] buffer;
 }
 qint16 EDFParser::Read16()
 {
@@ -79,19 +122,117 @@ qint16 EDFParser::Read16()
 }
 QString EDFParser::Read(int si)
 {
-    QString str;
-    if (pos>=filesize) return "";
-    for (int i=0;i<si;i++) {
-        str+=buffer[pos++];
+    if (pos+si>datasize) {
+        pos=datasize;
+        return "";
     }
+    QString str=QString::fromAscii(&buffer[pos],si);
+    pos+=si;
     return str.trimmed();
 }
+
+// Parses a space padded ascii integer field, as QString::toLong would
+static long edfLong(const char * str, int si, bool * ok)
+{
+    const char * end=str+si;
+    while ((str<end) && (*str==' ')) str++;
+    while ((end>str) && ((end[-1]==' ') || (end[-1]==0))) end--;
+
+    bool neg=false;
+    if ((str<end) && ((*str=='-') || (*str=='+'))) {
+        neg=(*str=='-');
+        str++;
+    }
+    if (str>=end) {
+        if (ok) *ok=false;
+        return 0;
+    }
+    long val=0;
+    for (;str<end;str++) {
+        if ((*str<'0') || (*str>'9')) {
+            if (ok) *ok=false;
+            return 0;
+        }
+        val=val*10+(*str-'0');
+    }
+    if (ok) *ok=true;
+    return neg ? -val : val;
+}
+
+// Parses a space padded ascii decimal field (with optional exponent), as QString::toDouble would
+static double edfDouble(const char * str, int si, bool * ok)
+{
+    const char * end=str+si;
+    while ((str<end) && (*str==' ')) str++;
+    while ((end>str) && ((end[-1]==' ') || (end[-1]==0))) end--;
+
+    bool neg=false;
+    if ((str<end) && ((*str=='-') || (*str=='+'))) {
+        neg=(*str=='-');
+        str++;
+    }
+    double val=0;
+    int digits=0,scale=0;
+    for (;(str<end) && (*str>='0') && (*str<='9');str++,digits++) val=val*10.0+(*str-'0');
+    if ((str<end) && (*str=='.')) {
+        for (str++;(str<end) && (*str>='0') && (*str<='9');str++,digits++,scale--) val=val*10.0+(*str-'0');
+    }
+    if (!digits) {
+        if (ok) *ok=false;
+        return 0;
+    }
+    if ((str<end) && ((*str=='e') || (*str=='E'))) {
+        bool eok;
+        long e=edfLong(str+1,end-str-1,&eok);
+        if (!eok) {
+            if (ok) *ok=false;
+            return 0;
+        }
+        scale+=e;
+        str=end;
+    }
+    if (str<end) {
+        if (ok) *ok=false;
+        return 0;
+    }
+    // Divide rather than multiply by a negative power, so short decimals round the same as toDouble
+    if (scale<0) val/=pow(10.0,-scale);
+    else if (scale>0) val*=pow(10.0,scale);
+    if (ok) *ok=true;
+    return neg ? -val : val;
+}
+
+long EDFParser::ReadLong(int si, bool * ok)
+{
+    if (pos+si>datasize) {
+        pos=datasize;
+        if (ok) *ok=false;
+        return 0;
+    }
+    long val=edfLong(&buffer[pos],si,ok);
+    pos+=si;
+    return val;
+}
+double EDFParser::ReadDouble(int si, bool * ok)
+{
+    if (pos+si>datasize) {
+        pos=datasize;
+        if (ok) *ok=false;
+        return 0;
+    }
+    double val=edfDouble(&buffer[pos],si,ok);
+    pos+=si;
+    return val;
+}
 bool EDFParser::Parse()
 {
     bool ok;
     QString temp,temp2;
 
-    version=QString::fromAscii(header.version,8).toLong(&ok);
+    if (!buffer)
+        return false;
+
+    version=edfLong(header.version,8,&ok);
     if (!ok)
         return false;
 
@@ -128,18 +269,18 @@ bool EDFParser::Parse()
 
     //qDebug() << startDate.toString("yyyy-MM-dd HH:mm:ss");
 
-    num_header_bytes=QString::fromAscii(header.num_header_bytes,8).toLong(&ok);
+    num_header_bytes=edfLong(header.num_header_bytes,8,&ok);
     if (!ok)
         return false;
     //reserved44=QString::fromAscii(header.reserved,44);
-    num_data_records=QString::fromAscii(header.num_data_records,8).toLong(&ok);
+    num_data_records=edfLong(header.num_data_records,8,&ok);
     if (!ok)
         return false;
 
-    dur_data_record=QString::fromAscii(header.dur_data_records,8).toDouble(&ok)*1000.0;
+    dur_data_record=edfDouble(header.dur_data_records,8,&ok)*1000.0;
     if (!ok)
         return false;
-    num_signals=QString::fromAscii(header.num_signals,4).toLong(&ok);
+    num_signals=edfLong(header.num_signals,4,&ok);
     if (!ok)
         return false;
 
@@ -152,7 +293,6 @@ bool EDFParser::Parse()
     for (int i=0;i<num_signals;i++) {
         EDFSignal *signal=new EDFSignal;
         edfsignals.push_back(signal);
-        signal->data=NULL;
         edfsignals[i]->label=Read(16);
         lookup[edfsignals[i]->label]=signal;
     }
@@ -160,48 +300,106 @@ bool EDFParser::Parse()
     for (int i=0;i<num_signals;i++) edfsignals[i]->transducer_type=Read(80);
 
     for (int i=0;i<num_signals;i++) edfsignals[i]->physical_dimension=Read(8);
-    for (int i=0;i<num_signals;i++) edfsignals[i]->physical_minimum=Read(8).toDouble(&ok);
-    for (int i=0;i<num_signals;i++) edfsignals[i]->physical_maximum=Read(8).toDouble(&ok);
-    for (int i=0;i<num_signals;i++) edfsignals[i]->digital_minimum=Read(8).toDouble(&ok);
+    for (int i=0;i<num_signals;i++) edfsignals[i]->physical_minimum=ReadDouble(8,&ok);
+    for (int i=0;i<num_signals;i++) edfsignals[i]->physical_maximum=ReadDouble(8,&ok);
+    for (int i=0;i<num_signals;i++) edfsignals[i]->digital_minimum=ReadDouble(8,&ok);
     for (int i=0;i<num_signals;i++) {
         EDFSignal & e=*edfsignals[i];
-        e.digital_maximum=Read(8).toDouble(&ok);
+        e.digital_maximum=ReadDouble(8,&ok);
         e.gain=(e.physical_maximum-e.physical_minimum)/(e.digital_maximum-e.digital_minimum);
         e.offset=0;
     }
 
     for (int i=0;i<num_signals;i++) edfsignals[i]->prefiltering=Read(80);
-    for (int i=0;i<num_signals;i++) edfsignals[i]->nr=Read(8).toLong(&ok);
+    for (int i=0;i<num_signals;i++) edfsignals[i]->nr=ReadLong(8,&ok);
     for (int i=0;i<num_signals;i++) edfsignals[i]->reserved=Read(32);
 
-    // allocate the buffers
-    for (int i=0;i<num_signals;i++) {
-        //qDebug//cout << "Reading signal " << signals[i]->label << endl;
-        EDFSignal & sig=*edfsignals[i];
+    if (num_data_records<0)
+        return false;
 
-        long recs=sig.nr * num_data_records;
-        if (num_data_records<0)
+    // Work out where each signal sits in a data record. Nothing is copied here,
+    // samples are only de-interleaved when a loader actually asks for them.
+    long recsize=0;
+    for (int i=0;i<num_signals;i++) {
+        if (edfsignals[i]->nr<0)
             return false;
-        sig.data=new qint16 [recs];
-        sig.pos=0;
+        recsize+=edfsignals[i]->nr*2;
     }
 
-    for (int x=0;x<num_data_records;x++) {
-        for (int i=0;i<num_signals;i++) {
-            EDFSignal & sig=*edfsignals[i];
-            memcpy((char *)&sig.data[sig.pos],(char *)&buffer[pos],sig.nr*2);
-            sig.pos+=sig.nr;
-            pos+=sig.nr*2;
-            // big endian will probably screw up without this..
-            /*for (int j=0;j<sig.nr;j++) {
-                qint16 t=Read16();
-                sig.data[sig.pos++]=t;
-            } */
+    if (m_gz)
+        return streamRecords(recsize);
+
+    if (recsize>0) {
+        long avail=(datasize-pos)/recsize;
+        if (num_data_records>avail) {
+            qDebug() << "EDFParser::Parse()" << filename << "is truncated, only" << avail << "of" << num_data_records << "data records present";
+            num_data_records=avail;
         }
     }
 
+    long offset=pos;
+    for (int i=0;i<num_signals;i++) {
+        EDFSignal & sig=*edfsignals[i];
+        sig.records=&buffer[offset];
+        sig.stride=recsize;
+        sig.num_records=num_data_records;
+        offset+=sig.nr*2;
+    }
+    pos+=recsize*num_data_records;
+
+    return true;
+}
+bool EDFParser::streamRecords(long recsize)
+{
+    for (int i=0;i<num_signals;i++) {
+        EDFSignal & sig=*edfsignals[i];
+        sig.data=new qint16 [sig.nr*num_data_records];
+        sig.owned=true;
+        sig.stride=recsize;
+        sig.num_records=num_data_records;
+    }
+
+    long x=0;
+    if (recsize>0) {
+        // Peak memory is the signals themselves plus one block, never a whole decompressed copy
+        long block=qMax(1L,65536L/recsize);
+        char * rec=new char [block*recsize];
+
+        while (x<num_data_records) {
+            long n=qMin(block,num_data_records-x);
+            int got=gzread(m_gz,rec,n*recsize);
+            if (got<0) {
+                qDebug() << "EDFParser::streamRecords() inflate error in" << filename;
+                break;
+            }
+            long whole=got/recsize;
+            for (long r=0;r<whole;r++) {
+                const char * src=&rec[r*recsize];
+                for (int i=0;i<num_signals;i++) {
+                    EDFSignal & sig=*edfsignals[i];
+                    // big endian will probably screw up without swapping here..
+                    memcpy((char *)&sig.data[(x+r)*sig.nr],src,sig.nr*2);
+                    src+=sig.nr*2;
+                }
+            }
+            x+=whole;
+            if (whole<n) break;
+        }
+        delete [] rec;
+    } else x=num_data_records;
+
+    gzclose(m_gz);
+    m_gz=NULL;
+
+    if (x<num_data_records) {
+        qDebug() << "EDFParser::Parse()" << filename << "is truncated, only" << x << "of" << num_data_records << "data records present";
+        num_data_records=x;
+        for (int i=0;i<num_signals;i++) edfsignals[i]->num_records=x;
+    }
+    filesize+=qint64(recsize)*num_data_records;
     return true;
 }
+
 bool EDFParser::Open(QString name)
 {
 
@@ -209,39 +407,54 @@ bool EDFParser::Open(QString name)
 
     if (name.endsWith(".gz")) {
         filename=name.mid(0,-3);
-        QFile fi(name);
-        fi.open(QFile::ReadOnly);
-        fi.seek(fi.size()-4);
-        unsigned char ch[4];
-        fi.read((char *)ch,4);
-        filesize=ch[0] | (ch [1] << 8) | (ch[2] << 16) | (ch[3] << 24);
-        datasize=filesize-EDFHeaderSize;
-        if (datasize<0) return false;
-        qDebug() << "Size of" << name << "uncompressed=" << filesize;
-        gzFile f=gzopen(name.toAscii(),"rb");
-        if (!f) {
+
+        // The gzip trailer only holds the uncompressed size modulo 4GB, so don't trust it.
+        // Only the headers are inflated here, Parse() streams the data records in after them.
+        m_gz=gzopen(name.toAscii(),"rb");
+        if (!m_gz) {
             qDebug() << "EDFParser::Open() Couldn't open file" << name;
             return false;
         }
-        gzread(f,(char *)&header,EDFHeaderSize);
+        //gzbuffer(m_gz,65536*2);
+        bool ok=false;
+        long ns=0;
+        if (gzread(m_gz,(char *)&header,EDFHeaderSize)==EDFHeaderSize)
+            ns=edfLong(header.num_signals,4,&ok);
+        if (!ok || (ns<=0)) {
+            qDebug() << "EDFParser::Open() Bad EDF header in" << name;
+            gzclose(m_gz);
+            m_gz=NULL;
+            return false;
+        }
+        datasize=ns*256; // signal headers are 256 bytes per signal
         buffer=new char [datasize];
-        //gzbuffer(f,65536*2);
-        gzread(f,buffer,datasize);
-        gzclose(f);
+        if (gzread(m_gz,buffer,datasize)!=datasize) {
+            qDebug() << "EDFParser::Open() Truncated EDF header in" << name;
+            gzclose(m_gz);
+            m_gz=NULL;
+            return false;
+        }
+        filesize=EDFHeaderSize+datasize;
     } else {
-        QFile f(name);
-        if (!f.open(QIODevice::ReadOnly))
+        m_file.setFileName(name);
+        if (!m_file.open(QIODevice::ReadOnly))
             return false;
         filename=name;
-        filesize=f.size();
+        filesize=m_file.size();
         datasize=filesize-EDFHeaderSize;
         if (datasize<0) return false;
 
-        f.read((char *)&header,EDFHeaderSize);
-        //qDebug() << "Opening " << name;
-        buffer=new char [datasize];
-        f.read(buffer,datasize);
-        f.close();
+        // Map the file rather than reading it, so signals a loader never asks for are never touched
+        m_map=m_file.map(0,filesize);
+        if (m_map) {
+            memcpy((char *)&header,m_map,EDFHeaderSize);
+            buffer=(char *)m_map+EDFHeaderSize;
+        } else {
+            m_file.read((char *)&header,EDFHeaderSize);
+            buffer=new char [datasize];
+            m_file.read(buffer,datasize);
+            m_file.close();
+        }
     }
     pos=0;
     return true;
@@ -290,6 +503,129 @@ Machine *ResmedLoader::CreateMachine(QString serial,Profile *profile)
 
 long event_cnt=0;
 
+/*! \struct ResmedImportQueue
+    \brief What the ResmedImport workers share with ResmedLoader::Open's commit loop
+
+    Everything but the results is set up before any worker starts, and only read from then on.
+    Each worker fills in its own slot of sessions & ready, under mutex.
+    */
+struct ResmedImportQueue {
+    ResmedImportQueue() {
+        loader=NULL;
+        machine=NULL;
+        backups=NULL;
+        create_backups=compress_backups=false;
+        finished=0;
+    }
+
+    ResmedLoader * loader;
+    Machine * machine;
+    BackupQueue * backups;
+    QString datalog_path;
+    QString backup_path;
+    QString serial;
+    bool create_backups;
+    bool compress_backups;
+    CalcSettings settings;
+
+    QMutex mutex;
+    //! \brief Signalled every time a worker finishes
+    QWaitCondition changed;
+    QVector<Session *> sessions;
+    QVector<bool> ready;
+    int finished;
+};
+
+/*! \class ResmedImport
+    \brief Backs up and parses one sessions worth of DATALOG EDF files into a new Session
+
+    Runs on a QThreadPool thread. The Session isn't added to the Machine here, that's left
+    to the commit loop in ResmedLoader::Open, which goes through them in SessionID order.
+    */
+class ResmedImport:public QRunnable
+{
+public:
+    ResmedImport(ResmedImportQueue * queue, int index, SessionID sessionid, const QStringList & files)
+        :m_queue(queue),m_index(index),m_sessionid(sessionid),m_files(files) {}
+    virtual void run();
+protected:
+    Session * parse();
+
+    ResmedImportQueue * m_queue;
+    int m_index;
+    SessionID m_sessionid;
+    QStringList m_files;
+};
+
+void ResmedImport::run()
+{
+    CalcSettings::setLocal(m_queue->settings);
+    Session * sess=parse();
+    CalcSettings::clearLocal();
+
+    QMutexLocker lock(&m_queue->mutex);
+    m_queue->sessions[m_index]=sess;
+    m_queue->ready[m_index]=true;
+    m_queue->finished++;
+    m_queue->changed.wakeAll();
+}
+
+Session * ResmedImport::parse()
+{
+    const QString ext_gz=".gz";
+    ResmedLoader * loader=m_queue->loader;
+    const QString & newpath=m_queue->datalog_path;
+    const QString & backup_path=m_queue->backup_path;
+    bool compress_backups=m_queue->compress_backups;
+
+    // Create the session
+    Session * sess=new Session(m_queue->machine,m_sessionid);
+    QString filename,fn,fullpath,backupfile,backfile, crcfile;
+    bool gz;
+
+    // Process EDF File List
+    for (int i=0;i<m_files.size();++i) {
+        filename=m_files[i];
+        gz=(filename.right(3).toLower()==ext_gz);
+        fullpath=newpath+filename;
+
+        // Queue the EDF file up for the backup folder. Already compressed ones are just copied.
+        if (m_queue->create_backups) {
+            backupfile=backup_path+filename;
+            m_queue->backups->add(fullpath, backupfile, !gz && compress_backups);
+
+            if (!gz) {
+                backfile=filename.replace(".edf",".crc",Qt::CaseInsensitive);
+            } else {
+                backfile=filename.replace(".edf.gz",".crc",Qt::CaseInsensitive);
+            }
+
+            backupfile=backup_path+backfile;
+            crcfile=newpath+backfile;
+            m_queue->backups->add(crcfile, backupfile);
+        }
+
+        EDFParser edf(fullpath);
+
+        // Parse the actual file
+        if (!edf.Parse())
+            continue;
+
+        // Give a warning if doesn't match the machine serial number in Identification.tgt
+        if (edf.serialnumber!=m_queue->serial) {
+            qDebug() << "edf Serial number doesn't match Identification.tgt";
+        }
+
+        fn=filename.section("_",-1).section(".",0,0).toLower();
+
+        if (fn=="eve") loader->LoadEVE(sess,edf);
+        else if (fn=="pld") loader->LoadPLD(sess,edf);
+        else if (fn=="brp") loader->LoadBRP(sess,edf);
+        else if (fn=="sad") loader->LoadSAD(sess,edf);
+    }
+    return sess;
+}
+
 int ResmedLoader::Open(QString & path,Profile *profile)
 {
     const QString datalog="DATALOG";
@@ -387,6 +723,10 @@ int ResmedLoader::Open(QString & path,Profile *profile)
         create_backups=false;
     }
 
+    // Let any backups left over from the last import finish before checking against them again
+    m_backups.wait();
+    m_backups.setThreaded(PROFILE.session->multithreading());
+
     ///////////////////////////////////////////////////////////////////////////////////
     // Parse the idmap into machine objects properties, (overwriting any old values)
     ///////////////////////////////////////////////////////////////////////////////////
@@ -421,6 +761,8 @@ int ResmedLoader::Open(QString & path,Profile *profile)
     // Create the backup folder for storing a copy of everything in..
     // (Unless we are importing from this backup folder)
     ///////////////////////////////////////////////////////////////////////////////////
+    // Everything backed up from here on gets reported as one, after end()
+    m_backups.begin();
     if (create_backups) {
         if (!dir.exists(backup_path)) {
             if (!dir.mkpath(backup_path+datalog)) {
@@ -429,24 +771,16 @@ int ResmedLoader::Open(QString & path,Profile *profile)
         }
 
         // Copy Identification files to backup folder
-        QFile::copy(path+idfile+ext_TGT,backup_path+idfile+ext_TGT);
-        QFile::copy(path+idfile+ext_CRC,backup_path+idfile+ext_CRC);
+        m_backups.add(path+idfile+ext_TGT,backup_path+idfile+ext_TGT);
+        m_backups.add(path+idfile+ext_CRC,backup_path+idfile+ext_CRC);
 
         //copy STR files to backup folder
         if (strpath.endsWith(ext_gz))  // Already compressed.
-            QFile::copy(strpath,backup_path+strfile+ext_EDF+ext_gz);
-        else { // Compress STR file to backup folder
-            QString strf=backup_path+strfile+ext_EDF;
-            if (QFile::exists(strf))
-                QFile::remove(strf);
-
-            compress_backups ?
-                compressFile(strpath,strf)
-            :
-                QFile::copy(strpath,strf);
-        }
+            m_backups.add(strpath,backup_path+strfile+ext_EDF+ext_gz);
+        else // Compress STR file to backup folder
+            m_backups.add(strpath,backup_path+strfile+ext_EDF,compress_backups);
 
-        QFile::copy(path+"STR.crc",backup_path+"STR.crc");
+        m_backups.add(path+"STR.crc",backup_path+"STR.crc");
     }
 
     ///////////////////////////////////////////////////////////////////////////////////
@@ -547,6 +881,13 @@ int ResmedLoader::Open(QString & path,Profile *profile)
 
     QMap<SessionID,QStringList>::iterator si;
 
+    // Files that weren't imported before (or have changed since), and the sessions they belong to
+    ImportIndex index;
+    index.load(m);
+    QHash<QString,QFileInfo> newinfo;
+    QSet<SessionID> touched, replaced;
+    SessionID imported;
+
     // For each file in flist...
     for (int i=0;i<size;i++) {
         QFileInfo fi=flist.at(i);
@@ -618,6 +959,18 @@ int ResmedLoader::Open(QString & path,Profile *profile)
             sessfiles[sessionid].push_back(filename);
         }
 
+        // Sessions with nothing in them were kept track of, so they don't get parsed all over again
+        if (!index.unchanged(datalog+"/"+filename,fi,&imported)) {
+            if (index.contains(datalog+"/"+filename)) {
+                qDebug() << "ResMed file" << filename << "has changed since it was imported";
+                if (m->SessionExists(sessionid)) replaced.insert(sessionid);
+            }
+            newinfo[filename]=fi;
+            touched.insert(sessionid);
+        } else if (imported) {
+            touched.insert(sessionid);
+        }
+
         if ((i % 10)==0) {
             // Update the progress bar
             if (qprogress) qprogress->setValue((float(i+1)/float(size)*10.0));
@@ -625,9 +978,7 @@ int ResmedLoader::Open(QString & path,Profile *profile)
         }
     }
 
-    QString fn;
     Session *sess;
-    int cnt=0;
     size=sessfiles.size();
 
     QHash<SessionID,int> sessday;
@@ -1049,90 +1400,84 @@ int ResmedLoader::Open(QString & path,Profile *profile)
     backup_path+=datalog+"/";
 
     /////////////////////////////////////////////////////////////////////////////
-    // Scan through new file list and import sessions
+    // Queue up the new sessions, in SessionID order
     /////////////////////////////////////////////////////////////////////////////
+    // Sessions with changed files are thrown away and imported again, as purging their day would
+    for (QSet<SessionID>::iterator it=replaced.begin();it!=replaced.end();it++) {
+        qDebug() << "Reimporting ResMed session" << *it;
+        m->RemoveSession(*it);
+    }
+
+    QList<SessionID> newids;
+    QList<QStringList> newfiles;
     for (QMap<SessionID,QStringList>::iterator si=sessfiles.begin();si!=sessfiles.end();si++) {
-        sessionid=si.key();
+        // Skip sessions whose files were all imported before, and came to nothing
+        if (!touched.contains(si.key()))
+            continue;
 
         // Skip file if already imported
-        if (m->SessionExists(sessionid))
+        if (m->SessionExists(si.key()))
             continue;
+        newids.push_back(si.key());
+        newfiles.push_back(si.value());
+    }
+    size=newids.size();
+
+    ResmedImportQueue queue;
+    queue.loader=this;
+    queue.machine=m;
+    queue.backups=&m_backups;
+    queue.datalog_path=newpath;
+    queue.backup_path=backup_path;
+    queue.serial=serial;
+    queue.create_backups=create_backups;
+    queue.compress_backups=compress_backups;
+    queue.settings=CalcSettings::current();
+    queue.sessions.fill(NULL,size);
+    queue.ready.fill(false,size);
+
+    bool multithreaded=PROFILE.session->multithreading();
+#ifdef DEBUG_EFFICIENCY
+    multithreaded=false; // ToTimeDelta's statistics aren't thread safe
+#endif
 
-        // Create the session
-        sess=new Session(m,sessionid);
-        QString fullpath,backupfile,backfile, crcfile;
-
-        // Process EDF File List
-        for (int i=0;i<si.value().size();++i) {
-            filename=si.value()[i];
-            gz=(filename.right(3).toLower()==ext_gz);
-            fullpath=newpath+filename;
-
-            // Copy the EDF file to the backup folder
-            if (create_backups) {
-                backupfile=backup_path+filename;
-                bool dobackup=true;
-                if (!gz && QFile::exists(backupfile+".gz")) {
-                    dobackup=false;
-                } else if (QFile::exists(backupfile)) {
-                    if (gz) {
-                        // don't bother, it's already there and compressed.
-                        dobackup=false;
-                    } else {
-                        // non compressed file is there..
-                        if (compress_backups) {
-                            // remove old edf file, as we are writing a compressed one
-                            QFile::remove(backupfile);
-                        } else { // don't bother copying it.
-                            dobackup=false;
-                        }
-                    }
-                }
-                if (dobackup) {
-                    if (!gz) {
-                        compress_backups ?
-                            compressFile(fullpath, backupfile)
-                        :
-                            QFile::copy(fullpath, backupfile);
-                    } else {
-                        // already compressed, just copy it.
-                        QFile::copy(fullpath, backupfile);
-                    }
-                }
-
-                if (!gz) {
-                    backfile=filename.replace(".edf",".crc",Qt::CaseInsensitive);
-                } else {
-                    backfile=filename.replace(".edf.gz",".crc",Qt::CaseInsensitive);
-                }
-
-                backupfile=backup_path+backfile;
-                crcfile=newpath+backfile;
-                QFile::copy(crcfile, backupfile);
-            }
-
-            EDFParser edf(fullpath);
-
-            // Parse the actual file
-            if (!edf.Parse())
-                continue;
-
-            // Give a warning if doesn't match the machine serial number in Identification.tgt
-            if (edf.serialnumber!=serial) {
-                qDebug() << "edf Serial number doesn't match Identification.tgt";
-            }
-
-            fn=filename.section("_",-1).section(".",0,0).toLower();
-
-            if (fn=="eve") LoadEVE(sess,edf);
-            else if (fn=="pld") LoadPLD(sess,edf);
-            else if (fn=="brp") LoadBRP(sess,edf);
-            else if (fn=="sad") LoadSAD(sess,edf);
+    /////////////////////////////////////////////////////////////////////////////
+    // Parse them all on the thread pool. Sessions share nothing while being built,
+    // so the workers run without locking until they hand their result over.
+    /////////////////////////////////////////////////////////////////////////////
+    if (multithreaded) {
+        QThreadPool * pool=QThreadPool::globalInstance();
+        for (int i=0;i<size;i++) {
+            pool->start(new ResmedImport(&queue,i,newids.at(i),newfiles.at(i)));
         }
-        if ((++cnt%10) ==0) {
-            if (qprogress) qprogress->setValue(10.0+(float(cnt)/float(size)*90.0));
-            QApplication::processEvents();
+    }
+
+    /////////////////////////////////////////////////////////////////////////////
+    // Commit each one in SessionID order as soon as it's ready, so the results
+    // (and Machine's view of its own history) come out the same every time
+    /////////////////////////////////////////////////////////////////////////////
+    bool ready;
+    int finished;
+    for (int i=0;i<size;i++) {
+        if (!multithreaded) {
+            ResmedImport task(&queue,i,newids.at(i),newfiles.at(i));
+            task.run();
         }
+        do {
+            queue.mutex.lock();
+            if (!queue.ready.at(i))
+                queue.changed.wait(&queue.mutex,100);
+            ready=queue.ready.at(i);
+            finished=queue.finished;
+            sess=queue.sessions.at(i);
+            queue.mutex.unlock();
+
+            if (!ready || ((i % 10)==0)) {
+                // Progress is how many are parsed, not just committed
+                if (qprogress) qprogress->setValue(10.0+(float(finished)/float(size)*90.0));
+                QApplication::processEvents();
+            }
+        } while (!ready);
 
         if (!sess) continue;
         if (!sess->first()) {
@@ -1146,7 +1491,7 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                 int mode;
                 sig=stredf.lookupSignal(CPAP_Mode);
                 if (sig) {
-                    mode=sig->data[dn];
+                    mode=sig->sample(dn);
                 } else mode=0;
 
                 sess->settings[CPAP_PresReliefType]=PR_EPR;
@@ -1154,12 +1499,12 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                 // AutoSV machines don't have both fields
                 sig=stredf.lookupSignal(RMS9_EPR);
                 if (sig) {
-                    sess->settings[CPAP_PresReliefMode]=EventDataType(sig->data[dn])*sig->gain;
+                    sess->settings[CPAP_PresReliefMode]=EventDataType(sig->sample(dn))*sig->gain;
                 }
 
                 sig=stredf.lookupSignal(RMS9_EPRSet);
                 if (sig)  {
-                    sess->settings[CPAP_PresReliefSet]=EventDataType(sig->data[dn])*sig->gain;
+                    sess->settings[CPAP_PresReliefSet]=EventDataType(sig->sample(dn))*sig->gain;
                 }
 
 
@@ -1167,7 +1512,7 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                     sess->settings[CPAP_Mode]=MODE_CPAP;
                     sig=stredf.lookupSignal(RMS9_SetPressure); // ?? What's meant by Set Pressure?
                     if (sig) {
-                        EventDataType pressure=sig->data[dn]*sig->gain;
+                        EventDataType pressure=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_Pressure]=pressure;
                     }
                 } else if (mode>5) {
@@ -1179,17 +1524,17 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                     EventDataType tmp,epap=0,ipap=0;
                     if (stredf.lookup.contains("EPAP")) {
                         sig=stredf.lookup["EPAP"];
-                        epap=sig->data[dn]*sig->gain;
+                        epap=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_EPAP]=epap;
                     }
                     if (stredf.lookup.contains("IPAP")) {
                         sig=stredf.lookup["IPAP"];
-                        ipap=sig->data[dn]*sig->gain;
+                        ipap=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_IPAP]=ipap;
                     }
                     if (stredf.lookup.contains("PS")) {
                         sig=stredf.lookup["PS"];
-                        tmp=sig->data[dn]*sig->gain;
+                        tmp=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_PS]=tmp; // technically this is IPAP-EPAP
                         if (!ipap) {
                             // not really possible. but anyway, just in case..
@@ -1198,26 +1543,26 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                     }
                     if (stredf.lookup.contains("Min PS")) {
                         sig=stredf.lookup["Min PS"];
-                        tmp=sig->data[dn]*sig->gain;
+                        tmp=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_PSMin]=tmp;
                         sess->settings[CPAP_IPAPLo]=epap+tmp;
                         sess->setMin(CPAP_IPAP,epap+tmp);
                     }
                     if (stredf.lookup.contains("Max PS")) {
                         sig=stredf.lookup["Max PS"];
-                        tmp=sig->data[dn]*sig->gain;
+                        tmp=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_PSMax]=tmp;
                         sess->settings[CPAP_IPAPHi]=epap+tmp;
                     }
                     if (stredf.lookup.contains("RR")) { // Is this a setting to force respiratory rate on S/T machines?
                         sig=stredf.lookup["RR"];
-                        tmp=sig->data[dn];
+                        tmp=sig->sample(dn);
                         sess->settings[CPAP_RespRate]=tmp*sig->gain;
                     }
 
                     if (stredf.lookup.contains("Easy-Breathe")) {
                         sig=stredf.lookup["Easy-Breathe"];
-                        tmp=sig->data[dn]*sig->gain;
+                        tmp=sig->sample(dn)*sig->gain;
 
                         sess->settings[CPAP_PresReliefSet]=tmp;
                         sess->settings[CPAP_PresReliefType]=(int)PR_EASYBREATHE;
@@ -1228,13 +1573,13 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                     sess->settings[CPAP_Mode]=MODE_APAP;
                     sig=stredf.lookupSignal(CPAP_PressureMin);
                     if (sig) {
-                        EventDataType pressure=sig->data[dn]*sig->gain;
+                        EventDataType pressure=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_PressureMin]=pressure;
                         //sess->setMin(CPAP_Pressure,pressure);
                     }
                     sig=stredf.lookupSignal(CPAP_PressureMax);
                     if (sig) {
-                        EventDataType pressure=sig->data[dn]*sig->gain;
+                        EventDataType pressure=sig->sample(dn)*sig->gain;
                         sess->settings[CPAP_PressureMax]=pressure;
                         //sess->setMax(CPAP_Pressure,pressure);
                     }
@@ -1248,7 +1593,10 @@ int ResmedLoader::Open(QString & path,Profile *profile)
             // Basically takes a guess.
             if (!sess->settings.contains(CPAP_Mode)) {
                 //The following is a lame assumption if 50th percentile == max, then it's CPAP
-                EventDataType p50=sess->percentile(CPAP_Pressure,0.50);
+                const EventDataType percs[2]={ 0.10, 0.50 };
+                EventDataType pvals[2];
+                sess->percentiles(CPAP_Pressure,2,percs,pvals);
+                EventDataType p50=pvals[1];
                 EventDataType max=sess->Max(CPAP_Pressure);
                 if (max==p50) {
                     sess->settings[CPAP_Mode]=MODE_CPAP;
@@ -1260,7 +1608,7 @@ int ResmedLoader::Open(QString & path,Profile *profile)
                     if (mode<MODE_APAP) mode=MODE_APAP;
                     sess->settings[CPAP_Mode]=mode;
                     // Assuming 10th percentile should cover for ramp/warmup
-                    sess->settings[CPAP_PressureMin]=sess->percentile(CPAP_Pressure,0.10);
+                    sess->settings[CPAP_PressureMin]=pvals[0];
                     sess->settings[CPAP_PressureMax]=sess->Max(CPAP_Pressure);
                 }
             }
@@ -1291,7 +1639,23 @@ int ResmedLoader::Open(QString & path,Profile *profile)
 
     if (m) {
         m->Save();
+
+        // Only now they're safely stored, remember which files went where
+        for (QMap<SessionID,QStringList>::iterator si=sessfiles.begin();si!=sessfiles.end();si++) {
+            SessionID id=m->SessionExists(si.key()) ? si.key() : 0;
+            for (int i=0;i<si.value().size();i++) {
+                QHash<QString,QFileInfo>::iterator fi=newinfo.find(si.value().at(i));
+                if (fi!=newinfo.end())
+                    index.add(datalog+"/"+fi.key(),fi.value(),id);
+            }
+        }
+        index.save();
     }
+    // The backups carry on after the import, and report in themselves when they're done
+    m_backups.end();
+    if (!m_backups.finished() && qstatusbar)
+        qstatusbar->showMessage(QObject::tr("Backing up SD card data..."));
+
     if (qprogress) qprogress->setValue(100);
     qDebug() << "Total Events " << event_cnt;
     return 1;
@@ -1328,7 +1692,7 @@ bool ResmedLoader::LoadEVE(Session *sess,EDFParser &edf)
     for (int s=0;s<edf.GetNumSignals();s++) {
         recs=edf.edfsignals[s]->nr*edf.GetNumDataRecords()*2;
 
-        data=(char *)edf.edfsignals[s]->data;
+        data=(char *)edf.edfsignals[s]->samples();
         pos=0;
         tt=edf.startdate;
         sess->updateFirst(tt);
@@ -1339,12 +1703,13 @@ bool ResmedLoader::LoadEVE(Session *sess,EDFParser &edf)
                 break;
             if (data[pos++]=='+') sign=true; else sign=false;
             t="";
-            c=data[pos];
-            do {
-                t+=c;
-                pos++;
-                c=data[pos];
-            } while ((c!=20) && (c!=21)); // start code
+            while ((pos<recs) && (data[pos]!=20) && (data[pos]!=21)) { // start code
+                t+=data[pos++];
+            }
+            if (pos>=recs) {
+                qDebug() << "Short EDF EVE file" << edf.filename;
+                break;
+            }
             d=t.toDouble(&ok);
             if (!ok) {
                 qDebug() << "Faulty EDF EVE file " << edf.filename;
@@ -1359,29 +1724,28 @@ bool ResmedLoader::LoadEVE(Session *sess,EDFParser &edf)
                 pos++;
                 // get duration.
                 t="";
-                do {
-                    t+=data[pos];
-                    pos++;
-                } while ((data[pos]!=20) && (pos<recs)); // start code
+                while ((pos<recs) && (data[pos]!=20)) { // start code
+                    t+=data[pos++];
+                }
                 duration=t.toDouble(&ok);
                 if (!ok) {
                     qDebug() << "Faulty EDF EVE file (at %" << pos << ") " << edf.filename;
                     break;
                 }
             }
-            while ((data[pos]==20) && (pos<recs)) {
+            while ((pos<recs) && (data[pos]==20)) {
                 t="";
                 pos++;
-                if (data[pos]==0)
+                if ((pos>=recs) || (data[pos]==0))
                     break;
                 if (data[pos]==20) {
                     pos++;
                     break;
                 }
 
-                do {
+                while ((pos<recs) && (data[pos]!=20)) { // start code
                     t+=tolower(data[pos++]);
-                } while ((data[pos]!=20) && (pos<recs)); // start code
+                }
                 if (!t.isEmpty()) {
                     if (t=="obstructive apnea") {
                         OA->AddEvent(tt,duration);
@@ -1407,7 +1771,7 @@ bool ResmedLoader::LoadEVE(Session *sess,EDFParser &edf)
                 }
                // pos++;
             }
-            while ((data[pos]==0) && pos<recs) pos++;
+            while ((pos<recs) && (data[pos]==0)) pos++;
             if (pos>=recs) break;
         }
         sess->updateLast(tt);
@@ -1442,7 +1806,7 @@ bool ResmedLoader::LoadBRP(Session *sess,EDFParser &edf)
         double rate=double(duration)/double(recs);
         EventList *a=sess->AddEventList(code,EVL_Waveform,es.gain,es.offset,0,0,rate);
         a->setDimension(es.physical_dimension);
-        a->AddWaveform(edf.startdate,es.data,recs,duration);
+        a->AddWaveform(edf.startdate,es.samples(),recs,duration);
         sess->setMin(code,a->Min());
         sess->setMax(code,a->Max());
     }
@@ -1467,7 +1831,7 @@ EventList * ResmedLoader::ToTimeDelta(Session *sess,EDFParser &edf, EDFSignal &
         startpos=20; // Shave the first 20 seconds of pressure data
         tt+=rate*startpos;
     }
-    qint16 * sptr=es.data;
+    qint16 * sptr=es.samples();
     qint16 * eptr=sptr+recs;
     sptr+=startpos;
 
@@ -1531,8 +1895,9 @@ bool ResmedLoader::LoadSAD(Session *sess,EDFParser &edf)
             continue;
         }
         bool hasdata=false;
+        qint16 * data=es.samples();
         for (int i=0;i<recs;i++) {
-            if (es.data[i]!=-1) {
+            if (data[i]!=-1) {
                 hasdata=true;
                 break;
             }
@@ -1586,7 +1951,7 @@ bool ResmedLoader::LoadPLD(Session *sess,EDFParser &edf)
         } else if ((es.label=="RR") || (es.label=="AF") || (es.label=="FR")) {
             code=CPAP_RespRate;
             a=sess->AddEventList(code,EVL_Waveform,es.gain,es.offset,0,0,rate);
-            a->AddWaveform(edf.startdate,es.data,recs,duration);
+            a->AddWaveform(edf.startdate,es.samples(),recs,duration);
         } else if ((es.label=="Vt") || (es.label=="VC")) {
             code=CPAP_TidalVolume;
             es.physical_maximum=es.physical_minimum=0;
@@ -1609,22 +1974,22 @@ bool ResmedLoader::LoadPLD(Session *sess,EDFParser &edf)
         } else if (es.label.startsWith("I:E")) {
             code=CPAP_IE;//I:E ratio?
             a=sess->AddEventList(code,EVL_Waveform,es.gain,es.offset,0,0,rate);
-            a->AddWaveform(edf.startdate,es.data,recs,duration);
+            a->AddWaveform(edf.startdate,es.samples(),recs,duration);
             //a=ToTimeDelta(sess,edf,es, code,recs,duration,0,0);
         } else if (es.label.startsWith("Ti")) {
             code=CPAP_Ti;
             a=sess->AddEventList(code,EVL_Waveform,es.gain,es.offset,0,0,rate);
-            a->AddWaveform(edf.startdate,es.data,recs,duration);
+            a->AddWaveform(edf.startdate,es.samples(),recs,duration);
             //a=ToTimeDelta(sess,edf,es, code,recs,duration,0,0);
         } else if (es.label.startsWith("Te")) {
             code=CPAP_Te;
             a=sess->AddEventList(code,EVL_Waveform,es.gain,es.offset,0,0,rate);
-            a->AddWaveform(edf.startdate,es.data,recs,duration);
+            a->AddWaveform(edf.startdate,es.samples(),recs,duration);
             //a=ToTimeDelta(sess,edf,es, code,recs,duration,0,0);
         } else if (es.label.startsWith("TgMV")) {
             code=CPAP_TgMV;
             a=sess->AddEventList(code,EVL_Waveform,es.gain,es.offset,0,0,rate);
-            a->AddWaveform(edf.startdate,es.data,recs,duration);
+            a->AddWaveform(edf.startdate,es.samples(),recs,duration);
             //a=ToTimeDelta(sess,edf,es, code,recs,duration,0,0);
         } else if (es.label=="") {
             if (emptycnt==0) {
@@ -13,6 +13,7 @@ Copyright: (c)2011 Mark Watkins
 //#include <map>
 //using namespace std;
 #include <QVector>
+#include <QFile>
 #include "SleepLib/machine.h" // Base class: MachineLoader
 #include "SleepLib/machine_loader.h"
 #include "SleepLib/profiles.h"
@@ -57,6 +58,32 @@ const int EDFHeaderSize=sizeof(EDFHeader);
     */
 struct EDFSignal {
 public:
+    EDFSignal() {
+        physical_minimum=physical_maximum=digital_minimum=digital_maximum=0;
+        gain=1;
+        offset=0;
+        nr=0;
+        records=NULL;
+        stride=0;
+        num_records=0;
+        data=NULL;
+        owned=false;
+    }
+    ~EDFSignal() {
+        if (owned) delete [] data;
+    }
+
+    /*! \brief Returns the signals samples, de-interleaving them out of the data records on first use
+        Signals that are already contiguous in the file are handed back in place, without copying */
+    qint16 * samples();
+
+    //! \brief Returns sample i, read straight out of its data record without decoding the rest of the signal
+    qint16 sample(long i) {
+        if (data) return data[i];
+        if (nr<=0) return 0;
+        return ((const qint16 *)(records+(i/nr)*stride))[i % nr];
+    }
+
     //! \brief Name of this Signal
     QString label;
 
@@ -93,11 +120,23 @@ public:
     //! \brief Reserved (usually blank)
     QString reserved;
 
-    //! \brief Pointer to the signals sample data
+    //! \brief This signals samples in the first data record, in the parsers file data
+    const char * records;
+
+    //! \brief Bytes from one data record to the next
+    long stride;
+
+    //! \brief Number of data records
+    long num_records;
+
+protected:
+    friend class EDFParser;
+
+    //! \brief The signals sample data, once samples() has been called
     qint16 * data;
 
-    //! \brief a non-EDF extra used internally to count the signal data
-    int pos;
+    //! \brief True if data was allocated by samples(), rather than pointing into the file data
+    bool owned;
 };
 
 /*! \class EDFParser
@@ -119,6 +158,12 @@ public:
     //! \brief Read si bytes of 8 bit data from the EDF+ data stream
     QString Read(int si);
 
+    //! \brief Read an si byte integer header field, without going through QString
+    long ReadLong(int si, bool * ok=NULL);
+
+    //! \brief Read an si byte decimal header field, without going through QString
+    double ReadDouble(int si, bool * ok=NULL);
+
     //! \brief Read 16 bit word of data from the EDF+ data stream
     qint16 Read16();
 
@@ -146,13 +191,15 @@ public:
 
     //! \brief Parse the EDF+ file into the list of EDFSignals.. Must be call Open(..) first.
     bool Parse();
+
+    //! \brief File data following the header. Memory mapped for plain files, decompressed for .gz
     char *buffer;
 
     //! \brief  The EDF+ files header structure, used as a place holder while processing the text data.
     EDFHeader header;
 
     QString filename;
-    long filesize;
+    qint64 filesize;
     long datasize;
     long pos;
 
@@ -168,6 +215,20 @@ public:
     qint64 startdate;
     qint64 enddate;
     QString reserved44;
+
+protected:
+    //! \brief Signals already found by lookupSignal, indexed by ChannelID
+    QHash<ChannelID,EDFSignal *> m_channels;
+
+    //! \brief Inflates the data records of a .gz file a block at a time, splitting each record into its signals
+    bool streamRecords(long recsize);
+
+    //! \brief Kept open while buffer is mapped from it
+    QFile m_file;
+    uchar * m_map;
+
+    //! \brief Open .gz file, until Parse() has streamed its data records in
+    gzFile m_gz;
 };
 
 /*! \class ResmedLoader
@@ -215,6 +276,9 @@ protected:
     //! This contains the Pressure, Leak, Respiratory Rate, Minute Ventilation, Tidal Volume, etc..
     bool LoadPLD(Session *sess,EDFParser &edf);
 
+    //! \brief Parses each sessions files on a worker thread (see ResmedLoader::Open)
+    friend class ResmedImport;
+
     QMap<SessionID,QStringList> sessfiles;
 #ifdef DEBUG_EFFICIENCY
     QHash<ChannelID,qint64> channel_efficiency;
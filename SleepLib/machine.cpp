@@ -5,8 +5,11 @@
 */
 
 #include <QApplication>
+#include <QMainWindow>
 #include <QDir>
+#include <QFile>
 #include <QProgressBar>
+#include <QThreadPool>
 #include <QDebug>
 #include <QString>
 #include <QObject>
@@ -16,6 +19,7 @@
 #include "profiles.h"
 #include <algorithm>
 #include "SleepLib/schema.h"
+#include "SleepLib/calcs.h"
 
 extern QProgressBar * qprogress;
 
@@ -68,16 +72,15 @@ QDate Machine::pickDate(qint64 first)
     QDate date=d2.date();
     QTime time=d2.time();
 
-    int closest_session=0;
+    qint64 closest_session=0;
 
     if (time<split_time) {
         date=date.addDays(-1);
     } else if (combine_sessions > 0) {
         QMap<QDate,Day *>::iterator dit=day.find(date.addDays(-1)); // Check Day Before
         if (dit != day.end()) {
-            QDateTime lt=QDateTime::fromTime_t(dit.value()->last()/1000L);
-            closest_session=lt.secsTo(d2)/60;
-            if (closest_session < combine_sessions) {
+            closest_session=dit.value()->distance(first,first)/60000L;
+            if ((closest_session >= 0) && (closest_session < combine_sessions)) {
                 date=date.addDays(-1);
             }
         }
@@ -119,24 +122,23 @@ QDate Machine::AddSession(Session *s,Profile *p)
     QMap<QDate,Day *>::iterator dit,nextday;
 
     bool combine_next_day=false;
-    int closest_session=0;
+    qint64 closest_session=0;
 
     if (time<split_time) {
         date=date.addDays(-1);
     } else if (combine_sessions > 0) {
+        // Gaps (in minutes) are measured from this sessions start, using the days interval index
         dit=day.find(date.addDays(-1)); // Check Day Before
         if (dit!=day.end()) {
-            QDateTime lt=QDateTime::fromTime_t(dit.value()->last()/1000);
-            closest_session=lt.secsTo(d2)/60;
-            if (closest_session<combine_sessions) {
+            closest_session=dit.value()->distance(s->first(),s->first())/60000L;
+            if ((closest_session >= 0) && (closest_session<combine_sessions)) {
                 date=date.addDays(-1);
             }
         } else {
             nextday=day.find(date.addDays(1));// Check Day Afterwards
             if (nextday!=day.end()) {
-                QDateTime lt=QDateTime::fromTime_t(nextday.value()->first()/1000);
-                closest_session=d2.secsTo(lt)/60;
-                if (closest_session < combine_sessions) {
+                closest_session=nextday.value()->distance(s->first(),s->first())/60000L;
+                if ((closest_session >= 0) && (closest_session < combine_sessions)) {
                     // add todays here. pull all tomorrows records to this date.
                     combine_next_day=true;
                 }
@@ -230,6 +232,12 @@ bool Machine::Purge(int secret)
         } else could_not_kill++;
 
     }
+    // Without its sessions, the import index would only stop them coming back
+    dir.remove(path+"/"+ImportIndexFile);
+
+    // Nor should their nights go on shaping the leak baselines of whatever gets imported next
+    purgeMaskLeakHistory(m_id);
+
     if (could_not_kill>0) {
       //  qWarning() << "Could not purge path\n" << path << "\n\n" << could_not_kill << " file(s) remain.. Suggest manually deleting this path\n";
     //    return false;
@@ -300,113 +308,237 @@ bool Machine::Load()
     if (qprogress) qprogress->setValue(100);
     return true;
 }
+bool Machine::RemoveSession(SessionID session)
+{
+    QHash<SessionID,Session *>::iterator it=sessionlist.find(session);
+    if (it==sessionlist.end())
+        return false;
+
+    Session * sess=it.value();
+    sessionlist.erase(it);
+
+    QString path=dataPath()+"/"+QString().sprintf("%08lx",session);
+    qDebug() << "Removing" << path+".000" << "and" << path+".001";
+    QFile::remove(path+".000");
+    QFile::remove(path+".001");
+
+    Day * d=sess->day();
+    if (d) {
+        d->removeSession(sess);
+        if (d->size()==0) {
+            for (QMap<QDate,Day *>::iterator dit=day.begin();dit!=day.end();dit++) {
+                if (dit.value()!=d) continue;
+                profile->daylist[dit.key()].removeAll(d);
+                day.erase(dit);
+                break;
+            }
+            delete d;
+        }
+    }
+    removeMaskLeakHistory(m_id,session);
+    delete sess;
+    return true;
+}
+
+QString Machine::dataPath()
+{
+    return profile->Get(properties[STR_PROP_Path]); //STR_GEN_DataFolder)+"/"+m_class+"_"+hexid();
+}
+
 bool Machine::SaveSession(Session *sess)
 {
-    QString path=profile->Get(properties[STR_PROP_Path]); //STR_GEN_DataFolder)+"/"+m_class+"_"+hexid();
-    if (sess->IsChanged()) sess->Store(path);
+    if (sess->IsChanged()) sess->Store(dataPath());
     return true;
 }
 
 bool Machine::Save()
 {
-    //int size;
-    int cnt=0;
-
-    QString path=profile->Get(properties[STR_PROP_Path]); //STR_GEN_DataFolder)+"/"+m_class+"_"+hexid();
+    QString path=dataPath();
     QDir dir(path);
     if (!dir.exists()) {
         dir.mkdir(path);
     }
 
+    SessionPipeline pipeline;
     QHash<SessionID,Session *>::iterator s;
-
-    m_savelist.clear();
     for (s=sessionlist.begin(); s!=sessionlist.end(); s++) {
-        cnt++;
         if ((*s)->IsChanged()) {
-            m_savelist.push_back(*s);
+            pipeline.add(*s);
         }
     }
-    savelistCnt=0;
-    savelistSize=m_savelist.size();
-    bool cachesessions=PROFILE.session->cacheSessions();
-    if (!PROFILE.session->multithreading()) {
-        for (int i=0;i<savelistSize;i++) {
-            if ((i % 10) ==0) {
-                qprogress->setValue(0+(float(savelistCnt)/float(savelistSize)*100.0));
-                QApplication::processEvents();
-            }
-            Session *s=m_savelist.at(i);
-            s->UpdateSummaries();
-            s->Store(path);
-            if (!cachesessions)
-                s->TrashEvents();
-            savelistCnt++;
+    pipeline.setTrashMode(PROFILE.session->cacheSessions() ? SessionPipeline::KeepEvents : SessionPipeline::TrashAll);
+    pipeline.run(qprogress, PROFILE.session->multithreading());
+    return true;
+}
 
-        }
-        return true;
-    }
-    int threads=QThread::idealThreadCount();
-    savelistSem=new QSemaphore(threads);
-    savelistSem->acquire(threads);
-    QVector<SaveThread*>thread;
-    for (int i=0;i<threads;i++) {
-        thread.push_back(new SaveThread(this,path));
-        QObject::connect(thread[i],SIGNAL(UpdateProgress(int)),qprogress,SLOT(setValue(int)));
-        thread[i]->start();
+//////////////////////////////////////////////////////////////////////////////////////////
+// SessionPipeline implmementation
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*! \class SessionTask
+    \brief A single Sessions worth of SessionPipeline work, run on a QThreadPool thread
+    */
+class SessionTask:public QRunnable
+{
+public:
+    SessionTask(SessionPipeline * pipeline, const SessionPipeline::Task & task, SessionPipeline::Pass pass)
+        :m_pipeline(pipeline),m_task(task),m_pass(pass) {}
+    virtual void run() {
+        CalcSettings::setLocal(*m_pipeline->m_settings);
+        if (m_pass==SessionPipeline::LeakHistoryPass)
+            m_pipeline->recordLeaks(m_task);
+        else m_pipeline->process(m_task);
+        CalcSettings::clearLocal();
+        m_pipeline->m_finished.release(1);
     }
-    while (!savelistSem->tryAcquire(threads,250)) {
-        if (qprogress) {
-        //    qprogress->setValue(66.0+(float(savelistCnt)/float(savelistSize)*33.0));
-           QApplication::processEvents();
-        }
+protected:
+    SessionPipeline * m_pipeline;
+    SessionPipeline::Task m_task;
+    SessionPipeline::Pass m_pass;
+};
+
+SessionPipeline::SessionPipeline()
+{
+    m_rewrite=false;
+    m_trash=KeepEvents;
+    m_settings=new CalcSettings(CalcSettings::current());
+}
+
+SessionPipeline::~SessionPipeline()
+{
+    delete m_settings;
+}
+
+void SessionPipeline::add(Session * sess, bool foreground)
+{
+    Machine * m=sess->machine();
+    QHash<Machine *, QString>::iterator i=m_paths.find(m);
+    if (i==m_paths.end()) {
+        i=m_paths.insert(m,m->dataPath());
     }
+    m_tasks.push_back(Task(sess,i.value(),!sess->eventsLoaded(),foreground));
+}
 
-    for (int i=0;i<threads;i++) {
-        while (thread[i]->isRunning()) {
-            SaveThread::msleep(250);
-            QApplication::processEvents();
-        }
-        delete thread[i];
+void SessionPipeline::process(const Task & task)
+{
+    Session * sess=task.session;
+
+    // Load the events if they aren't loaded already
+    sess->OpenEvents();
+
+    // Throw away the affected channels (and anything calculated from them),
+    // so UpdateSummaries only redoes what's needed
+    for (int c=0;c<m_invalidate.size();c++) {
+        sess->invalidateChannel(m_invalidate.at(c));
     }
+    if (m_rewrite)
+        sess->SetChanged(true);
 
-    delete savelistSem;
-    return true;
+    sess->UpdateSummaries();
+    if (sess->IsChanged())
+        sess->Store(task.path);
+
+    if ((m_trash==TrashAll) || ((m_trash==TrashOpened) && task.opened))
+        sess->TrashEvents();
 }
 
-/*SaveThread::SaveThread(Machine *m,QString p)
+void SessionPipeline::recordLeaks(const Task & task)
 {
-    machine=m;
-    path=p;
-} */
+    Session * sess=task.session;
+    if (!task.opened) {
+        recordMaskLeakHistory(sess);
+        return;
+    }
+
+    // Only the stored leak & pressure data is needed, so the derived channels OpenEvents would fill
+    // in are left for process(), which opens them again later, rather than holding every sessions
+    // events at once
+    if (sess->PeekEvents())
+        recordMaskLeakHistory(sess);
+    sess->TrashEvents();
+}
 
-void SaveThread::run()
+void SessionPipeline::runPass(const QList<Task> & tasks, Pass pass, QProgressBar * progress, bool multithreaded, int done, int total)
 {
-    bool cachesessions=PROFILE.session->cacheSessions();
-
-    while (Session *sess=machine->popSaveList()) {
-        int i=(float(machine->savelistCnt)/float(machine->savelistSize)*100.0);
-        emit UpdateProgress(i);
-        sess->UpdateSummaries();
-        sess->Store(path);
-        if (!cachesessions)
-            sess->TrashEvents();
+    int size=tasks.size();
+    if (!size) return;
+
+    QList<Task> local;
+    if (!multithreaded) {
+        local=tasks;
+    } else {
+        QThreadPool * pool=QThreadPool::globalInstance();
+        for (int i=0;i<size;i++) {
+            const Task & task=tasks.at(i);
+            if (task.foreground) local.push_back(task);
+            else pool->start(new SessionTask(this,task,pass));
+        }
+    }
+
+    // While workers are busy with the profiles sessions, user input is held back (run() has
+    // already disabled the window and stopped its graphs painting), but everything else is
+    // still processed so the window keeps drawing and answering the window manager.
+    QEventLoop::ProcessEventsFlags flags=(local.size()==size) ? QEventLoop::AllEvents : QEventLoop::ExcludeUserInputEvents;
+
+    CalcSettings::setLocal(*m_settings);
+    for (int i=0;i<local.size();i++) {
+        if (progress && ((i % 10) ==0)) {
+            progress->setValue(float(done+i+m_finished.available())/float(total)*100.0);
+            QApplication::processEvents(flags);
+        }
+        if (pass==LeakHistoryPass)
+            recordLeaks(local.at(i));
+        else process(local.at(i));
+    }
+    CalcSettings::clearLocal();
+    m_finished.release(local.size());
+
+    // Every task releases once, so this only succeeds when they're all done
+    while (!m_finished.tryAcquire(size,100)) {
+        if (progress) progress->setValue(float(done+m_finished.available())/float(total)*100.0);
+        QApplication::processEvents(flags);
     }
-    machine->savelistSem->release(1);
 }
 
-Session *Machine::popSaveList()
+void SessionPipeline::run(QProgressBar * progress, bool multithreaded)
 {
-
-    Session *sess=NULL;
-    savelistMutex.lock();
-    if (m_savelist.size()>0) {
-        sess=m_savelist.at(0);
-        m_savelist.pop_front();
-        savelistCnt++;
+    int size=m_tasks.size();
+    if (!size) return;
+
+    // Nights the history hasn't got, or that were just (re)imported, go in before any baselines are worked out
+    QList<Task> leaks;
+    CalcSettings::setLocal(*m_settings);
+    for (int i=0;i<size;i++) {
+        Session * sess=m_tasks.at(i).session;
+        if (sess->machine()->GetType()!=MT_CPAP)
+            continue;
+        if (!hasMaskLeakHistory(sess) || (sess->IsChanged() && sess->eventsLoaded()))
+            leaks.push_back(m_tasks.at(i));
     }
-    savelistMutex.unlock();
-    return sess;
+    CalcSettings::clearLocal();
+
+    // Keep the sessions out of reach while workers have them: the window takes no input, and
+    // its central widget, where the graphs and summaries live, doesn't paint until they're stored.
+    QWidget * window=(progress && multithreaded) ? progress->window() : NULL;
+    QMainWindow * mainwindow=qobject_cast<QMainWindow *>(window);
+    QWidget * central=mainwindow ? mainwindow->centralWidget() : NULL;
+    bool enabled=window && window->isEnabled();
+    bool updates=central && central->updatesEnabled();
+    if (enabled) window->setEnabled(false);
+    if (updates) central->setUpdatesEnabled(false);
+
+    int total=leaks.size()+size;
+    runPass(leaks,LeakHistoryPass,progress,multithreaded,0,total);
+    runPass(m_tasks,ProcessPass,progress,multithreaded,leaks.size(),total);
+
+    if (updates) central->setUpdatesEnabled(true);
+    if (enabled) window->setEnabled(true);
+
+    if (progress) progress->setValue(100);
+    m_tasks.clear();
+
+    // The mask leak history may have had nights added
+    saveMaskLeakHistory();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
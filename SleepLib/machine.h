@@ -14,6 +14,7 @@
 #include <QThread>
 #include <QMutex>
 #include <QSemaphore>
+#include <QRunnable>
 
 #include <QHash>
 #include <QVector>
@@ -33,29 +34,97 @@ class Session;
 class Profile;
 class Machine;
 
-/*! \class SaveThread
-    \brief This class is used in the multithreaded save code.. It accelerates the indexing of summary data.
+struct CalcSettings;
+class QProgressBar;
+
+/*! \class SessionPipeline
+    \brief Recalculates and stores Sessions in parallel, one QThreadPool task per Session
+
+    Sessions share no data with each other, so each task opens its sessions events if needed,
+    throws away any channels asked for, runs UpdateSummaries and stores the result, without
+    locking anything. The preferences are snapshotted when the pipeline is created and handed
+    to every worker, and Machine paths are looked up as sessions are queued, so workers never
+    read the profile. The GUI thread waits in run(), updating progress as tasks finish and
+    keeping the event loop going. While workers are running the progress bars window is
+    disabled, user input isn't processed and the windows central widget doesn't paint, so
+    nothing can draw or open their sessions until the lot are stored.
+
+    CPAP sessions new to the mask leak history get their nights recorded in a first pass, so
+    each leak baseline sees the same earlier nights whatever order the workers get to them.
     */
-class SaveThread:public QThread
+class SessionPipeline
 {
-    Q_OBJECT
 public:
-    SaveThread(Machine *m,QString p) { machine=m; path=p; }
+    SessionPipeline();
+    ~SessionPipeline();
+
+    //! \brief What happens to each sessions event data once it's been stored
+    enum TrashMode { KeepEvents=0, TrashOpened, TrashAll };
+
+    //! \brief Channels to throw away in each session (see Session::invalidateChannel) before recalculating
+    void setInvalidate(const QList<ChannelID> & channels) { m_invalidate=channels; }
+
+    //! \brief Forces each session to be completely rewritten, events included
+    void setRewrite(bool b) { m_rewrite=b; }
+
+    //! \brief Sets whether to free event data afterwards (TrashOpened only frees what the task loaded itself)
+    void setTrashMode(TrashMode mode) { m_trash=mode; }
+
+    /*! \brief Queues sess for processing
+        \param foreground Process it on the thread calling run() instead, for sessions the GUI has open */
+    void add(Session * sess, bool foreground=false);
 
-    //! \brief Static millisecond sleep function.. Can be used from anywhere
-    static void msleep(unsigned long msecs) { QThread::msleep(msecs); }
+    //! \brief Number of sessions queued
+    int size() { return m_tasks.size(); }
+
+    //! \brief Processes all queued sessions, returning once they're all stored
+    void run(QProgressBar * progress=NULL, bool multithreaded=true);
 
-    //! \brief Start Save processing thread running
-    virtual void run();
 protected:
-    Machine *machine;
-    QString path;
-signals:
-    //! \brief Signal sent to update the Progress Bar
-    void UpdateProgress(int i);
+    struct Task {
+        Task() { session=NULL; opened=false; foreground=false; }
+        Task(Session * _session, QString _path, bool _opened, bool _foreground) {
+            session=_session;
+            path=_path;
+            opened=_opened;
+            foreground=_foreground;
+        }
+        Task(const Task & copy) {
+            session=copy.session;
+            path=copy.path;
+            opened=copy.opened;
+            foreground=copy.foreground;
+        }
+
+        Session * session;
+        QString path;
+        //! \brief Events weren't loaded when queued
+        bool opened;
+        bool foreground;
+    };
+    friend class SessionTask;
+
+    //! \brief Which part of the work a SessionTask does
+    enum Pass { LeakHistoryPass=0, ProcessPass };
+
+    //! \brief Does the work for one session. Safe to call from any thread
+    void process(const Task & task);
+
+    //! \brief Records one sessions night in the mask leak history. Safe to call from any thread
+    void recordLeaks(const Task & task);
+
+    //! \brief Runs pass over tasks, with done of total already finished for the progress bar
+    void runPass(const QList<Task> & tasks, Pass pass, QProgressBar * progress, bool multithreaded, int done, int total);
+
+    QList<Task> m_tasks;
+    QHash<Machine *, QString> m_paths;
+    QList<ChannelID> m_invalidate;
+    bool m_rewrite;
+    TrashMode m_trash;
+    CalcSettings * m_settings;
+    QSemaphore m_finished;
 };
 
-
 /*! \class Machine
     \brief This Machine class is the Heart of SleepyLib, representing a single Machine and holding it's data
 
@@ -79,6 +148,9 @@ public:
     //! \brief Save individual session
     bool SaveSession(Session *sess);
 
+    //! \brief Returns the folder this machines sessions are stored in
+    QString dataPath();
+
     //! \brief Deletes the crud out of all machine data in the SleepLib database
     bool Purge(int secret);
 
@@ -97,6 +169,10 @@ public:
     //! \brief Adds the session to this machine object, and the Master Profile list. (used during load)
     QDate AddSession(Session *s,Profile *p);
 
+    /*! \brief Deletes session and its stored files, taking it off its Day (and the Day too if that leaves
+        it empty) and out of the mask leak history, so it can be imported again. Returns false if it isn't here */
+    bool RemoveSession(SessionID session);
+
     //! \brief Find the date this session belongs in, according to profile settings
     QDate pickDate(qint64 start);
 
@@ -128,17 +204,6 @@ public:
     //! \brief Returns the date of the most recent loaded Session
     const QDate & LastDay() { return lastday; }
 
-    //! \brief Grab the next task in the multithreaded save code
-    Session *popSaveList();
-
-    //! \brief The list of sessions that need saving (for multithreaded save code)
-    QList<Session *> m_savelist;
-
-    volatile int savelistCnt;
-    int savelistSize;
-    QMutex savelistMutex;
-    QSemaphore *savelistSem;
-
 protected:
     QDate firstday,lastday;
     SessionID highest_sessionid;
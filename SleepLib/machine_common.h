@@ -30,6 +30,9 @@ class OldDBVersion {};
 
 const quint32 magic=0xC73216AB; // Magic number for Sleepyhead Data Files.. Don't touch!
 
+//! \brief Name of the ImportIndex file kept in each machines data folder
+const QString ImportIndexFile="Import.idx";
+
 //const int max_number_event_fields=10;
 // This should probably move somewhere else
 //! \fn timezoneOffset();
@@ -6,9 +6,15 @@
 
 #include <QFile>
 #include <QDir>
+#include <QRunnable>
+#include <QDataStream>
+#include <QDateTime>
+#include <QStatusBar>
 
 #include "machine_loader.h"
 
+extern QStatusBar *qstatusbar;
+
 // This crap moves to Profile
 QList<MachineLoader *> m_loaders;
 
@@ -45,6 +51,9 @@ MachineLoader::~MachineLoader()
     }
 }
 
+// Size of the chunks files are streamed through while being backed up
+const int backup_chunk_size=65536;
+
 bool MachineLoader::compressFile(QString inpath, QString outpath)
 {
     if (outpath.isEmpty())
@@ -58,31 +67,319 @@ bool MachineLoader::compressFile(QString inpath, QString outpath)
         qDebug() << "compressFile()" << inpath << "does not exist";
         return false;
     }
-    qint64 size=f.size();
     if (!f.open(QFile::ReadOnly)) {
         qDebug() << "compressFile() Couldn't open" << inpath;
         return false;
     }
-    char * buf=new char [size];
-    if (!f.read(buf,size)) {
-        delete buf;
-        qDebug() << "compressFile() Couldn't read all of" << inpath;
-        return false;
-    }
-    f.close();
     gzFile gz=gzopen(outpath.toAscii(),"wb");
     //gzbuffer(gz,65536*2);
     if (!gz) {
         qDebug() << "compressFile() Couldn't open" << outpath <<"for writing";
-        delete buf;
         return false;
     }
-    gzwrite(gz,buf,size);
+
+    char * buf=new char [backup_chunk_size];
+    bool ok=true;
+    qint64 cnt;
+    while ((cnt=f.read(buf,backup_chunk_size))>0) {
+        if (gzwrite(gz,buf,cnt)!=cnt) {
+            ok=false;
+            break;
+        }
+    }
+    if (cnt<0) ok=false;
+    if (gzclose(gz)!=Z_OK) ok=false;
+    delete [] buf;
+
+    if (!ok) {
+        qDebug() << "compressFile() Couldn't compress all of" << inpath;
+        QFile::remove(outpath);
+    }
+    return ok;
+}
+
+// Streams path's contents through crc32. gzread passes plain files through untouched,
+// so a compressed backup hashes the same as the file it was made from.
+static bool contentHash(const QString & path, quint32 & crc, qint64 & size)
+{
+    gzFile gz=gzopen(path.toAscii(),"rb");
+    if (!gz) return false;
+
+    char * buf=new char [backup_chunk_size];
+    uLong c=crc32(0L,Z_NULL,0);
+    int cnt;
+    size=0;
+    while ((cnt=gzread(gz,buf,backup_chunk_size))>0) {
+        c=crc32(c,(const Bytef *)buf,cnt);
+        size+=cnt;
+    }
     gzclose(gz);
-    delete buf;
+    delete [] buf;
+
+    crc=c;
+    return cnt==0;
+}
+
+enum BackupResult { BR_Copied, BR_Unchanged, BR_Failed };
+
+/*! \class BackupTask
+    \brief Backs up a single file for a BackupQueue, on its thread pool
+    */
+class BackupTask:public QRunnable
+{
+public:
+    BackupTask(BackupQueue * queue, const QString & inpath, const QString & outpath, bool compress)
+        :m_queue(queue),m_inpath(inpath),m_outpath(outpath),m_compress(compress) {}
+    virtual void run() {
+        m_queue->backup(m_inpath,m_outpath,m_compress);
+    }
+protected:
+    BackupQueue * m_queue;
+    QString m_inpath;
+    QString m_outpath;
+    bool m_compress;
+};
+
+BackupQueue::BackupQueue()
+{
+    m_threaded=true;
+    m_batch=false;
+    m_pending=m_copied=m_unchanged=m_failed=0;
+    // Mostly disk bound, so there's nothing to gain from more
+    m_pool.setMaxThreadCount(2);
+}
+BackupQueue::~BackupQueue()
+{
+    wait();
+}
+
+void BackupQueue::begin()
+{
+    QMutexLocker lock(&m_mutex);
+    m_batch=true;
+}
+
+void BackupQueue::end()
+{
+    QMutexLocker lock(&m_mutex);
+    m_batch=false;
+    if (m_pending==0)
+        report();
+}
+
+void BackupQueue::add(QString inpath, QString outpath, bool compress)
+{
+    m_mutex.lock();
+    m_pending++;
+    m_mutex.unlock();
+
+    if (m_threaded) {
+        m_pool.start(new BackupTask(this,inpath,outpath,compress));
+    } else {
+        backup(inpath,outpath,compress);
+    }
+}
+
+void BackupQueue::wait()
+{
+    m_pool.waitForDone();
+}
+
+bool BackupQueue::finished()
+{
+    QMutexLocker lock(&m_mutex);
+    return m_pending==0;
+}
+
+void BackupQueue::backup(const QString & inpath, const QString & outpath, bool compress)
+{
+    // Sources that are already gzipped arrive with outpath ending in .gz, so the other form
+    // is worked out from the target's own name rather than what compress says
+    QString target=compress ? outpath+".gz" : outpath;
+    QString other=target.endsWith(".gz") ? target.left(target.length()-3) : target+".gz";
+
+    bool has_target=QFile::exists(target);
+    bool has_other=QFile::exists(other);
+
+    // Only hash when there's an existing backup it could match
+    if (has_target || has_other) {
+        quint32 crc,bcrc;
+        qint64 size,bsize;
+        if (!contentHash(inpath,crc,size)) {
+            qDebug() << "BackupQueue Couldn't read" << inpath;
+            done(BR_Failed);
+            return;
+        }
+        if ((has_target && contentHash(target,bcrc,bsize) && (bcrc==crc) && (bsize==size))
+        || (has_other && contentHash(other,bcrc,bsize) && (bcrc==crc) && (bsize==size))) {
+            done(BR_Unchanged);
+            return;
+        }
+        if (has_target) QFile::remove(target);
+    }
+
+    bool ok=compress ? MachineLoader::compressFile(inpath,target) : QFile::copy(inpath,target);
+    if (!ok) {
+        qDebug() << "BackupQueue Couldn't back up" << inpath << "to" << target;
+        done(BR_Failed);
+        return;
+    }
+    // Don't leave a stale copy in the other format lying about
+    if (has_other) QFile::remove(other);
+    done(BR_Copied);
+}
+
+void BackupQueue::done(int result)
+{
+    QMutexLocker lock(&m_mutex);
+    if (result==BR_Copied) m_copied++;
+    else if (result==BR_Unchanged) m_unchanged++;
+    else m_failed++;
+
+    if ((--m_pending==0) && !m_batch)
+        report();
+}
+
+void BackupQueue::report()
+{
+    if (m_copied+m_unchanged+m_failed==0)
+        return;
+
+    QString msg=QObject::tr("Backup finished: %1 files copied, %2 unchanged, %3 failed")
+            .arg(m_copied).arg(m_unchanged).arg(m_failed);
+    qDebug() << msg;
+
+    // Usually on a worker thread, so the status bar gets told through its event queue
+    if (qstatusbar)
+        QMetaObject::invokeMethod(qstatusbar,"showMessage",Qt::QueuedConnection,Q_ARG(QString,msg),Q_ARG(int,10000));
+    m_copied=m_unchanged=m_failed=0;
+}
+
+const quint16 import_index_version=1;
+
+// How much of each end of a file ImportIndex hashes
+const int import_hash_size=4096;
+
+// Hashes the size and the first & last few KB, which is where anything appended or rewritten shows up
+static quint32 importHash(const QFileInfo & fi)
+{
+    QFile f(fi.filePath());
+    if (!f.open(QFile::ReadOnly))
+        return 0;
+
+    qint64 size=f.size();
+    uLong crc=crc32(0L,(const Bytef *)&size,sizeof(size));
+
+    char buf[import_hash_size];
+    qint64 cnt=f.read(buf,import_hash_size);
+    if (cnt>0) crc=crc32(crc,(const Bytef *)buf,cnt);
+    if (size>import_hash_size) {
+        f.seek(qMax(qint64(import_hash_size),size-import_hash_size));
+        cnt=f.read(buf,import_hash_size);
+        if (cnt>0) crc=crc32(crc,(const Bytef *)buf,cnt);
+    }
+    return crc;
+}
+
+ImportIndex::ImportIndex()
+{
+    m_changed=false;
+}
+
+void ImportIndex::load(Machine * m)
+{
+    m_files.clear();
+    m_changed=false;
+    m_filename=m->dataPath()+"/"+ImportIndexFile;
+
+    QFile f(m_filename);
+    if (!f.open(QFile::ReadOnly))
+        return;
+
+    QDataStream in(&f);
+    in.setVersion(QDataStream::Qt_4_6);
+    in.setByteOrder(QDataStream::LittleEndian);
+
+    quint32 mag32,count,session;
+    quint16 version;
+    in >> mag32;
+    in >> version;
+    if ((mag32!=magic) || (version!=import_index_version)) {
+        qDebug() << "Import index" << m_filename << "is out of date, starting afresh";
+        return;
+    }
+    in >> count;
+
+    QString path;
+    Record rec;
+    for (quint32 i=0;(i<count) && (in.status()==QDataStream::Ok);i++) {
+        in >> path;
+        in >> rec.size;
+        in >> rec.modified;
+        in >> rec.hash;
+        in >> session;
+        rec.session=session;
+        if (in.status()==QDataStream::Ok)
+            m_files[path]=rec;
+    }
+}
+
+void ImportIndex::save()
+{
+    if (!m_changed || m_filename.isEmpty())
+        return;
+
+    QFile f(m_filename);
+    if (!f.open(QFile::WriteOnly)) {
+        qWarning() << "Couldn't write import index" << m_filename;
+        return;
+    }
+    QDataStream out(&f);
+    out.setVersion(QDataStream::Qt_4_6);
+    out.setByteOrder(QDataStream::LittleEndian);
+
+    out << (quint32)magic;
+    out << (quint16)import_index_version;
+    out << (quint32)m_files.size();
+    for (QHash<QString,Record>::iterator i=m_files.begin();i!=m_files.end();i++) {
+        out << i.key();
+        out << i.value().size;
+        out << i.value().modified;
+        out << i.value().hash;
+        out << (quint32)i.value().session;
+    }
+    f.close();
+    m_changed=false;
+}
+
+bool ImportIndex::unchanged(const QString & relpath, const QFileInfo & fi, SessionID * session)
+{
+    QHash<QString,Record>::iterator i=m_files.find(relpath);
+    if (i==m_files.end())
+        return false;
+
+    Record & rec=i.value();
+    if (rec.size!=fi.size())
+        return false;
+
+    quint32 modified=fi.lastModified().toTime_t();
+    if (rec.modified!=modified) {
+        // Same size, different time.. only a look at the contents will tell
+        if (importHash(fi)!=rec.hash)
+            return false;
+        rec.modified=modified;
+        m_changed=true;
+    }
+    if (session) *session=rec.session;
     return true;
 }
 
+void ImportIndex::add(const QString & relpath, const QFileInfo & fi, SessionID session)
+{
+    m_files[relpath]=Record(fi.size(),fi.lastModified().toTime_t(),importHash(fi),session);
+    m_changed=true;
+}
+
 /*const QString machine_profile_name="MachineList.xml";
 
 void MachineLoader::LoadMachineList()
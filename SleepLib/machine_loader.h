@@ -9,6 +9,9 @@ License: GPL
 
 #ifndef MACHINE_LOADER_H
 #define MACHINE_LOADER_H
+#include <QMutex>
+#include <QThreadPool>
+#include <QFileInfo>
 #include "profiles.h"
 #include "machine.h"
 
@@ -20,6 +23,116 @@ License: GPL
 #include "zlib.h"
 #endif
 
+/*! \class BackupQueue
+    \brief Copies imported files to a backup folder in the background, off the import's critical path
+
+    Files are streamed through in fixed size chunks, and gzip compressed on the way if asked.
+    A file whose existing backup (compressed or not) already has the same contents is left alone.
+    Backups are added in batches, between begin() and end(), and the status bar is told how the
+    batch went once it has ended and the queue has run dry.
+    */
+class BackupQueue
+{
+public:
+    BackupQueue();
+
+    //! \brief Waits for anything still queued before going away
+    ~BackupQueue();
+
+    //! \brief Starts a batch of backups, which isn't reported until end() has been called
+    void begin();
+
+    //! \brief Ends the batch, reporting it now if all its backups are already done
+    void end();
+
+    //! \brief Queues inpath to be backed up as outpath, or outpath+".gz" if compress is set
+    void add(QString inpath, QString outpath, bool compress=false);
+
+    //! \brief Run backups on worker threads (the default), or inline in add()
+    void setThreaded(bool b) { m_threaded=b; }
+
+    //! \brief Blocks until every queued backup is done
+    void wait();
+
+    //! \brief Returns true if no backups are queued or in progress
+    bool finished();
+
+protected:
+    friend class BackupTask;
+
+    //! \brief Does the actual backup work for one file, on whichever thread
+    void backup(const QString & inpath, const QString & outpath, bool compress);
+
+    //! \brief Counts a finished backup, reporting the batch if it has ended and the queue runs dry
+    void done(int result);
+
+    //! \brief Tells the status bar how the batch went. Expects m_mutex to be held
+    void report();
+
+    QThreadPool m_pool;
+    QMutex m_mutex;
+    bool m_threaded;
+    bool m_batch;
+    int m_pending;
+    int m_copied;
+    int m_unchanged;
+    int m_failed;
+};
+
+/*! \class ImportIndex
+    \brief Remembers which source files a machine has imported, so a re-import can tell what's new
+
+    Kept in the machines data folder. Files are matched by their path relative to the card,
+    their size & modification time, falling back to a hash of their first & last few KB
+    when only the time differs (as happens when a card is copied somewhere).
+    */
+class ImportIndex
+{
+public:
+    ImportIndex();
+
+    //! \brief Loads machine m's index, forgetting any previous one
+    void load(Machine * m);
+
+    //! \brief Writes the index back to the machines data folder, if anything changed
+    void save();
+
+    //! \brief Returns true if relpath was imported before, and is still the same file
+    //! \param session Set to the SessionID it was imported into, or 0 if it gave nothing worth keeping
+    bool unchanged(const QString & relpath, const QFileInfo & fi, SessionID * session=NULL);
+
+    //! \brief Returns true if relpath has been imported before, changed or not
+    bool contains(const QString & relpath) { return m_files.contains(relpath); }
+
+    //! \brief Records relpath as imported into session (0 for none) as it stands now
+    void add(const QString & relpath, const QFileInfo & fi, SessionID session);
+
+protected:
+    struct Record {
+        Record() { size=0; modified=0; hash=0; session=0; }
+        Record(qint64 _size, quint32 _modified, quint32 _hash, SessionID _session) {
+            size=_size;
+            modified=_modified;
+            hash=_hash;
+            session=_session;
+        }
+        Record(const Record & copy) {
+            size=copy.size;
+            modified=copy.modified;
+            hash=copy.hash;
+            session=copy.session;
+        }
+        qint64 size;
+        quint32 modified;
+        quint32 hash;
+        SessionID session;
+    };
+
+    QHash<QString,Record> m_files;
+    QString m_filename;
+    bool m_changed;
+};
+
 /*! \class MachineLoader
     \brief Base class to derive a new Machine importer from
     */
@@ -41,7 +154,8 @@ public:
     //! \brief Override to returns the class name of this MachineLoader
     virtual const QString & ClassName()=0;
 
-    bool compressFile(QString inpath, QString outpath="");
+    //! \brief gzip compresses inpath to outpath (inpath+".gz" if none given), a chunk at a time
+    static bool compressFile(QString inpath, QString outpath="");
 
 
  /*
@@ -70,6 +184,9 @@ protected:
     QString m_class;
     MachineType m_type;
     Profile * m_profile;
+
+    //! \brief Backs up SD card data in the background while the import carries on
+    BackupQueue m_backups;
 };
 
 // Put in machine loader class as static??
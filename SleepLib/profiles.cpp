@@ -389,20 +389,8 @@ void Profile::RemoveSession(Session * sess)
         for (int d=0;d<di.value().size();d++) {
             Day *day=di.value()[d];
 
-            int i=day->getSessions().indexOf(sess);
-            if (i>=0) {
-                for (;i<day->getSessions().size()-1;i++) {
-                    day->getSessions()[i]=day->getSessions()[i+1];
-                }
-                day->getSessions().pop_back();
-                qint64 first=0,last=0;
-                for (int i=0;i<day->getSessions().size();i++) {
-                    Session & sess=*day->getSessions()[i];
-                    if (!first || first>sess.first()) first=sess.first();
-                    if (!last || last<sess.last()) last=sess.last();
-                }
-                // day->setFirst(first);
-                // day->setLast(last);
+            if (day->getSessions().contains(sess)) {
+                day->removeSession(sess);
                 return;
             }
         }
@@ -24,7 +24,7 @@ const quint16 filetype_data=1;
 
 // This is the uber important database version for SleepyHeads internal storage
 // Increment this after stuffing with Session's save & load code.
-const quint16 summary_version=11;
+const quint16 summary_version=12;
 const quint16 events_version=10;
 
 Session::Session(Machine * m,SessionID session)
@@ -33,8 +33,11 @@ Session::Session(Machine * m,SessionID session)
         session=m->CreateSessionID();
     }
     s_machine=m;
+    s_day=NULL;
     s_session=session;
     s_changed=false;
+    s_events_changed=false;
+    s_summaries_valid=false;
     s_events_loaded=false;
     _first_session=true;
     s_enabled=-1;
@@ -78,12 +81,30 @@ bool Session::OpenEvents() {
             qWarning() << "Error Unpacking Events" << s_eventfile;
             return false;
         }
+
+        // Fill in derived channels left until now, or made with different preferences. Opening is
+        // a read, so they're only flagged for storing, which the next Machine::Save pipeline does
+        if (updateDerivedChannels(this,true)>0) {
+            UpdateSummaries();
+            SetChanged(true);
+        }
     }
 
 
     return s_events_loaded=true;
 }
 
+bool Session::PeekEvents() {
+    if (s_events_loaded || (eventlist.size() > 0))
+        return true;
+
+    if (!LoadEvents(s_eventfile)) {
+        qWarning() << "Error Unpacking Events" << s_eventfile;
+        return false;
+    }
+    return true;
+}
+
 bool Session::Store(QString path)
 // Storing Session Data in our format
 // {DataDir}/{MachineID}/{SessionID}.{ext}
@@ -100,13 +121,17 @@ bool Session::Store(QString path)
     a=StoreSummary(base+".000"); // if actually has events
     //qDebug() << " Summary done";
     if (eventlist.size()>0) {
-        s_eventfile=base+".001";
-        StoreEvents(s_eventfile);
+        // Summary only changes (like enabling/disabling) don't need the events rewritten
+        if (s_events_changed || s_eventfile.isEmpty()) {
+            s_eventfile=base+".001";
+            StoreEvents(s_eventfile);
+        }
     } else { // who cares..
         //qDebug() << "Trying to save empty events file";
     }
     //qDebug() << " Events done";
     s_changed=false;
+    s_events_changed=false;
     s_events_loaded=true;
 
         //TrashEvents();
@@ -152,6 +177,7 @@ bool Session::StoreSummary(QString filename)
     out << m_valuesummary;
     out << m_timesummary;
     out << m_gain;
+    out << m_derived;
 
     file.close();
     return true;
@@ -317,10 +343,15 @@ bool Session::LoadSummary(QString filename)
                 in >> m_gain;
             }
         }
+        if (version >= 12) {
+            in >> m_derived;
+        }
 
 
     }
 
+    s_summaries_valid=true;
+
     // not really a good idea to do this... should flag and do a reindex
     if (version < summary_version) {
 
@@ -353,7 +384,7 @@ bool Session::StoreEvents(QString filename)
 
     quint16 compress=0;
 
-    if (p_profile->session->compressSessionData())
+    if (CalcSettings::current().compressSessionData)
         compress=compress_method;
 
     header << (quint16)compress;
@@ -574,10 +605,11 @@ bool Session::LoadEvents(QString filename)
             if (version>=7) // version 7 added this field
                 in >> second_field;
 
-            EventList *elist=AddEventList(code,elt,gain,offset,mn,mx,rate,second_field);
+            // Not using AddEventList, as that would flag the channel as changed
+            EventList *elist=new EventList(elt,gain,offset,mn,mx,rate,second_field);
             elist->setDimension(dim);
 
-            //eventlist[code].push_back(elist);
+            eventlist[code].push_back(elist);
             elist->m_count=evcount;
             elist->m_first=ts1;
             elist->m_last=ts2;
@@ -652,7 +684,15 @@ void Session::destroyEvent(ChannelID code)
             delete it.value()[i];
         }
         eventlist.erase(it);
+        s_events_changed=true;
     }
+    m_derived.remove(code);
+    clearSummary(code);
+    // does not trash settings..
+}
+
+void Session::clearSummary(ChannelID code)
+{
     m_gain.erase(m_gain.find(code));
     m_firstchan.erase(m_firstchan.find(code));
     m_lastchan.erase(m_lastchan.find(code));
@@ -666,118 +706,111 @@ void Session::destroyEvent(ChannelID code)
     m_cnt.erase(m_cnt.find(code));
     m_valuesummary.erase(m_valuesummary.find(code));
     m_timesummary.erase(m_timesummary.find(code));
-    // does not trash settings..
 }
 
-void Session::updateCountSummary(ChannelID code)
+void Session::invalidateChannel(ChannelID code)
 {
-    QHash<ChannelID,QVector<EventList *> >::iterator ev=eventlist.find(code);
-    if (ev==eventlist.end()) return;
-
-    QHash<ChannelID,QHash<EventStoreType, EventStoreType> >::iterator vs=m_valuesummary.find(code);
-    if (vs!=m_valuesummary.end()) // already calculated?
-        return;
+    QList<ChannelID> pending;
+    QSet<ChannelID> seen;
+    ChannelID c;
+
+    pending.push_back(code);
+    while (!pending.isEmpty()) {
+        c=pending.takeFirst();
+        if (seen.contains(c)) continue;
+        seen.insert(c);
+
+        const DerivedChannel * dc=findDerivedChannel(c);
+        if (dc && (!dc->supplied || m_derived.contains(c))) {
+            // UpdateSummaries will calculate it again
+            destroyEvent(c);
+        } else {
+            clearSummary(c);
+        }
+        s_dirty.insert(c);
 
-    QHash<EventStoreType, EventStoreType> valsum;
-    QHash<EventStoreType, quint32> timesum;
+        pending.append(derivedChannels(c));
+    }
+    // The events file only needs rewriting if destroyEvent actually threw some away
+    s_changed=true;
+}
 
-    EventDataType raw,lastraw=0;
-    qint64 start,time,lasttime=0;
-    qint32 len,cnt;
-    quint32 * tptr;
-    EventStoreType * dptr, * eptr;
-    for (int i=0;i<ev.value().size();i++) {
-        EventList & e=*(ev.value()[i]);
-        start=e.first();
-        cnt=e.count();
-        dptr=e.rawData();
-        eptr=dptr+cnt;
+void Session::updateCountSummary(ChannelID code)
+{
+    if (m_valuesummary.contains(code)) // already calculated?
+        return;
 
-        EventDataType rate=0;
+    updateChannelSummary(code,true);
+}
 
-        m_gain[code]=e.gain();
+void Session::updateChannelSummary(ChannelID code, bool histograms)
+{
+    QHash<ChannelID,QVector<EventList *> >::iterator ev=eventlist.find(code);
+    if (ev==eventlist.end()) return;
 
-        if (e.type()==EVL_Event) {
-            lastraw=*dptr++;
-            tptr=e.rawTime();
-            lasttime=start + *tptr++;
-            // Event version
+    QVector<EventList *> & evec=ev.value();
+    if (evec.size()==0) return;
 
-            for (;dptr < eptr; dptr++) {
-                 time=start + *tptr++;
-                 raw=*dptr;
+    // Like the other caches, histograms are only generated when missing
+    if (histograms && m_valuesummary.contains(code))
+        histograms=false;
 
-                 valsum[raw]++;
+    // One streaming pass per EventList gathers everything below
+    SummaryKernel * kernel=SummaryKernel::local();
+    for (int i=0;i<evec.size();i++) {
+        kernel->add(evec[i],histograms);
+    }
 
-                 // elapsed time in seconds since last event occurred
-                 len=(time-lasttime) / 1000L;
+    m_gain[code]=kernel->gain();
 
-                 timesum[lastraw]+=len;
+    // Don't trample on values the loaders have already set
+    if (!m_cnt.contains(code)) m_cnt[code]=kernel->count();
+    if (!m_sum.contains(code)) m_sum[code]=kernel->sum();
+    if (!m_avg.contains(code)) m_avg[code]=kernel->avg();
+    if (!m_min.contains(code)) m_min[code]=kernel->Min();
+    if (!m_max.contains(code)) m_max[code]=kernel->Max();
+    if (!m_firstchan.contains(code)) m_firstchan[code]=kernel->first();
+    if (!m_lastchan.contains(code)) m_lastchan[code]=kernel->last();
 
-                 lastraw=raw;
-                 lasttime=time;
-            }
-        } else {
-            // Waveform version, first just count
-            for (;dptr < eptr; dptr++) {
-                raw=*dptr;
-                valsum[raw]++;
-            }
-
-            // Then process the list of values, time is simply (rate * count)
-            rate=e.rate();
-            EventDataType t;
-            for (QHash<EventStoreType, EventStoreType>::iterator it=valsum.begin(); it!=valsum.end(); it++) {
-                t=EventDataType(it.value())*rate;
-                timesum[it.key()]+=t;
-            }
-        }
+    if (histograms && kernel->hasHistogram()) {
+        kernel->valueSummary(m_valuesummary[code]);
+        kernel->timeSummary(m_timesummary[code]);
+        if (!m_wavg.contains(code)) m_wavg[code]=kernel->wavg();
     }
-    if (valsum.size()==0) return;
-
-    m_valuesummary[code]=valsum;
-    m_timesummary[code]=timesum;
 }
 
 void Session::UpdateSummaries()
 {
     ChannelID id;
     QHash<ChannelID,QVector<EventList *> >::iterator c;
-    calcAHIGraph(this);
-
-    // Calculates RespRate and related waveforms (Tv, MV, Te, Ti) if missing
-    calcRespRate(this);
+    // AHI graph, RespRate and related waveforms, leaks & oximetry flags, if missing or out of date.
+    // The lazy ones are left until the session gets opened.
+    updateDerivedChannels(this,false);
 
-    calcLeaks(this);
-    calcSPO2Drop(this);
-    calcPulseChange(this);
+    // Fresh sessions get everything calculated, otherwise only what changed since last time
+    bool full=!s_summaries_valid;
 
+    bool waveform;
     for (c=eventlist.begin();c!=eventlist.end();c++) {
         id=c.key();
+        if (!full && !s_dirty.contains(id) && m_cnt.contains(id))
+            continue;
+
         if (schema::channel[id].type()==schema::DATA) {
-            //sum(id); // avg calculates this and cnt.
-            if (c.value().size()>0) {
-                EventList * el=c.value()[0];
-                EventDataType gain=el->gain();
-                m_gain[id]=gain;
-            }
-            if (!((id==CPAP_FlowRate) || (id==CPAP_MaskPressureHi) || (id==CPAP_RespEvent) || (id==CPAP_MaskPressure)))
-                updateCountSummary(id);
-
-            Min(id);
-            Max(id);
-            count(id);
-            last(id);
-            first(id);
-            if (((id==CPAP_FlowRate) || (id==CPAP_MaskPressureHi) || (id==CPAP_RespEvent) || (id==CPAP_MaskPressure)))
+            // Value and time histograms are pointless for these
+            waveform=((id==CPAP_FlowRate) || (id==CPAP_MaskPressureHi) || (id==CPAP_RespEvent) || (id==CPAP_MaskPressure));
+
+            updateChannelSummary(id,!waveform);
+            if (waveform)
                 continue;
 
             cph(id);
             sph(id);
-            avg(id);
             wavg(id);
         }
     }
+    s_dirty.clear();
+    s_summaries_valid=true;
 }
 
 bool Session::SearchEvent(ChannelID code, qint64 time, qint64 dist)
@@ -830,7 +863,15 @@ bool Session::enabled()
 void Session::setEnabled(bool b)
 {
     settings[SESSION_ENABLED]=s_enabled=b;
-    SetChanged(true);
+    if (s_day) spanChanged();
+
+    // Only the summary needs saving
+    s_changed=true;
+}
+
+void Session::spanChanged()
+{
+    s_day->updateSession(this);
 }
 
 
@@ -840,29 +881,12 @@ EventDataType Session::Min(ChannelID id)
     if (i!=m_min.end())
         return i.value();
 
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end()) {
+    if (!eventlist.contains(id)) {
         m_min[id]=0;
         return 0;
     }
-    QVector<EventList *> & evec=j.value();
-
-    bool first=true;
-    EventDataType min=0,t1;
-    for (int i=0;i<evec.size();i++) {
-        if (evec[i]->count()==0)
-            continue;
-        t1=evec[i]->Min();
-        if (t1==0 && t1==evec[i]->Max()) continue;
-        if (first) {
-            min=t1;
-            first=false;
-        } else {
-            if (min>t1) min=t1;
-        }
-    }
-    m_min[id]=min;
-    return min;
+    updateChannelSummary(id,false);
+    return m_min[id];
 }
 EventDataType Session::Max(ChannelID id)
 {
@@ -870,94 +894,48 @@ EventDataType Session::Max(ChannelID id)
     if (i!=m_max.end())
         return i.value();
 
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end()) {
+    if (!eventlist.contains(id)) {
         m_max[id]=0;
         return 0;
     }
-    QVector<EventList *> & evec=j.value();
-
-    bool first=true;
-    EventDataType max=0,t1;
-    for (int i=0;i<evec.size();i++) {
-        if (evec[i]->count()==0) continue;
-        t1=evec[i]->Max();
-        if (t1==0 && t1==evec[i]->Min()) continue;
-        if (first) {
-            max=t1;
-            first=false;
-        } else {
-            if (max<t1) max=t1;
-        }
-    }
-    m_max[id]=max;
-    return max;
+    updateChannelSummary(id,false);
+    return m_max[id];
 }
 qint64 Session::first(ChannelID id)
 {
-    qint64 drift=qint64(PROFILE.cpap->clockDrift())*1000L;
+    qint64 drift=qint64(CalcSettings::currentClockDrift())*1000L;
     qint64 tmp;
     QHash<ChannelID,quint64>::iterator i=m_firstchan.find(id);
-    if (i!=m_firstchan.end()) {
-        tmp=i.value();
-        if (s_machine->GetType()==MT_CPAP)
-            tmp+=drift;
-        return tmp;
-    }
-
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end())
-        return 0;
-    QVector<EventList *> & evec=j.value();
-
-    bool first=true;
-    qint64 min=0,t1;
-    for (int i=0;i<evec.size();i++) {
-        t1=evec[i]->first();
-        if (first) {
-            min=t1;
-            first=false;
-        } else {
-            if (min>t1) min=t1;
-        }
-    }
-    m_firstchan[id]=min;
+    if (i==m_firstchan.end()) {
+        if (!eventlist.contains(id))
+            return 0;
+        updateChannelSummary(id,false);
+        i=m_firstchan.find(id);
+        if (i==m_firstchan.end())
+            return 0;
+    }
+    tmp=i.value();
     if (s_machine->GetType()==MT_CPAP)
-        min+=drift;
-    return min;
+        tmp+=drift;
+    return tmp;
 }
 qint64 Session::last(ChannelID id)
 {
-    qint64 drift=qint64(PROFILE.cpap->clockDrift())*1000L;
+    qint64 drift=qint64(CalcSettings::currentClockDrift())*1000L;
     qint64 tmp;
     QHash<ChannelID,quint64>::iterator i=m_lastchan.find(id);
-    if (i!=m_lastchan.end()) {
-        tmp=i.value();
-        if (s_machine->GetType()==MT_CPAP)
-            tmp+=drift;
-        return tmp;
-    }
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end())
-        return 0;
-    QVector<EventList *> & evec=j.value();
-
-    bool first=true;
-    qint64 max=0,t1;
-    for (int i=0;i<evec.size();i++) {
-        t1=evec[i]->last();
-        if (first) {
-            max=t1;
-            first=false;
-        } else {
-            if (max<t1) max=t1;
-        }
-    }
-
-    m_lastchan[id]=max;
+    if (i==m_lastchan.end()) {
+        if (!eventlist.contains(id))
+            return 0;
+        updateChannelSummary(id,false);
+        i=m_lastchan.find(id);
+        if (i==m_lastchan.end())
+            return 0;
+    }
+    tmp=i.value();
     if (s_machine->GetType()==MT_CPAP)
-        max+=drift;
-    return max;
+        tmp+=drift;
+    return tmp;
 }
 bool Session::channelDataExists(ChannelID id)
 {
@@ -1209,19 +1187,12 @@ int Session::count(ChannelID id)
     if (i!=m_cnt.end())
         return i.value();
 
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end()) {
+    if (!eventlist.contains(id)) {
         m_cnt[id]=0;
         return 0;
     }
-    QVector<EventList *> & evec=j.value();
-
-    int sum=0;
-    for (int i=0;i<evec.size();i++) {
-        sum+=evec[i]->count();
-    }
-    m_cnt[id]=sum;
-    return sum;
+    updateChannelSummary(id,false);
+    return m_cnt[id];
 }
 
 double Session::sum(ChannelID id)
@@ -1230,29 +1201,12 @@ double Session::sum(ChannelID id)
     if (i!=m_sum.end())
         return i.value();
 
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end()) {
+    if (!eventlist.contains(id)) {
         m_sum[id]=0;
         return 0;
     }
-    QVector<EventList *> & evec=j.value();
-
-    double gain,sum=0;
-    EventStoreType * dptr, * eptr;
-    int cnt;
-    for (int i=0;i<evec.size();i++) {
-        EventList & ev=*(evec[i]);
-        gain=ev.gain();
-        cnt=ev.count();
-        dptr=ev.rawData();
-        eptr=dptr+cnt;
-
-        for (; dptr < eptr; dptr++) {
-            sum+=double(*dptr) * gain;
-        }
-    }
-    m_sum[id]=sum;
-    return sum;
+    updateChannelSummary(id,false);
+    return m_sum[id];
 }
 
 EventDataType Session::avg(ChannelID id)
@@ -1261,33 +1215,12 @@ EventDataType Session::avg(ChannelID id)
     if (i!=m_avg.end())
         return i.value();
 
-    QHash<ChannelID,QVector<EventList *> >::iterator j=eventlist.find(id);
-    if (j==eventlist.end()) {
+    if (!eventlist.contains(id)) {
         m_avg[id]=0;
         return 0;
     }
-    QVector<EventList *> & evec=j.value();
-
-    double val=0,gain;
-    int cnt=0;
-    EventStoreType * dptr, * eptr;
-    for (int i=0;i<evec.size();i++) {
-        EventList & ev=*(evec[i]);
-        dptr=ev.rawData();
-        gain=ev.gain();
-        cnt=ev.count();
-        eptr=dptr+cnt;
-
-        for (; dptr < eptr; dptr++) {
-            val+=double(*dptr) * gain;
-        }
-    }
-
-    if (cnt>0) { // Shouldn't really happen.. Should aways contain data
-        val/=double(cnt);
-    }
-    m_avg[id]=val;
-    return val;
+    updateChannelSummary(id,false);
+    return m_avg[id];
 }
 EventDataType Session::cph(ChannelID id) // count per hour
 {
@@ -1313,55 +1246,57 @@ EventDataType Session::sph(ChannelID id) // sum per hour, assuming id is a time
     return val;
 }
 
-bool sortfunction (EventStoreType i,EventStoreType j) { return (i<j); }
-
 EventDataType Session::percentile(ChannelID id,EventDataType percent)
 {
+    EventDataType result=0;
+    percentiles(id,1,&percent,&result);
+    return result;
+}
+
+void Session::percentiles(ChannelID id, int num, const EventDataType * percents, EventDataType * results)
+{
+    for (int i=0;i<num;i++) {
+        results[i]=0;
+    }
+
     QHash<ChannelID,QVector<EventList *> >::iterator jj=eventlist.find(id);
     if (jj==eventlist.end())
-        return 0;
+        return;
     QVector<EventList *> & evec=jj.value();
 
-    if (percent > 1.0) {
-        qWarning() << "Session::percentile() called with > 1.0";
-        return 0;
-    }
-
     int size=evec.size();
     if (size==0)
-        return 0;
-
-    QVector<EventStoreType> array;
-
-    EventDataType gain=evec[0]->gain();
+        return;
 
-    EventStoreType * dptr, * sptr, *eptr;
+    for (int i=0;i<num;i++) {
+        if (percents[i] > 1.0) {
+            qWarning() << "Session::percentile() called with > 1.0";
+            return;
+        }
+    }
 
-    int tt=0,cnt;
+    PercentileEngine * engine=PercentileEngine::local();
     for (int i=0;i<size;i++) {
-        EventList & ev=*evec[i];
-        cnt=ev.count();
-        tt+=cnt;
+        engine->add(evec[i]);
     }
-    array.resize(tt);
 
-    for (int i=0;i<size;i++) {
-        EventList & ev=*evec[i];
-        sptr=ev.rawData();
-        dptr=array.data();
+    // Assumes gain doesn't change between this channels EventLists
+    EventDataType gain=evec[0]->gain();
 
-        eptr=sptr+cnt;
-        for (; sptr < eptr; sptr++) {
-            *dptr++ = * sptr;
-        }
+    const int max_stack=8;
+    EventStoreType stackraw[max_stack];
+    QVector<EventStoreType> heapraw;
+    EventStoreType * raw=stackraw;
+    if (num > max_stack) {
+        heapraw.resize(num);
+        raw=heapraw.data();
     }
 
-    int n=array.size()*percent;
-    if (n>array.size()-1) n--;
-    nth_element(array.begin(), array.begin()+n, array.end());
-
-    // slack, no averaging.. fixme if this function is ever used..
-    return array[n] * gain;
+    engine->raw(percents,raw,num);
+    for (int i=0;i<num;i++) {
+        // slack, no averaging between neighbouring values
+        results[i]=EventDataType(raw[i]) * gain;
+    }
 }
 
 EventDataType Session::wavg(ChannelID id)
@@ -1409,6 +1344,12 @@ EventList * Session::AddEventList(ChannelID code, EventListType et,EventDataType
     }
     EventList * el=new EventList(et,gain,offset,min,max,rate,second_field);
 
+    // Previously calculated summaries for this channel are now stale.
+    // (Loaders may have set some upfront for fresh sessions, so leave those be)
+    if (s_summaries_valid)
+        clearSummary(code);
+    setChannelDirty(code);
+
     eventlist[code].push_back(el);
     //s_machine->registerChannel(chan);
     return el;
@@ -1418,6 +1359,7 @@ void Session::offsetSession(qint64 offset)
     //qDebug() << "Session starts" << QDateTime::fromTime_t(s_first/1000).toString("yyyy-MM-dd HH:mm:ss");
     s_first+=offset;
     s_last+=offset;
+    if (s_day) spanChanged();
     QHash<ChannelID,quint64>::iterator it;
 
     for (it=m_firstchan.begin();it!=m_firstchan.end();it++) {
@@ -1445,13 +1387,13 @@ void Session::offsetSession(qint64 offset)
 qint64 Session::first() {
     qint64 start=s_first;
     if (s_machine->GetType()==MT_CPAP)
-        start+=qint64(PROFILE.cpap->clockDrift())*1000L;
+        start+=qint64(CalcSettings::currentClockDrift())*1000L;
     return start;
 }
 
 qint64 Session::last() {
     qint64 last=s_last;
     if (s_machine->GetType()==MT_CPAP)
-        last+=qint64(PROFILE.cpap->clockDrift())*1000L;
+        last+=qint64(CalcSettings::currentClockDrift())*1000L;
     return last;
 }
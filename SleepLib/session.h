@@ -10,6 +10,7 @@
 
 #include <QDebug>
 #include <QHash>
+#include <QSet>
 #include <QVector>
 
 #include "SleepLib/machine.h"
@@ -17,6 +18,7 @@
 #include "SleepLib/event.h"
 //class EventList;
 class Machine;
+class Day;
 
 /*! \class Session
     \brief Contains a single Sessions worth of machine event/waveform information.
@@ -53,6 +55,10 @@ public:
     //! \brief Loads the events for this session when requested (only the summaries are loaded at startup)
     bool OpenEvents();
 
+    //! \brief Loads just the stored events, without filling in derived channels like OpenEvents does.
+    //! For a quick read only, so they must be put away with TrashEvents straight after
+    bool PeekEvents();
+
     //! \brief Put the events away until needed again, freeing memory
     void TrashEvents();
 
@@ -90,14 +96,21 @@ public:
     void offsetSession(qint64 d);
 
     //! \brief Just set the start of the timerange without comparing
-    void really_set_first(qint64 d) { s_first=d; }
+    void really_set_first(qint64 d) { s_first=d; if (s_day) spanChanged(); }
 
     //! \brief Just set the end of the timerange without comparing
-    void really_set_last(qint64 d) { s_last=d; }
+    void really_set_last(qint64 d) { s_last=d; if (s_day) spanChanged(); }
+
+    //! \brief Return the start of the timerange, without clock drift adjustment
+    qint64 really_first() { return s_first; }
+
+    //! \brief Return the end of the timerange, without clock drift adjustment
+    qint64 really_last() { return s_last; }
 
     void set_first(qint64 d) {
         if (!s_first) s_first=d;
         else if (d<s_first) s_first=d;
+        if (s_day) spanChanged();
     }
     void set_last(qint64 d) {
         if (d<=s_first) {
@@ -106,6 +119,7 @@ public:
         }
         if (!s_last) s_last=d;
         else if (s_last<d) s_last=d;
+        if (s_day) spanChanged();
     }
 
     //! \brief Return Session Length in decimal hours
@@ -114,12 +128,30 @@ public:
         return t;
     }
 
-    //! \brief Flag this Session as dirty, so Machine object can save it
+    //! \brief Flag this Session as dirty, so Machine object can save it (including all of it's events)
     void SetChanged(bool val) {
         s_changed=val;
+        s_events_changed=val;
         s_events_loaded=val; // dirty hack putting this here
     }
 
+    /*! \brief Flags channel code and everything derived from it as needing recalculation
+        Calculated channels are destroyed, ready for UpdateSummaries to recalculate them,
+        while machine data keeps its EventLists and just loses its cached summaries */
+    void invalidateChannel(ChannelID code);
+
+    //! \brief Flags channel code as having changed EventList data since the last UpdateSummaries
+    void setChannelDirty(ChannelID code) {
+        s_dirty.insert(code);
+        s_events_changed=true;
+    }
+
+    //! \brief Returns true if channel code has changed since the last UpdateSummaries
+    bool channelDirty(ChannelID code) { return s_dirty.contains(code); }
+
+    //! \brief Returns true if this sessions summaries have been calculated or loaded before
+    bool summariesValid() { return s_summaries_valid; }
+
     //! \brief Return this Sessions dirty status
     bool IsChanged() {
         return s_changed;
@@ -147,12 +179,22 @@ public:
     QHash<ChannelID,QHash<EventStoreType, quint32> > m_timesummary;
     QHash<ChannelID,EventDataType> m_gain;
 
+    //! \brief Parameter hash each derived channel was calculated with (see DerivedChannel)
+    QHash<ChannelID,quint32> m_derived;
+
     //! \brief Generates sum and time data for each distinct value in 'code' events..
     void updateCountSummary(ChannelID code);
 
+    /*! \brief Fills any missing count, sum, avg, min, max, first & last caches for channel code
+        in one pass over its EventLists, plus the value & time histograms if requested */
+    void updateChannelSummary(ChannelID code, bool histograms);
+
     //! \brief Destroy any trace of event 'code', freeing any memory if loaded.
     void destroyEvent(ChannelID code);
 
+    //! \brief Throws away all cached summary information for channel code, leaving event data intact
+    void clearSummary(ChannelID code);
+
     // UpdateSummaries may recalculate all these, but it may be faster setting upfront
     void setCount(ChannelID id,int val) { m_cnt[id]=val; }
     void setSum(ChannelID id,EventDataType val) { m_sum[id]=val; }
@@ -216,6 +258,9 @@ public:
     //! \brief Returns (without caching) the requested Percentile of all events of type id
     EventDataType percentile(ChannelID id,EventDataType percentile);
 
+    //! \brief Returns (without caching) num Percentiles of all events of type id, from a single counting pass
+    void percentiles(ChannelID id, int num, const EventDataType * percents, EventDataType * results);
+
     //! \brief Returns true if the channel has events loaded, or a record of a count for when they are not
     bool channelExists(ChannelID name);
 
@@ -231,10 +276,10 @@ public:
     void SetEventFile(QString & filename) { s_eventfile=filename; }
 
     //! \brief Update this sessions first time if it's less than the current record
-    inline void updateFirst(qint64 v) { if (!s_first) s_first=v; else if (s_first>v) s_first=v; }
+    inline void updateFirst(qint64 v) { if (!s_first) s_first=v; else if (s_first>v) s_first=v; if (s_day) spanChanged(); }
 
     //! \brief Update this sessions latest time if it's more than the current record
-    inline void updateLast(qint64 v) { if (!s_last) s_last=v; else if (s_last<v) s_last=v; }
+    inline void updateLast(qint64 v) { if (!s_last) s_last=v; else if (s_last<v) s_last=v; if (s_day) spanChanged(); }
 
     //! \brief Returns (and caches) the first time for Channel code
     qint64 first(ChannelID code);
@@ -250,13 +295,28 @@ public:
 
     //! \brief Returns this sessions MachineID
     Machine * machine() { return s_machine; }
+
+    //! \brief Returns the Day whose interval index this session is in, if any
+    Day * day() { return s_day; }
+
+    //! \brief Sets the Day to tell when this sessions times or enabled state change (Day::AddSession does this)
+    void setDay(Day * day) { s_day=day; }
 protected:
+    //! \brief Lets s_day update its interval index after the time range or enabled state changed
+    void spanChanged();
+
     SessionID s_session;
 
     Machine *s_machine;
+    Day *s_day;
     qint64 s_first;
     qint64 s_last;
     bool s_changed;
+    bool s_events_changed;
+    bool s_summaries_valid;
+
+    //! \brief Channels whose data changed since the last UpdateSummaries
+    QSet<ChannelID> s_dirty;
     bool s_lonesession;
     bool s_evchecksum_checked;
     bool _first_session;
@@ -114,6 +114,7 @@ int main(int argc, char *argv[])
 
     for (int i=1;i<args.size();i++) {
         if (args[i]=="-l") force_login_screen=true;
+        if (args[i]=="-crc16") return CRC16SelfTest() ? 0 : 1;
         if (args[i]=="-p") {
 #ifdef Q_WS_WIN32
             Sleep(1000);
@@ -218,6 +218,7 @@ MainWindow::~MainWindow()
     // Shutdown and Save the current User profile
     Profiles::Done();
     mainwin=NULL;
+    qstatusbar=NULL; // backups finishing late mustn't report to it
     delete ui;
 }
 
@@ -2371,6 +2372,7 @@ void MainWindow::on_actionPurge_Current_Day_triggered()
             QFile::remove(filename0);
             QFile::remove(filename1);
             m->sessionlist.erase(m->sessionlist.find(id)); // remove from machines session list
+            removeMaskLeakHistory(m->id(),id); // and from the nights leak baselines are drawn from
         }
         QList<Day *> & dl=PROFILE.daylist[date];
         QList<Day *>::iterator it;//=dl.begin();
@@ -2522,9 +2524,10 @@ void MainWindow::on_filterBookmarksButton_clicked()
     }
 }
 
-void MainWindow::reprocessEvents(bool restart)
+void MainWindow::reprocessEvents(bool restart, const QList<ChannelID> & channels)
 {
     m_restartRequired=restart;
+    m_reprocessChannels=channels;
     QTimer::singleShot(0,this,SLOT(doReprocessEvents()));
 }
 
@@ -2554,76 +2557,45 @@ void MainWindow::doReprocessEvents()
     m_inRecalculation=true;
     QDate first=PROFILE.FirstDay();
     QDate date=PROFILE.LastDay();
-    Session *sess;
     Day *day;
-    //FlowParser flowparser;
 
     mainwin->Notify("Performance will be degraded during these recalculations.","Recalculating Indices");
 
-    // For each day in history
-    int daycount=first.daysTo(date);
-    int idx=0;
-
-    QList<Machine *> machines=PROFILE.GetMachines(MT_CPAP);
-
-    // Disabling multithreaded save as it appears it's causing problems
-    bool cache_sessions=false; //PROFILE.session->cacheSessions();
-    if (cache_sessions) { // Use multithreaded save to handle reindexing.. (hogs memory like hell)
-        qstatus->setText(tr("Loading Event Data"));
-    } else {
-        qstatus->setText(tr("Recalculating Summaries"));
-    }
+    qstatus->setText(tr("Recalculating Summaries"));
     if (qprogress) {
         qprogress->setValue(0);
         qprogress->setVisible(true);
     }
-    bool isopen;
+    // Without specific channels, redo the lot, and rewrite every events file
+    bool rewrite=m_reprocessChannels.isEmpty();
+    QList<ChannelID> channels=m_reprocessChannels;
+    if (rewrite) {
+        channels.push_back(CPAP_UserFlag1);
+        channels.push_back(CPAP_UserFlag2);
+        channels.push_back(CPAP_UserFlag3);
+        channels.push_back(CPAP_AHI);
+        channels.push_back(CPAP_RDI);
+    }
+
+    // Sessions are independent, so queue the lot and let the pipeline spread them over the cores,
+    // putting events away again afterwards unless they were already loaded. The day on display
+    // stays on this thread, and no events get processed until the workers are finished
+    QDate current=daily->getDate();
+    SessionPipeline pipeline;
+    pipeline.setInvalidate(channels);
+    pipeline.setRewrite(rewrite);
+    pipeline.setTrashMode(SessionPipeline::TrashOpened);
     do {
         day=PROFILE.GetDay(date,MT_CPAP);
         if (day) {
             for (int i=0;i<day->size();i++) {
-                sess=(*day)[i];
-                isopen=sess->eventsLoaded();
-
-                // Load the events if they aren't loaded already
-                sess->OpenEvents();
-
-                //if (!sess->channelDataExists(CPAP_FlowRate)) continue;
-
-                //QVector<EventList *> & flowlist=sess->eventlist[CPAP_FlowRate];
-
-                // Destroy any current user flags..
-                sess->destroyEvent(CPAP_UserFlag1);
-                sess->destroyEvent(CPAP_UserFlag2);
-                sess->destroyEvent(CPAP_UserFlag3);
-
-                // AHI flags
-                sess->destroyEvent(CPAP_AHI);
-                sess->destroyEvent(CPAP_RDI);
-
-                sess->SetChanged(true);
-                if (!cache_sessions) {
-                    sess->UpdateSummaries();
-                    sess->machine()->SaveSession(sess);
-                    if (!isopen)
-                        sess->TrashEvents();
-                }
+                pipeline.add((*day)[i], date==current);
             }
         }
         date=date.addDays(-1);
-       // if (qprogress && (++idx % 10) ==0) {
-            qprogress->setValue(0+(float(++idx)/float(daycount)*100.0));
-            QApplication::processEvents();
-       // }
-
     } while (date>=first);
 
-    if (cache_sessions) {
-        qstatus->setText(tr("Recalculating Summaries"));
-        for (int i=0;i<machines.size();i++) {
-            machines.at(i)->Save();
-        }
-    }
+    pipeline.run(qprogress, PROFILE.session->multithreading());
 
     qstatus->setText(tr(""));
     qprogress->setVisible(false);
@@ -2636,7 +2608,6 @@ void MainWindow::doReprocessEvents()
         Notify("Recalculations are now complete.","Task Completed");
 
         FreeSessions();
-        QDate current=daily->getDate();
         daily->LoadDate(current);
         if (overview) overview->ReloadGraphs();
     }
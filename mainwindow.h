@@ -138,8 +138,10 @@ public:
 
     void sendStatsUrl(QString msg) { on_recordsBox_linkClicked(QUrl(msg)); }
 
-    //! \brief Sets up recalculation of all event summaries and flags
-    void reprocessEvents(bool restart=false);
+    /*! \brief Sets up recalculation of event summaries and flags
+        \param channels Channels to recalculate (along with anything derived from them).
+               If empty, the user flags and AHI graphs are recalculated, and all event data rewritten. */
+    void reprocessEvents(bool restart=false, const QList<ChannelID> & channels=QList<ChannelID>());
 
 public slots:
     //! \brief Recalculate all event summaries and flags
@@ -315,6 +317,7 @@ private:
     gGraphView *SnapshotGraph;
     QString bookmarkFilter;
     bool m_restartRequired;
+    QList<ChannelID> m_reprocessChannels;
     volatile bool m_inRecalculation;
 };
 
@@ -1041,7 +1041,7 @@ void Oximetry::on_RunButton_toggled(bool checked)
         SPO2->setRecMinY(90);
         SPO2->setRecMaxY(100);
 
-        day->getSessions().clear();
+        day->clearSessions();
         //QTimer::singleShot(10000,this,SLOT(oximeter_running_check()));
         if (!oximeter->startLive()) {
             mainwin->Notify(tr("Oximetry Error!\n\nSomething is wrong with the device connection."));
@@ -1171,7 +1171,7 @@ void Oximetry::oximeter_running_check()
         if (oximeter->mode()==SO_LIVE) oximeter->stopLive();
 
         oximeter->destroySession();
-        day->getSessions().clear();
+        day->clearSessions();
         ui->SerialPortsCombo->setEnabled(true);
         qstatus->setText(tr("Ready"));
         ui->ImportButton->setEnabled(true);
@@ -1191,7 +1191,7 @@ void Oximetry::on_ImportButton_clicked()
     connect(oximeter,SIGNAL(updateProgress(float)),this,SLOT(update_progress(float)));
 
     PLETHY->setVisible(false);
-    day->getSessions().clear();
+    day->clearSessions();
     GraphView->setDay(day);
     GraphView->setEmptyText("Make Sure Oximeter Is Ready");
     GraphView->redraw();
@@ -1237,7 +1237,7 @@ void Oximetry::import_finished()
 void Oximetry::import_aborted()
 {
     oximeter->disconnect(oximeter,SIGNAL(importProcess()),0,0);
-    day->getSessions().clear();
+    day->clearSessions();
     //QMessageBox::warning(mainwin,tr("Oximeter Error"),tr("Please make sure your oximeter is switched on, and able to transmit data.\n(You may need to enter the oximeters Settings screen for it to be able to transmit.)"),QMessageBox::Ok);
     mainwin->Notify(tr("Please make sure your oximeter is switched on, and in the right mode to transmit data."),tr("Oximeter Error!"),5000);
     //qDebug() << "Oximetry import failed";
@@ -1322,7 +1322,7 @@ void Oximetry::on_saveButton_clicked()
         m->AddSession(session,p_profile);
 
         oximeter->getMachine()->Save();
-        day->getSessions().clear();
+        day->clearSessions();
 
         mainwin->getDaily()->LoadDate(mainwin->getDaily()->getDate());
         mainwin->getOverview()->ReloadGraphs();
@@ -1360,7 +1360,7 @@ bool Oximetry::openSPOFile(QString filename)
     if (date.date().year()<2000) date=date.addYears(100);
     //ui->dateEdit->setDateTime(date);
 
-    day->getSessions().clear();
+    day->clearSessions();
     oximeter->createSession(date);
     Session *session=oximeter->getSession();
     day->AddSession(session);
@@ -1442,7 +1442,7 @@ bool Oximetry::openSPORFile(QString filename)
     QDateTime date=QDateTime::fromString(dstr,"MM/dd/yy HH:mm:ss");
     if (date.date().year()<2000) date=date.addYears(100);
 
-    day->getSessions().clear();
+    day->clearSessions();
     oximeter->createSession(date);
     Session *session=oximeter->getSession();
     day->AddSession(session);
@@ -1562,7 +1562,7 @@ void Oximetry::openSession(Session * session)
         }
     } // else it's already saved.
 
-    day->getSessions().clear();
+    day->clearSessions();
     day->AddSession(session);
 
     oximeter->setSession(session);
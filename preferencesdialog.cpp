@@ -292,8 +292,16 @@ bool PreferencesDialog::Save()
 {
     bool recalc_events=false;
     bool needs_restart=false;
+    bool rewrite_events=false;
 
-    if (ui->ahiGraphZeroReset->isChecked()!=profile->cpap->AHIReset()) recalc_events=true;
+    // Channels to be recalculated
+    QList<ChannelID> recalc_channels;
+
+    if (ui->ahiGraphZeroReset->isChecked()!=profile->cpap->AHIReset()) {
+        recalc_events=true;
+        recalc_channels.push_back(CPAP_AHI);
+        recalc_channels.push_back(CPAP_RDI);
+    }
 
     if (ui->useSquareWavePlots->isChecked()!=profile->appearance->squareWavePlots()) {
         needs_restart=true;
@@ -316,8 +324,10 @@ bool PreferencesDialog::Save()
     if (profile->cpap->userEventFlagging() &&
        (profile->cpap->userEventDuration()!=ui->apneaDuration->value() ||
         profile->cpap->userEventDuplicates()!=ui->userEventDuplicates->isChecked() ||
-        profile->cpap->userFlowRestriction()!=ui->apneaFlowRestriction->value()))
+        profile->cpap->userFlowRestriction()!=ui->apneaFlowRestriction->value())) {
         recalc_events=true;
+        recalc_channels.push_back(CPAP_UserFlag1);
+    }
 
     // Restart if turning user event flagging on/off
     if (profile->cpap->userEventFlagging()!=ui->customEventGroupbox->isChecked()) {
@@ -326,10 +336,17 @@ bool PreferencesDialog::Save()
             needs_restart=true;
         //} else
             recalc_events=true;
+            recalc_channels.push_back(CPAP_UserFlag1);
     }
 
-    if (profile->session->compressSessionData()!=ui->compressSessionData->isChecked())
+    if (profile->session->compressSessionData()!=ui->compressSessionData->isChecked()) {
         recalc_events=true;
+        rewrite_events=true;
+    }
+
+    // An empty list makes reprocessEvents redo the lot and rewrite all event data
+    if (rewrite_events)
+        recalc_channels.clear();
 
     if (recalc_events) {
         if (PROFILE.countDays(MT_CPAP,PROFILE.FirstDay(),PROFILE.LastDay())>0) {
@@ -489,7 +506,7 @@ bool PreferencesDialog::Save()
 
     if (recalc_events) {
         // send a signal instead?
-        mainwin->reprocessEvents(needs_restart);
+        mainwin->reprocessEvents(needs_restart,recalc_channels);
     } else if (needs_restart) {
         mainwin->RestartApplication();
     } else {